@@ -14,6 +14,9 @@
  * 1.3:		added Lightwave object support
  * 1.4:		added animating object support
  * 1.5:		added C output format
+ *
+ * This file just handles the command line; the converter
+ * itself is in convert.c.
  */
 
 #include <stdio.h>
@@ -21,68 +24,27 @@
 #include <string.h>
 #include <ctype.h>
 
-#ifdef __DUMB_MSDOS__
-#include <alloc.h>
-#define mymalloc farmalloc
-#define myfree farfree
-#else
-#define mymalloc malloc
-#define myfree free
-#endif
-
-#ifndef _WIN32
-#define stricmp strcasecmp
-#else
-#define strdup _strdup
-#define stricmp _stricmp
-#endif
-
 #include "internal.h"
 #include "proto.h"
 
-#define VERSION "1.5"
 #define DEFAULT_PROGNAME	"3dsconv"
 char *progname;		/* the program's name */
 
-/* global variables settable by the user */
-int	output_format;
-#define FORMAT_JAG	0		/* old output format */
-#define	FORMAT_N3D	1		/* new output format */
-#define FORMAT_ANIM	2		/* new output format + animation info */
-#define FORMAT_C	3		/* C file output format, integer */
-#define FORMAT_CFLOAT	4		/* C file output format, floating point */
-
-char 	*defaultlabel;			/* label for the object data */
-char 	*outfilename = (char *)0;	/* name of the output file */
-char 	*infilename;			/* name of the input file */
-int	merge_tris;			/* merge triangles into polygons if 1, don't if 0 */
-int	verbose;			/* report lots of things about what we're doing if 1, be quiet if 0 */
-int	usedataseg;			/* whether to use the data segment (1) or text segment (0) */
-int	outputheader;			/* whether to output .include commands */
-int	clabels;			/* output C style labels (i.e. with underbars) if this is 1 */
-int	multiobject;			/* output a multiple object header (1) or just 1 object (0) */
-int	animflag;			/* include animation data (1) or not (0) */
-
-double	uscale;				/* user specified scale factor */
-double	pointdelta;			/* if points are less than pointdelta apart, they are
-					 * merged
-					 */
-double facedelta;			/* if face normals are less than this much apart, they
-					 * can be merged
-					 */
-
-/* Global variables */
-char *filepath;				/* path where the .3ds file is found */
-
 void
 usage( char *errmsg )
 {
 	if (errmsg)
 		fprintf(stderr, "%s\n", errmsg);
 	fprintf(stderr, "%s Version %s\n", progname, VERSION);
-	fprintf(stderr, "Usage: %s [-o outfile][-l label][-f format][-scale scale] {options} inputfile\n", progname);
+	fprintf(stderr, "Usage: %s [-o outfile][-l label][-f format][-scale scale][-j threads] {options} inputfile...\n", progname);
+	fprintf(stderr, "   or: %s [-manifest file] {options} [inputfile...]\n", progname);
 	fprintf(stderr, "Valid options are:\n");
+	fprintf(stderr, "  -cache dir:     Save conversions in 'dir', and reuse them when nothing has changed\n");
 	fprintf(stderr, "  -clabels:       Add an underbar to labels (default for -f new)\n");
+	fprintf(stderr, "  -compact:       Pack the faces and points into as few lines as possible, without comments\n");
+	fprintf(stderr, "  -manifest file: Convert the files listed in 'file', one per line, each with its own options\n");
+	fprintf(stderr, "  -maxmerge:      Merge as many faces as possible, into polygons with up to %d sides\n", MAXVERTICES);
+	fprintf(stderr, "  -model file:    Also save the finished model in 'file', to convert to other formats later\n");
 	fprintf(stderr, "  -multiobj:      Output multiple objects, rather than merging all named objects\n");
 	fprintf(stderr, "  -noclabels:     Do not add an underbar to labels (default for -f old)\n");
 	fprintf(stderr, "  -noheader:      Do not output .data header or .include commands at start of file\n");
@@ -96,357 +58,335 @@ usage( char *errmsg )
 	fprintf(stderr, "  old or j3d:     Original jaguar 3D library format\n");
 	fprintf(stderr, "  cf or cfloat:   C data, using float, file\n");
 	fprintf(stderr, "  c or c3d:       C data file\n");
+	fprintf(stderr, "  bin or b3d:     New 3D library format, as binary data with an assembler stub\n");
+	fprintf(stderr, "  abin:           Animation format, as binary data with an assembler stub\n");
 	exit(1);
 }
 
-int
-main(int argc, char **argv)
-{
-	char wkstr[256];
-	int i, retval;
-	char *extension;
+/*
+ * one file to convert; with more than one, they are
+ * converted in parallel
+ */
+typedef struct batchjob {
+	Converter cv;			/* options for this file */
+	int retval;			/* result of converting it */
+} BatchJob;
 
-	pointdelta = 1.0;
-	facedelta = 0.01;
-	merge_tris = 1;
-	uscale = 1.0;
-	output_format = FORMAT_N3D;
-	verbose = 0;
-	usedataseg = 1;
-	outputheader = 1;
-	clabels = -1;	/* a default value, overridden later */
-	multiobject = 0;
-	animflag = 0;
+#define MAXMANIFESTARGS	64		/* most words on one manifest line */
 
-	progname = *argv++;
-	if (!*progname) {				/* if for some reason the runtime library didn't get our name... */
-		progname = DEFAULT_PROGNAME;		/* assume this is our name */
-	}
-	argc--;
-	if (!*argv) {
-		usage( (char *)0 );		/* program invoked with no arguments */
-	}
-	while (*argv) {
+/*
+ * parse the options at the start of *argvp into cv, leaving
+ * *argvp pointing at the first argument that isn't an option.
+ * manifest is where to put a -manifest file name, or 0 if
+ * these options come from a manifest (where -j and -manifest
+ * aren't allowed).
+ * returns: 0 on success, otherwise an error message (which
+ * may be in wkstr)
+ */
+static char *
+getoptions(Converter *cv, char ***argvp, char **manifest, char *wkstr)
+{
+	char **argv = *argvp;
+	char *err = 0;
+
+	while (*argv && !err) {
 		if (**argv != '-') break;
 		if (!strcmp(*argv, "-o")) {
-			argv++; argc--;
-			if (!*argv) {
-				usage( "No output file name given with '-o'\n" );
-			}
-			outfilename = *argv;
+			argv++;
+			if (!*argv)
+				return "No output file name given with '-o'\n";
+			cv->outfilename = *argv;
 		} else if (!strcmp(*argv, "-l")) {
-			argv++; argc--;
-			if (!*argv) {
-				usage( "No label name given with '-l'\n" );
-			}
-			defaultlabel = *argv;
+			argv++;
+			if (!*argv)
+				return "No label name given with '-l'\n";
+			cv->defaultlabel = *argv;
 		} else if (!strcmp(*argv, "-f")) {
-			argv++; argc--;
-			if (!*argv) {
-				usage( "No format type given with '-f'\n" );
-			}
+			argv++;
+			if (!*argv)
+				return "No format type given with '-f'\n";
 			if (!strcmp(*argv, "new") || !strcmp(*argv, "n3d"))
-				output_format = FORMAT_N3D;
+				cv->output_format = FORMAT_N3D;
 			else if (!strcmp(*argv, "old") || !strcmp(*argv, "j3d"))
-				output_format = FORMAT_JAG;
+				cv->output_format = FORMAT_JAG;
 			else if (!strcmp(*argv, "cf") || !strcmp(*argv, "cfloat"))
-				output_format = FORMAT_CFLOAT;
+				cv->output_format = FORMAT_CFLOAT;
 			else if (!strcmp(*argv, "c") || !strcmp(*argv, "c3d"))
-				output_format = FORMAT_C;
-			else if (!strcmp(*argv, "anim") || !strcmp(*argv, "a3d")) {
-				output_format = FORMAT_ANIM;
-				animflag = multiobject = 1;
-			} else
-				usage( "Unknown format type given after '-f'\n" );
+				cv->output_format = FORMAT_C;
+			else if (!strcmp(*argv, "anim") || !strcmp(*argv, "a3d"))
+				cv->output_format = FORMAT_ANIM;
+			else if (!strcmp(*argv, "bin") || !strcmp(*argv, "b3d"))
+				cv->output_format = FORMAT_BIN;
+			else if (!strcmp(*argv, "abin"))
+				cv->output_format = FORMAT_ABIN;
+			else
+				return "Unknown format type given after '-f'\n";
 		} else if (!strcmp(*argv, "-scale")) {
-			argv++; argc--;
-			if (!*argv) {
-				usage( "No scale factor given with '-scale'\n" );
-			}
-			uscale = atof(*argv);
+			argv++;
+			if (!*argv)
+				return "No scale factor given with '-scale'\n";
+			cv->uscale = atof(*argv);
+		} else if (!manifest && (!strcmp(*argv, "-j") || !strcmp(*argv, "-manifest"))) {
+			sprintf( wkstr, "'%s' can't be used in a manifest\n", *argv );
+			err = wkstr;
+		} else if (!strcmp(*argv, "-j")) {
+			argv++;
+			if (!*argv)
+				return "No thread count given with '-j'\n";
+			cv->numthreads = atoi(*argv);
+			if (cv->numthreads < 1)
+				cv->numthreads = 1;
+		} else if (!strcmp(*argv, "-manifest")) {
+			argv++;
+			if (!*argv)
+				return "No file name given with '-manifest'\n";
+			*manifest = *argv;
+		} else if (!strcmp(*argv, "-cache")) {
+			argv++;
+			if (!*argv)
+				return "No directory given with '-cache'\n";
+			cv->cachedir = *argv;
+		} else if (!strcmp(*argv, "-model")) {
+			argv++;
+			if (!*argv)
+				return "No file name given with '-model'\n";
+			cv->modelname = *argv;
+		} else if (!strncmp(*argv, "-comp", 5)) {
+			cv->compact = 1;
+		} else if (!strncmp(*argv, "-maxm", 5)) {
+			cv->maxmerge = 1;
 		} else if (!strncmp(*argv, "-tri", 4)) {
-			merge_tris = 0;
+			cv->merge_tris = 0;
 		} else if (!strcmp(*argv, "-textseg")) {
-			usedataseg = 0;
+			cv->usedataseg = 0;
 		} else if (!strncmp(*argv, "-v", 2)) {
-			verbose = 1;
+			cv->verbose = 1;
 		} else if (!strncmp(*argv, "-clabel", 5)) {
-			clabels = 1;
+			cv->clabels = 1;
 		} else if (!strncmp(*argv, "-noclabel", 6)) {
-			clabels = 0;
+			cv->clabels = 0;
 		} else if (!strncmp(*argv, "-noheader", 6)) {
-			outputheader = 0;
+			cv->outputheader = 0;
 		} else if (!strncmp(*argv, "-multio", 6)) {
-			multiobject = 1;
+			cv->multiobject = 1;
 		} else {
-			sprintf( wkstr, "Illegal option given: '%s'\n", *argv );
-			usage(wkstr);		/* illegal option */
+			sprintf( wkstr, "Illegal option given: '%.200s'\n", *argv );
+			err = wkstr;		/* illegal option */
 		}
-		argv++; argc--;
-	}
-	if (argc != 1) {		/* should be exactly one argument left, the input file name */
-		usage( "Exactly one input file must be specified\n" );
-	}
-	infilename = *argv;
-	if (!outfilename) {
-		if (output_format == FORMAT_JAG)
-			outfilename = change_extension(infilename, ".j3d");
-		else if (output_format == FORMAT_ANIM)
-			outfilename = change_extension(infilename, ".a3d");
-		else if (output_format == FORMAT_C || output_format == FORMAT_CFLOAT)
-			outfilename = change_extension(infilename, ".c");
-		else
-			outfilename = change_extension(infilename, ".n3d");
-	}
-
-	/* if neither -clabels nor -noclabels was given explicitly, default to
-	 * C style labels for new output format, and non-C style for the old
-	 * output format
-	 */
-	if (clabels == -1) {		/* option wasn't explicitly given by the user */
-		clabels = (output_format == FORMAT_JAG) ? 0 : 1;
-	}
-
-	filepath = strdup(infilename);
-	/* replace the last path separator with a null */
-	/* also, if no label has been specified, make one out
-	 * of the file name
-	 */
-	{
-		char *s;
-		char *filelabel;
-
-		s = strrchr(filepath, '\\');
-		if (!s)
-			s = strrchr(filepath, '/');
-		if (!s)
-			s = strrchr(filepath, ':');
-
-		if (s) {
-			++s;
-			filelabel = name2label(s);
-			*s = 0;
-		} else {
-			filelabel = name2label(filepath);
-			*filepath = 0;
-		}
-		if (!defaultlabel) {
-			defaultlabel = mymalloc(strlen(filelabel)+1);
-			strcpy(defaultlabel, filelabel);
-		}
-	}
-
-	extension  = strrchr(infilename, '.');
-
-	/* Assume 3D Studio as default */
-	if (!extension) extension = "3ds";
-	else extension++;
-
-	if (!stricmp(extension, "lw") || !stricmp(extension, "lwob"))
-		retval = readlwfile(infilename);
-	else
-		retval = read3dsfile(infilename);
-
-	if (retval)
-		return 1;
-
-
-	if (verbose)
-		fprintf(stdout, "Merging vertices\n");
-
-	for (i = 0; i < numObjs; i++)
-		MergeVertices( &objtab[i] );
-
-	/* calculate all vertex normals */
-	if (verbose)
-		fprintf(stdout, "Calculating vertex normals\n");
-	for (i = 0; i < numObjs; i++)
-		CalcVertexNormals( &objtab[i] );
-
-	if (merge_tris) {
-		if (verbose)
-			fprintf(stdout, "Merging faces\n");
-		for (i = 0; i < numObjs; i++)
-			MergeFaces( &objtab[i] );
+		argv++;
 	}
-
-	for (i = 0; i < numObjs; i++)
-		CheckUncoloredFaces( &objtab[i] );
-
-	return write_output_file( outfilename );
-//	return 0;
+	*argvp = argv;
+	return err;
 }
 
-/*************************************************************************
-change_extension(name, ext): creates a duplicate string, containing the
-given file name but with its extension changed to ext; if the file had
-no extension, one is added.
-ext must contain the appropriate '.' character
-**************************************************************************/
-
-char *
-change_extension(char *name, char *ext)
+/*
+ * add a job for a file to the list
+ * returns: 0 on success, otherwise -1
+ */
+static int
+addjob(BatchJob **jobs, int *numjobs, int *maxjobs, Converter *cv)
 {
-	char *s;		/* temporary string pointer */
-	size_t len;		/* length of the string */
-	size_t extpos;		/* position where the extension is to be added */
-	char *newname;
-
-	len = extpos = 0;
+	BatchJob *newjobs;
 
-	for (s = name; *s; s++) {
-		if (*s == '\\' || *s == '/') {		/* account for both UNIX and DOS path separators */
-			extpos = 0;			/* no extension yet, the name isn't finished */
-		} else if (*s == '.') {
-			extpos = len;
+	if (*numjobs == *maxjobs) {
+		newjobs = realloc(*jobs, (*maxjobs + 32) * sizeof(BatchJob));
+		if (!newjobs) {
+			fprintf(stderr, "%s: insufficient memory\n", progname);
+			return -1;
 		}
-		len++;
-	}
-	if (extpos == 0)
-		extpos = len;
-
-	newname = mymalloc(len+strlen(ext)+1);		/* the "+1" is for the trailing 0 */
-	if (!newname) {
-		fprintf(stderr, "Fatal error: insufficient memory\n");
-		exit(1);
+		*jobs = newjobs;
+		*maxjobs += 32;
 	}
-	strcpy(newname, name);
-	strcpy(newname+extpos, ext);
-	return newname;
+	(*jobs)[*numjobs].cv = *cv;
+	(*jobs)[*numjobs].retval = 0;
+	(*numjobs)++;
+	return 0;
 }
 
-
 /*
- * converts a file name (fname) into a label
+ * read a manifest: each line names an input file, optionally
+ * preceded by options for it, which are added to the ones
+ * given on the command line (base). Blank lines, and lines
+ * starting with '#', are ignored; file names with spaces in
+ * them can be put in double quotes.
+ * The words of the manifest point into *textp, which must be
+ * kept until the conversions are done.
+ * returns: 0 on success, otherwise -1
  */
-
-char *
-name2label( char *fname )
+static int
+readmanifest(char *fname, Converter *base, char **textp,
+	     BatchJob **jobs, int *numjobs, int *maxjobs)
 {
-	static char buf[128];
-	char *s = buf;
-	char c;
+	FILE *f;
+	char *text, *p, *line, *eol, *err;
+	long size;
+	int lineno;
+	char *args[MAXMANIFESTARGS+1];
+	char **argv;
+	int nargs;
+	Converter cv;
+	char wkstr[256];
 
-	if (output_format == FORMAT_C || output_format == FORMAT_CFLOAT) {
-		*s++ = 'C';
-		*s++ = '3';
-		*s++ = 'D';
-		*s++ = '_';
-	} else if (clabels)
-		*s++ = '_';
-	while (*fname && *fname != '.') {
-		c = *fname++;
-		if (c == ' ' || c == '-')
-			c = '_';
+	f = fopen(fname, "rb");
+	if (!f) {
+		perror(fname);
+		return -1;
+	}
+	fseek(f, 0L, SEEK_END);
+	size = ftell(f);
+	rewind(f);
+	text = malloc(size + 1);
+	if (!text) {
+		fprintf(stderr, "%s: insufficient memory\n", progname);
+		fclose(f);
+		return -1;
+	}
+	if (size < 0 || fread(text, 1, size, f) != (size_t)size) {
+		fprintf(stderr, "%s: error reading %s\n", progname, fname);
+		fclose(f);
+		free(text);
+		return -1;
+	}
+	fclose(f);
+	text[size] = 0;
+	*textp = text;
+
+	for (lineno = 1, line = text; *line; lineno++, line = eol) {
+		eol = strchr(line, '\n');
+		if (eol)
+			*eol++ = 0;
 		else
-			c = tolower(c);
-		*s++ = c;
+			eol = line + strlen(line);
+
+		/* split the line into words, in place */
+		p = line;
+		nargs = 0;
+		for (;;) {
+			while (isspace((unsigned char)*p))
+				p++;
+			if (*p == 0 || (*p == '#' && nargs == 0))
+				break;
+			if (nargs == MAXMANIFESTARGS) {
+				fprintf(stderr, "%s, line %d: too many words\n", fname, lineno);
+				return -1;
+			}
+			if (*p == '"') {
+				args[nargs++] = ++p;
+				while (*p && *p != '"')
+					p++;
+				if (*p != '"') {
+					fprintf(stderr, "%s, line %d: missing '\"'\n", fname, lineno);
+					return -1;
+				}
+			} else {
+				args[nargs++] = p;
+				while (*p && !isspace((unsigned char)*p))
+					p++;
+			}
+			if (*p == 0)
+				break;
+			*p++ = 0;
+		}
+		if (nargs == 0)
+			continue;
+		args[nargs] = 0;
+
+		cv = *base;
+		argv = args;
+		err = getoptions(&cv, &argv, 0, wkstr);
+		if (!err && (!argv[0] || argv[1]))
+			err = "Exactly one input file must be specified\n";
+		if (err) {
+			fprintf(stderr, "%s, line %d: %s", fname, lineno, err);
+			return -1;
+		}
+		cv.infilename = argv[0];
+		if (addjob(jobs, numjobs, maxjobs, &cv) != 0)
+			return -1;
 	}
-	*s++ = 0;
-	return buf;
+	return 0;
 }
 
-/*************************************************************************
-write_output_file(): write out appropriate headers, and then the
-object(s)
-**************************************************************************/
+static void
+convertjob(void *arg, int i)
+{
+	BatchJob *job = (BatchJob *)arg + i;
+
+	job->retval = ConvertFile(&job->cv);
+	FreeConverter(&job->cv);
+}
 
 int
-write_output_file( char *outfname )
+main(int argc, char **argv)
 {
-	int ret;
-	int (*writefile)(FILE *, Object *);
+	char wkstr[256];
+	char *err;
+	char *manifest = 0;
+	char *manifesttext = 0;
+	int retval;
 	int i;
-	FILE *f;
-	Object *rootobj;
-
-	f = fopen(outfname, "w");
-	if (!f) {
-		perror(outfname);
-		return 1;
-	}
-
-	if (output_format == FORMAT_JAG) {
-		fprintf(f, ";*========================================\n");
-		fprintf(f, "; .JAG/.J3D format file\n");
-		fprintf(f, ";*========================================\n\n");
+	Converter cv;
+	BatchJob *jobs = 0;
+	int numjobs = 0, maxjobs = 0;
+	TexCache *texcache = 0;
 
-		writefile = JAGwritefile;
-	} else if (output_format == FORMAT_ANIM) {
-		fprintf(f, ";*========================================\n");
-		fprintf(f, "; 3D Animation Data File\n");
-		fprintf(f, ";*========================================\n\n");
+	InitConverter(&cv);
 
-		writefile = N3Dwritefile;
-	} else if (output_format == FORMAT_C) {
-		fprintf(f, "/*========================================\n");
-		fprintf(f, "  3D Library Data File\n");
-		fprintf(f, " *=======================================*/\n\n");
-
-		writefile = Cwritefile;
-	} else if (output_format == FORMAT_CFLOAT) {
-		fprintf(f, "/*========================================\n");
-		fprintf(f, "  3D Library Data File\n");
-		fprintf(f, " *=======================================*/\n\n");
-
-		writefile = CFwritefile;
-	} else {
-		fprintf(f, ";*========================================\n");
-		fprintf(f, "; 3D Library Data File\n");
-		fprintf(f, ";*========================================\n\n");
+	progname = *argv++;
+	if (!*progname) {				/* if for some reason the runtime library didn't get our name... */
+		progname = DEFAULT_PROGNAME;		/* assume this is our name */
+	}
+	cv.progname = progname;
+	if (!*argv) {
+		usage( (char *)0 );		/* program invoked with no arguments */
+	}
+	if ((err = getoptions(&cv, &argv, &manifest, wkstr)) != 0)
+		usage(err);
 
-		writefile = N3Dwritefile;
+	/* the rest of the arguments are input files */
+	if (!*argv && !manifest) {
+		usage( "No input file specified\n" );
 	}
-	if (output_format == FORMAT_C) {
-		fprintf(f, "#include \"c3d.h\"\n");
-	} else if (output_format == FORMAT_CFLOAT) {
-		fprintf(f, "#define USE_FLOAT\n");
-		fprintf(f, "#include \"c3d.h\"\n");
-	} else {
-		if (outputheader) {
-			fprintf(f, "\n\t.include\t'jaguar.inc'\n\n");
-			if (usedataseg)
-				fprintf(f, "\t.data\n");
+	for (; *argv; argv++) {
+		if (**argv == '-') {
+			usage( "Options must come before the input files\n" );
 		}
-		fprintf(f, "\t.globl\t%sdata\n",defaultlabel);
-		fprintf(f, "%sdata:\n", defaultlabel);
+		cv.infilename = *argv;
+		if (addjob(&jobs, &numjobs, &maxjobs, &cv) != 0)
+			return 1;
+	}
+	cv.infilename = 0;
+	if (manifest && readmanifest(manifest, &cv, &manifesttext, &jobs, &numjobs, &maxjobs) != 0)
+		return 1;
+	if (cv.outfilename && numjobs > 1) {
+		usage( "'-o' can only be used with a single input file\n" );
+	}
+	if (cv.modelname && numjobs > 1) {
+		usage( "'-model' can only be used with a single input file\n" );
 	}
 
-	if (animflag && (output_format == FORMAT_N3D || output_format == FORMAT_ANIM)) {
-		rootobj = FixObjectLists();
-		fprintf(f, "\t.dc.l\t.%s\t; pointer to root object\n", name2label(rootobj->name));
-		for (i = 0; i < numObjs; i++) {
-			Object *obj;
-
-			/* remember down below that name2label uses a static buffer;
-			   don't try to optimize the calls to it
-			 */
-			fprintf(f, ".%s:\n", name2label(objtab[i].name));
-			fprintf(f, "\t.dc.l\t.%s_data\n", name2label(objtab[i].name));
-			fprintf(f, "\t.dc.w\t$4000, 0, 0\n");
-			fprintf(f, "\t.dc.w\t0, $4000, 0\n");
-			fprintf(f, "\t.dc.w\t0, 0, $4000\n");
-			fprintf(f, "\t.dc.w\t0, 0, 0\n");
-			obj = objtab[i].siblings;
-			if (obj)
-				fprintf(f, "\t.dc.l\t.%s\t; siblings\n", name2label(obj->name));
-			else
-				fprintf(f, "\t.dc.l\t0\t; siblings\n");
-			obj = objtab[i].children;
-			if (obj)
-				fprintf(f, "\t.dc.l\t.%s\t; children\n", name2label(obj->name));
-			else
-				fprintf(f, "\t.dc.l\t0\t; children\n");
-			if (objtab[i].numframes) {
-				fprintf(f, "\t.dc.l\t.%s_anim\n", name2label(objtab[i].name));
-			} else {
-				fprintf(f, "\t.dc.l\t0\t; no animation\n");
-			}
+	/*
+	 * with several files, share the threads out between them,
+	 * and let them share what they find out about textures
+	 */
+	if (numjobs > 1) {
+		texcache = NewTexCache();
+		for (i = 0; i < numjobs; i++) {
+			jobs[i].cv.numthreads = cv.numthreads / numjobs;
+			if (jobs[i].cv.numthreads < 1)
+				jobs[i].cv.numthreads = 1;
+			jobs[i].cv.texcache = texcache;
 		}
 	}
-	for (i = 0; i < numObjs; i++) {
-		ret = writefile(f, &objtab[i]);
-		if (ret) return 1;
+	ParallelFor(cv.numthreads, numjobs, convertjob, jobs);
+
+	retval = 0;
+	for (i = 0; i < numjobs; i++) {
+		if (jobs[i].retval != 0)
+			retval = 1;
 	}
-	return 0;
+	FreeTexCache(texcache);
+	free(jobs);
+	free(manifesttext);
+	return retval;
 }
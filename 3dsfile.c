@@ -19,38 +19,63 @@
 #ifdef __DUMB_MSDOS__
 #include <alloc.h>
 #define mymalloc farmalloc
+#define mycalloc farcalloc
+#define myrealloc farrealloc
 #define myfree farfree
 #else
 #define mymalloc malloc
+#define mycalloc calloc
+#define myrealloc realloc
 #define myfree free
 #endif
 
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define USE_SSE2
+#endif
+
+/* byte order of the machine we're running on; 3DS files are little endian */
+#if defined(__BYTE_ORDER__) && defined(__ORDER_BIG_ENDIAN__) && (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+#define HOST_BIG_ENDIAN
+#elif (defined(__BYTE_ORDER__) && defined(__ORDER_LITTLE_ENDIAN__) && (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)) \
+	|| defined(_WIN32) || defined(__i386__) || defined(__x86_64__)
+#define HOST_LITTLE_ENDIAN
+#endif
+
 #include "3dstudio.h"
 #include "internal.h"
 #include "proto.h"
 
 /*#define DEBUG_KF*/
 
-/* External variables */
-extern double	uscale;			/* user specified scale factor */
-extern char	*progname;		/* name of this program */
-extern char	*infilename;		/* input file name */
-extern int	verbose;		/* -v flag specified? */
-extern int	multiobject;		/* output multiple objects? */
-extern int	animflag;		/* get animation data? */
+/*
+ * index of the chunk tree, built in one pass over the file;
+ * entry 0 is the file itself
+ */
+typedef struct chunknode {
+	unsigned id;			/* chunk id */
+	uint8_t *data;			/* start of chunk data (just past its header) */
+	long length;			/* length of chunk data */
+	int parent;			/* enclosing chunk, or -1 */
+	int child;			/* first subchunk, or -1 */
+	int next;			/* next chunk with the same parent, or -1 */
+} ChunkNode;
 
-/* Global variables */
-static uint8_t	*fbuf;				/* buffer for loading 3ds file, */
-					/* will be allocated */
-static uint8_t	*fbufend;			/* pts to the end of the buffer */
-static long	fbufsize;			/* size of the buffer */
+/*
+ * everything we know about the 3DS file being read
+ */
+typedef struct tdsfile {
+	Converter *cv;			/* conversion we're reading it for */
+	uint8_t	*fbuf;			/* the 3ds file, mapped read only */
+	uint8_t	*fbufend;		/* pts to the end of the buffer */
+	long	fbufsize;		/* size of the buffer */
 
-static uint8_t	*mdata;				/* start of mesh data section */
-static uint8_t	*mdataend;			/* end of mdata */
-static uint8_t	*kfdata;			/* start of key frame data section */
-static uint8_t	*kfdataend;
+	ChunkNode *chunktab;		/* the chunk index */
+	int	numChunks;		/* number of entries in chunktab */
+	int	maxChunks;		/* current size of chunktab */
 
-static double	scale;				/* scale factor from 3DS file */
+	double	scale;			/* scale factor from 3DS file */
+} TDSFile;
 
 
 typedef struct color {
@@ -83,21 +108,24 @@ static const Matrix Identity = {
 };
 
 /* local functions */
-static void buildmatrecs(uint8_t *, uint8_t *);
-static COLOR *get3dscolor(uint8_t *p);
+static int read3dsdata(TDSFile *, char *);
+static int buildmatrecs(TDSFile *, int);
+static void get3dscolor(uint8_t *p, COLOR *);
 static float getfloat(uint8_t *);
 static uint16_t getshort(void *);
 static uint32_t getlong(void *);
-static int buildfacerecs(uint8_t *, uint8_t *);
-static uint8_t *getntriobj(uint8_t *, uint8_t *, long *, Object **);
-static uint8_t *getchunk(uint8_t *, uint8_t *, unsigned, long *);
-static uint8_t *getchunkfromset(uint8_t*, uint8_t *, unsigned *, long *, unsigned *);
+static int buildfacerecs(TDSFile *, int);
+static void decodemesh(void *, int);
+static void geometrykey(TDSFile *, int, int, Object *);
+static int buildchunkindex(TDSFile *, unsigned, uint8_t *, uint8_t *);
+static int indexchunks(TDSFile *, uint8_t *, uint8_t *, int);
+static int findchild(TDSFile *, int, unsigned);
+static int findnext(TDSFile *, int, unsigned);
+static uint8_t *chunkdata(TDSFile *, int);
 static uint8_t *get3dpoint(uint8_t *, double *, double *, double *);
-static int buildkfdata(uint8_t *, uint8_t *);
-
-#ifdef _WIN32
-#define strdup _strdup
-#endif
+static void decodepoints(uint8_t *, int, VertexArrays *, int, double);
+static void decodetexverts(uint8_t *, int, VertexArrays *);
+static int buildkfdata(TDSFile *, int);
 
 /*
  *	read 3d studio file into internal format
@@ -105,38 +133,55 @@ static int buildkfdata(uint8_t *, uint8_t *);
  */
 
 int
-read3dsfile(fname)
+read3dsfile(cv, fname)
+	Converter *cv;	/* conversion to read it for */
 	char *fname;	/* ptr to 3ds file name */
 {
-	FILE *fp;
-	unsigned short version;
-	long length;
-	uint8_t *p;
+	MappedFile mf;
+	TDSFile tf;
+	int ret;
 
-	if ((fp = fopen(fname, "rb")) == NULL) {
-		perror(fname);
-		exit(-1);
-	}
-	fseek(fp, 0L, 2);	/* seek to end of file */
-	fbufsize = ftell(fp);
-	fseek(fp, 0L, 0);	/* rewind */
-
-	if ((fbuf = (uint8_t *) mymalloc(fbufsize)) == NULL) {	/* get buffer */
-		fprintf(stderr, "%s: insufficient memory for loading 3DS file\n",
-			progname);
-		return -1;
-	}
-	if (fread(fbuf, fbufsize, 1, fp) != 1) {	/* read 3ds file */
-		perror(fname);
+	if (map_file(fname, &mf) != 0)
 		return -1;
-	}
-	fclose(fp);
+	memset(&tf, 0, sizeof(tf));
+	tf.cv = cv;
+	tf.fbuf = mf.data;
+	tf.fbufsize = mf.size;
+
+	ret = read3dsdata(&tf, fname);
+
+	/* everything we keep has been copied out of the file by now */
+	unmap_file(&mf);
+	if (tf.chunktab)
+		myfree(tf.chunktab);
+	return ret;
+}
+
+/*
+ *	convert the (read only) file image in tf->fbuf
+ */
+static int
+read3dsdata(tf, fname)
+	TDSFile *tf;	/* file being read */
+	char *fname;	/* ptr to 3ds file name */
+{
+	Converter *cv = tf->cv;
+	unsigned short version;
+	uint8_t *p;
+	int mdata, kfdata;		/* MDATA and KFDATA chunks */
+	uint8_t *fbuf = tf->fbuf;
+	uint8_t *fbufend;
+	long fbufsize = tf->fbufsize;
 
 	/*
 	 * compute end of buffer 
 	 */
 	fbufend = fbuf + fbufsize;
 	
+	if (fbufsize < 6) {
+		fprintf(stderr,"%s: %s is not a valid 3DS file.\n", cv->progname, fname);
+		return -1;
+	}
 	version = getshort(fbuf);
 	fbuf += 6L;			/* who needs the header now? */
 	/*
@@ -146,43 +191,49 @@ read3dsfile(fname)
 		/* a .PRJ file: that's fine */
 		;
 	} else if (version != 0x4d4d) {
-		fprintf(stderr,"%s: %s is not a valid 3DS file.\n", progname, fname);
+		fprintf(stderr,"%s: %s is not a valid 3DS file.\n", cv->progname, fname);
 		return -1;
 	}
 
+	/*
+	 * find all the chunks in the file
+	 */
+	tf->fbuf = fbuf;
+	tf->fbufend = fbufend;
+	if (buildchunkindex(tf, version, fbuf, fbufend) != 0)
+		return -1;
 
 	/*
 	 * now process the various parts of the 3ds file
 	 */
-	if ((mdata = getchunk(fbuf, fbufend, MDATA, &length)) == NULL) {
-		fprintf(stderr, "%s: %s has no MDATA chunk.\n", progname, fname);
+	if ((mdata = findchild(tf, 0, MDATA)) < 0) {
+		fprintf(stderr, "%s: %s has no MDATA chunk.\n", cv->progname, fname);
 		return -1;
 	}
-	mdataend = mdata + length;
-	if ((p = getchunk(mdata, fbufend, MSCALE, &length)) == NULL) {
-		fprintf(stderr, "%s: %s has no scale.\n", progname, fname);
+	if ((p = chunkdata(tf, findchild(tf, mdata, MSCALE))) == NULL) {
+		fprintf(stderr, "%s: %s has no scale.\n", cv->progname, fname);
 		return -1;
 	}
-	scale = getfloat(p);
-	if (verbose) {
-		printf("Scale factor for 3DS file: %f\n", scale);
+	tf->scale = getfloat(p);
+	if (cv->verbose) {
+		printf("Scale factor for 3DS file: %f\n", tf->scale);
 	}
-	scale /= uscale;
+	tf->scale /= cv->uscale;
 
-	buildmatrecs(mdata,mdataend);
+	if (buildmatrecs(tf, mdata) != 0)
+		return -1;
 
-	if (buildfacerecs(mdata,mdataend) != 0)
+	if (buildfacerecs(tf, mdata) != 0)
 		return (-1);
 
-	if (animflag) {
-		kfdata = getchunk(fbuf, fbufend, KFDATA, &length);
-		if (kfdata == NULL) {
+	if (cv->animflag) {
+		kfdata = findchild(tf, 0, KFDATA);
+		if (kfdata < 0) {
 			fprintf(stderr, "Warning: no animation data in file\n");
 			return 0;
 		}
-		kfdataend = kfdata + length;
 
-		if (buildkfdata(kfdata, kfdataend) != 0)
+		if (buildkfdata(tf, kfdata) != 0)
 			return -1;
 	}
 	return 0;
@@ -190,58 +241,63 @@ read3dsfile(fname)
 
 /* 
  *	build the materials records
+ *	returns: 0 on success, otherwise -1
  */
-static void
-buildmatrecs(mstart, mend)
-	uint8_t *mstart;	/* start of mdata section */
-	uint8_t *mend;	/* ...and its end */
+static int
+buildmatrecs(tf, mnode)
+	TDSFile *tf;		/* file being read */
+	int mnode;		/* mdata section */
 {
-	long length;
-	uint8_t *mat, *matend;
+	Converter *cv = tf->cv;
+	int mat;			/* material entry chunk */
 	char *matname;			/* material name */
 	uint8_t *color;			/* color chunk */
-	COLOR *cptr;
+	COLOR col;
 	Material matrec;
 
-	uint8_t *texmap, *texmapend;
+	int texmap;
 	char *texmapname;
 
-	if (verbose)
+	if (cv->verbose)
 		fprintf(stdout, "Building materials records\n");
+	col.red = col.green = col.blue = 0.0;	/* in case of an unknown color chunk */
 
-	for(;;) {
-		if ((mat = getchunk(mstart, mend, MAT_ENTRY, &length)) == NULL) {
-			break;
-		}
-	 	mstart = matend = mat + length;
-		if ((matname = (char *)getchunk(mat, matend, MAT_NAME, &length)) == NULL) {
+	for (mat = findchild(tf, mnode, MAT_ENTRY); mat >= 0; mat = findnext(tf, mat, MAT_ENTRY)) {
+		if ((matname = (char *)chunkdata(tf, findchild(tf, mat, MAT_NAME))) == NULL) {
 			break;
 		}	
-		if ((color = getchunk(mat, matend, MAT_DIFFUSE, &length)) == NULL) {
+		if ((color = chunkdata(tf, findchild(tf, mat, MAT_DIFFUSE))) == NULL) {
 			break;
 		}
-		cptr = get3dscolor(color);
-		matrec.red = 255.9*cptr->red;
-		matrec.green = 255.9*cptr->green;
-		matrec.blue = 255.9*cptr->blue;
-		matrec.name = strdup(matname);
+		get3dscolor(color, &col);
+		matrec.red = 255.9*col.red;
+		matrec.green = 255.9*col.green;
+		matrec.blue = 255.9*col.blue;
+		matrec.name = ArenaStrdup(cv->arena, matname);
+		if (!matrec.name) {
+			fprintf(stderr, "ERROR: out of memory\n");
+			return -1;
+		}
 
 		/* check for a texture map */
-		texmap = getchunk(mat, matend, MAT_TEXMAP, &length);
-		if (texmap) {
-			texmapend = texmap+length;
+		texmap = findchild(tf, mat, MAT_TEXMAP);
+		if (texmap >= 0) {
 			/* get texture file name */
-			texmapname = (char *)getchunk(texmap, texmapend, MAT_MAPNAME, &length);
+			texmapname = (char *)chunkdata(tf, findchild(tf, texmap, MAT_MAPNAME));
 		} else {
 			texmapname = (char *)0;
 		}
 		if (texmapname) {
-			matrec.texmap = strdup(texmapname);
+			matrec.texmap = ArenaStrdup(cv->arena, texmapname);
+			if (!matrec.texmap) {
+				fprintf(stderr, "ERROR: out of memory\n");
+				return -1;
+			}
 			/* fill in some default sizes */
 			matrec.twidth = matrec.theight = 64;
 
 			/* try to get the actual sizes & colors from the Targa file */
-			if (read_targa(&matrec, 1) < 0) {
+			if (read_targa(cv, &matrec, 1) < 0) {
 				/* an error occured; this isn't a valid texture map */
 				matrec.texmap = (char *)0;
 			}
@@ -249,52 +305,53 @@ buildmatrecs(mstart, mend)
 			matrec.texmap = (char *)0;
 		}
 
-		if (verbose)
+		if (cv->verbose)
 			fprintf(stdout, "Adding material %s\n", matrec.name);
-		AddMaterial(&matrec);
+		if (AddMaterial(cv, &matrec) != 0)
+			return -1;
 	}
-
+	return 0;
 }
 
 
-static COLOR
-*get3dscolor(p)
+static void
+get3dscolor(p, c)
 	unsigned char *p;
+	COLOR *c;
 {
 	short cmd;
-	static COLOR ColorBuffer;
 
 	cmd = getshort(p); p += 6L;	/* skip id+length */
 
 	switch (cmd) {
 	case COLOR_F:
-		ColorBuffer.red = getfloat(p); p+= 4L;	
-		ColorBuffer.green = getfloat(p); p+= 4L;	
-		ColorBuffer.blue = getfloat(p); p+= 4L;	
+		c->red = getfloat(p); p+= 4L;	
+		c->green = getfloat(p); p+= 4L;	
+		c->blue = getfloat(p); p+= 4L;	
 		break;
 	case COLOR_24:
-		ColorBuffer.red = (float) ((unsigned char)p[0]) / 256.0;
-		ColorBuffer.green = (float) ((unsigned char)p[1]) / 256.0;
-		ColorBuffer.blue = (float) ((unsigned char)p[2]) / 256.0;
+		c->red = (float) ((unsigned char)p[0]) / 256.0;
+		c->green = (float) ((unsigned char)p[1]) / 256.0;
+		c->blue = (float) ((unsigned char)p[2]) / 256.0;
 		break;
 	}
-
-	return &ColorBuffer;
 }
 
 /*
  *	get a 32 bit float from a uint32_t pointer (byte swapped)
+ *	the buffer is read only, so we swap into a local instead
  */
 static	float
 getfloat(p)
 	uint8_t *p;
 {
-	float *flp;
+	union {
+		uint32_t l;
+		float f;
+	} u;
 
-	*((uint32_t *)p) = getlong(p);	/* looks weird, but we don't want */
-	flp = (float *) p;			/* the compiler to tranfer the     */
-						/* float to a uint32_t                 */
-	return *flp;
+	u.l = getlong(p);
+	return u.f;
 }
 
 
@@ -320,281 +377,684 @@ getlong(void *p0)
 	return d;
 }
 
+/*
+ * a mesh waiting to be decoded; each N_TRI_OBJECT chunk is self
+ * contained, so the meshes can be decoded in parallel and then
+ * committed in file order
+ */
+typedef struct meshjob {
+	TDSFile *tf;			/* file it's in */
+	int ntri;			/* N_TRI_OBJECT chunk */
+	Object *obj;			/* object to decode into */
+	Object mesh;			/* private object, used when all meshes go into one object */
+	Matrix M;			/* orientation matrix */
+	int numthreads;			/* threads it may use itself */
+	char *errmsg;			/* if not 0, why the mesh couldn't be decoded */
+} MeshJob;
+
 /* 
  *	build the point & face records
  */
 static int
-buildfacerecs(mstart, mend)
-	uint8_t *mstart;	/* start of mdata section */
-	uint8_t *mend;	/* ...and its end */
+buildfacerecs(tf, mnode)
+	TDSFile *tf;		/* file being read */
+	int mnode;		/* mdata section */
 {
-	int i;
-	long length;
-	uint8_t *ntri, *ntriend;		/* n-tri object */
-	uint8_t *face, *faceend;		/* face array chunk */
-	uint8_t *p;
+	Converter *cv = tf->cv;
+	int i, j, k;
+	int nobj;			/* named object */
+	int ntri;			/* n-tri object */
+	MeshJob *jobs, *job;
+	int numjobs;
+	int vertbase;			/* base of vertex list */
 	Vertex vert;
 	Polygon poly;
-	int vertbase;			/* base of vertex list */
-	int polybase;			/* base of polygon list */
-	int numverts;
-	int numpolys;
-	char *matname;			/* material name */
 	Object *curobj = NULL;
-	Matrix M;			/* orientation matrix */
-	extern char *defaultlabel;
-	extern int clabels;
+	int ret;
 
-	if (!multiobject) {
-		curobj = CreateObject( clabels ? defaultlabel + 1 : defaultlabel );
+	if (!cv->multiobject) {
+		curobj = CreateObject(cv, cv->clabels ? cv->defaultlabel + 1 : cv->defaultlabel);
+		if (!curobj)
+			return -1;
+		cv->labelobject = 1;
 	}
 
-	for(;;) {
-		if (multiobject)
-			ntri = getntriobj(mstart, mend, &length, &curobj);
-		else
-			ntri = getntriobj(mstart, mend, &length, (Object **)0);
+	/*
+	 *	look for named, n-tri objects
+	 */
+	numjobs = 0;
+	for (nobj = findchild(tf, mnode, NAMED_OBJECT); nobj >= 0; nobj = findnext(tf, nobj, NAMED_OBJECT)) {
+		if (findchild(tf, nobj, N_TRI_OBJECT) >= 0)
+			numjobs++;
+	}
+	if (numjobs == 0)
+		return 0;
+	jobs = mycalloc(numjobs, sizeof(MeshJob));
+	if (!jobs) {
+		fprintf(stderr, "%s: insufficient memory for mesh data\n", cv->progname);
+		return -1;
+	}
 
-		if (ntri == NULL) break;
+	/* create the objects now, so that they stay in file order */
+	ret = 0;
+	i = 0;
+	for (nobj = findchild(tf, mnode, NAMED_OBJECT); ret == 0 && nobj >= 0; nobj = findnext(tf, nobj, NAMED_OBJECT)) {
+		if ((ntri = findchild(tf, nobj, N_TRI_OBJECT)) < 0)
+			continue;		/* a light or camera, or some such */
+		jobs[i].tf = tf;
+		jobs[i].ntri = ntri;
+		jobs[i].mesh.cv = cv;
+		jobs[i].numthreads = (cv->numthreads > numjobs) ? cv->numthreads / numjobs : 1;
+		if (cv->multiobject) {
+			jobs[i].obj = CreateObject(cv, (char *)tf->chunktab[nobj].data);
+			if (!jobs[i].obj) {
+				ret = -1;
+				break;
+			}
+		} else {
+			jobs[i].mesh.name = curobj->name;
+			jobs[i].obj = &jobs[i].mesh;
+		}
+		i++;
+	}
+	if (ret != 0) {
+		myfree(jobs);
+		return ret;
+	}
+	ParallelFor(cv->numthreads, numjobs, decodemesh, jobs);
 
-		if (verbose)
-			fprintf(stderr, "Building face records for %s\n", curobj->name);
+	/*
+	 *	now add the meshes to their objects, in file order
+	 */
+	if (!cv->multiobject) {
+		int nverts = 0, npolys = 0, ncorners = 0;
 
-		mstart = ntriend = ntri+length;
-		vertbase = curobj->numVerts;
-		polybase = curobj->numPolys;
+		for (i = 0; i < numjobs; i++) {
+			nverts += jobs[i].mesh.numVerts;
+			npolys += jobs[i].mesh.numPolys;
+			ncorners += jobs[i].mesh.numCorners;
+		}
+		if (ReserveVertices(curobj, nverts) != 0 ||
+		    ReservePolygons(curobj, npolys, ncorners) != 0)
+			ret = -1;
+	}
+	for (i = 0; ret == 0 && i < numjobs; i++) {
+		job = &jobs[i];
+		if (!cv->multiobject)
+			job->obj = curobj;
 
-		/* get mesh matrix */
-		p = getchunk(ntri, ntriend, MSH_MATRIX, &length);
-		if (p) {
-			p = get3dpoint(p, &M.xrite, &M.yrite, &M.zrite);
-			p = get3dpoint(p, &M.xdown, &M.ydown, &M.zdown);
-			p = get3dpoint(p, &M.xhead, &M.yhead, &M.zhead);
-			p = get3dpoint(p, &M.xposn, &M.yposn, &M.zposn);
-#ifdef DEBUG_KF
-			printf("Matrix for %s:\n", curobj->name);
-			printf("%f, %f, %f, %f\n", M.xrite, M.xdown, M.xhead, M.xposn);
-			printf("%f, %f, %f, %f\n", M.yrite, M.ydown, M.yhead, M.yposn);
-			printf("%f, %f, %f, %f\n", M.zrite, M.zdown, M.zhead, M.zposn);
-#endif
-		} else {
-			M = Identity;
+		if (cv->verbose) {
+			fprintf(stderr, "Building face records for %s\n", job->obj->name);
+			fprintf(stdout, "Getting material groups\n");
+		}
+		if (job->errmsg) {
+			fprintf(stderr, "%s: %s\n", cv->infilename, job->errmsg);
+			ret = -1;
+			break;
 		}
 
-		if (animflag) {
+		if (cv->animflag) {
 			/* save the orientation matrix for animation info */
-			curobj->inpptr = malloc(sizeof(Matrix));
-			*(Matrix *)curobj->inpptr = M;
+			job->obj->inpptr = ArenaMalloc(cv->arena, sizeof(Matrix));
+			if (!job->obj->inpptr) {
+				fprintf(stderr, "ERROR: out of memory\n");
+				ret = -1;
+				break;
+			}
+			*(Matrix *)job->obj->inpptr = job->M;
 		}
 
-		/* now build point records */
-		if ((p = getchunk(ntri, ntriend, POINT_ARRAY, &length)) == NULL) {
-			fprintf(stderr, "%s: points array not found\n", infilename);
-			return -1;	
-		}
-		numverts = getshort(p); p+=2L;
-		vert.vx = vert.vy = vert.vz = 0;
-		vert.u = vert.v = 0;
-		for (i = 0; i < numverts; i++) {
-			double x, y, z;
-
-			p = get3dpoint(p, &x, &y, &z);
-
-			/* re-orient and scale the point */
-			vert.x = x/scale;
-			vert.y = -z/scale; 
-			vert.z = y/scale;
-			AddVertex(curobj, &vert);
+		if (!cv->multiobject) {
+			/* append the mesh to the one big object */
+			vertbase = curobj->numVerts;
+			for (k = 0; ret == 0 && k < job->mesh.numVerts; k++) {
+				GetVertex(&job->mesh, k, &vert);
+				if (AddVertex(curobj, &vert) < 0)
+					ret = -1;
+			}
+			for (k = 0; ret == 0 && k < job->mesh.numPolys; k++) {
+				GetPolygon(&job->mesh, k, &poly);
+				for (j = 0; j < poly.numverts; j++)
+					poly.vert[j] += vertbase;
+				if (AddPolygon(curobj, &poly) < 0)
+					ret = -1;
+			}
 		}
+	}
 
-		/* next get the faces */
-		p = face = getchunk(ntri, ntriend, FACE_ARRAY, &length);
-		if (p == NULL) {
-			fprintf(stderr, "%s: face array not found\n", infilename);
-			return -1;
-		}
-		faceend = face+length;
+	for (i = 0; i < numjobs; i++)
+		FreeGeometry(&jobs[i].mesh);
+	myfree(jobs);
+	return ret;
+}
 
-		numpolys = getshort(p); p += 2;
+/*
+ *	decode one mesh into its object; called from
+ *	ParallelFor(), so this must only touch its own job
+ */
+static void
+decodemesh(arg, n)
+	void *arg;		/* the job array */
+	int n;			/* which job to do */
+{
+	MeshJob *job = (MeshJob *)arg + n;
+	TDSFile *tf = job->tf;
+	Object *curobj = job->obj;
+	int ntri = job->ntri;
+	int i;
+	int face, matgroup;		/* face array and material group chunks */
+	uint8_t *p;
+	Polygon poly;
+	int numverts;
+	int numpolys;
+	int firstpoly;			/* first face of this mesh */
+	int firstvert;			/* first vertex of this mesh */
+	char *matname;			/* material name */
+	Matrix M;			/* orientation matrix */
 
-		for (i = 0; i < numpolys; i++) {
-			poly.material = -1;
-			poly.numverts = 3;
-			poly.vert[0] = vertbase + getshort(p); p += 2;
-			poly.vert[2] = vertbase + getshort(p); p += 2;
-			poly.vert[1] = vertbase + getshort(p); p += 2;
-			poly.u[0] = poly.v[0] = 0.0;
-			poly.u[2] = 0.0; poly.v[2] = 0.0;
-			poly.u[1] = 0.0; poly.v[1] = 0.0;
-			p += 2;		/* skip flags */
-
-			CalcFaceNormal(curobj, &poly);
-			AddPolygon(curobj, &poly);
+	/* get mesh matrix */
+	p = chunkdata(tf, findchild(tf, ntri, MSH_MATRIX));
+	if (p) {
+		p = get3dpoint(p, &M.xrite, &M.yrite, &M.zrite);
+		p = get3dpoint(p, &M.xdown, &M.ydown, &M.zdown);
+		p = get3dpoint(p, &M.xhead, &M.yhead, &M.zhead);
+		p = get3dpoint(p, &M.xposn, &M.yposn, &M.zposn);
+#ifdef DEBUG_KF
+		printf("Matrix for %s:\n", curobj->name);
+		printf("%f, %f, %f, %f\n", M.xrite, M.xdown, M.xhead, M.xposn);
+		printf("%f, %f, %f, %f\n", M.yrite, M.ydown, M.yhead, M.yposn);
+		printf("%f, %f, %f, %f\n", M.zrite, M.zdown, M.zhead, M.zposn);
+#endif
+	} else {
+		M = Identity;
+	}
+	job->M = M;
+
+	/* with -cache, an unchanged object may already be done */
+	if (curobj->cv->cachedir && curobj != &job->mesh) {
+		geometrykey(tf, ntri, findchild(tf, ntri, FACE_ARRAY), curobj);
+		if (CacheLoadGeometry(curobj) == 0) {
+			curobj->cached = 1;
+			return;
 		}
+	}
 
-		/* get material groups and texture coordinates here! */
-		if (verbose)
-			fprintf(stdout, "Getting material groups\n");
+	/* now build point records */
+	if ((i = findchild(tf, ntri, POINT_ARRAY)) < 0) {
+		job->errmsg = "points array not found";
+		return;
+	}
+	p = tf->chunktab[i].data;
+	numverts = getshort(p); p+=2L;
+	if (numverts > (tf->chunktab[i].length - 2) / 12)
+		numverts = (tf->chunktab[i].length - 2) / 12;	/* truncated chunk */
+	if ((firstvert = AllocVertices(curobj, numverts)) < 0) {
+		job->errmsg = "out of memory";
+		return;
+	}
+	decodepoints(p, numverts, &curobj->verts, firstvert, tf->scale);
 
-		while ((p = getchunk(p, faceend, MSH_MAT_GROUP, &length)) != NULL) {
-			int curmat;
+	/* next get the faces */
+	face = findchild(tf, ntri, FACE_ARRAY);
+	if (face < 0) {
+		job->errmsg = "face array not found";
+		return;
+	}
+	p = tf->chunktab[face].data;
 
-			matname = (char *)p;
-			while (*p) p++;			/* skip name */
-			p++;				/* skip trailing 0 */
-			curmat = GetMaterial(matname);
-			numpolys = getshort(p); p += 2;
-			for (i = 0; i < numpolys; i++) {
-				int polyidx;
+	numpolys = getshort(p); p += 2;
+	if (numpolys > (tf->chunktab[face].length - 2) / 8)
+		numpolys = (tf->chunktab[face].length - 2) / 8;	/* truncated chunk */
+	if (ReservePolygons(curobj, numpolys, 3*numpolys) != 0) {
+		job->errmsg = "out of memory";
+		return;
+	}
+	firstpoly = curobj->numPolys;
+
+	for (i = 0; i < numpolys; i++) {
+		poly.material = -1;
+		poly.numverts = 3;
+		poly.vert[0] = getshort(p); p += 2;
+		poly.vert[2] = getshort(p); p += 2;
+		poly.vert[1] = getshort(p); p += 2;
+		poly.u[0] = poly.v[0] = 0.0;
+		poly.u[2] = 0.0; poly.v[2] = 0.0;
+		poly.u[1] = 0.0; poly.v[1] = 0.0;
+		p += 2;		/* skip flags */
+		if (poly.vert[0] >= numverts || poly.vert[1] >= numverts ||
+		    poly.vert[2] >= numverts) {
+			job->errmsg = "face uses a point that isn't in the points array";
+			return;
+		}
 
-				polyidx = polybase + getshort(p); p += 2;
-				curobj->polytab[polyidx].material = curmat;
-			}
+		if (AddPolygon(curobj, &poly) < 0) {
+			job->errmsg = "out of memory";
+			return;
 		}
+	}
+	CalcFaceNormals(curobj, firstpoly, job->numthreads);
+
+	/* get material groups and texture coordinates here! */
+	for (matgroup = findchild(tf, face, MSH_MAT_GROUP); matgroup >= 0;
+	     matgroup = findnext(tf, matgroup, MSH_MAT_GROUP)) {
+		int curmat;
+
+		p = tf->chunktab[matgroup].data;
+		matname = (char *)p;
+		while (*p) p++;			/* skip name */
+		p++;				/* skip trailing 0 */
+		curmat = GetMaterial(curobj->cv, matname);
+		numpolys = getshort(p); p += 2;
+		for (i = 0; i < numpolys; i++) {
+			int polyidx;
 
-		/* look for texture coordinates */
-		p = getchunk(ntri, ntriend, TEX_VERTS, &length);
-		if (p) {
-			numverts = getshort(p); p += 2;
-			for (i = 0; i < numverts; i++) {
-				double u,v;
-				u = getfloat(p); p += 4;
-				v = 1.0 - getfloat(p); p += 4;		/* 3DS is weird! */
-				if (u < 0.0)
-					u = 0.0;
-				else if (u > 1.0)
-					u = 1.0;
-				if (v < 0.0)
-					v = 0.0;
-				else if (v > 1.0)
-					v = 1.0;
-
-				curobj->verttab[i+vertbase].u = u;
-				curobj->verttab[i+vertbase].v = v;
-			}
+			polyidx = getshort(p); p += 2;
+			if (polyidx < curobj->numPolys)
+				curobj->facetab[polyidx].material = curmat;
 		}
+	}
 
+	/* look for texture coordinates */
+	if ((i = findchild(tf, ntri, TEX_VERTS)) >= 0) {
+		p = tf->chunktab[i].data;
+		numverts = getshort(p); p += 2;
+		if (numverts > (tf->chunktab[i].length - 2) / 8)
+			numverts = (tf->chunktab[i].length - 2) / 8;	/* truncated chunk */
+		if (numverts > curobj->numVerts)
+			numverts = curobj->numVerts;
+		decodetexverts(p, numverts, &curobj->verts);
 	}
+}
 
-	return 0;
+/*
+ *	work out the cache key for an object's geometry, from its
+ *	N_TRI_OBJECT chunk and the materials its faces use; if that
+ *	can't be done, the key is left empty and the object just
+ *	isn't cached
+ */
+static void
+geometrykey(tf, ntri, face, obj)
+	TDSFile *tf;		/* file being read */
+	int ntri;		/* n-tri object */
+	int face;		/* its face array, or -1 */
+	Object *obj;		/* object it's for */
+{
+	int matgroup;
+	int *mats;
+	int nmats;
+
+	obj->geokey[0] = 0;
+	nmats = 0;
+	if (face >= 0) {
+		for (matgroup = findchild(tf, face, MSH_MAT_GROUP); matgroup >= 0;
+		     matgroup = findnext(tf, matgroup, MSH_MAT_GROUP))
+			nmats++;
+	}
+	mats = mymalloc((nmats + 1) * sizeof(int));
+	if (!mats)
+		return;
+	nmats = 0;
+	if (face >= 0) {
+		for (matgroup = findchild(tf, face, MSH_MAT_GROUP); matgroup >= 0;
+		     matgroup = findnext(tf, matgroup, MSH_MAT_GROUP))
+			mats[nmats++] = FindMaterial(obj->cv, (char *)tf->chunktab[matgroup].data);
+	}
+	CacheGeometryKey(obj, tf->chunktab[ntri].data, tf->chunktab[ntri].length, tf->scale, mats, nmats);
+	myfree(mats);
 }
 
+/*
+ *	get a little endian float from the file, the fast way
+ *	if we know what byte order the machine uses
+ */
+static float
+lefloat(p)
+	uint8_t *p;
+{
+#if defined(HOST_LITTLE_ENDIAN)
+	float f;
+
+	memcpy(&f, p, 4);
+	return f;
+#elif defined(HOST_BIG_ENDIAN) && defined(__GNUC__)
+	union {
+		uint32_t l;
+		float f;
+	} u;
+
+	memcpy(&u.l, p, 4);
+	u.l = __builtin_bswap32(u.l);
+	return u.f;
+#else
+	return getfloat(p);
+#endif
+}
 
-static	uint8_t
-*getntriobj(mstart, mend, length, objptr)
-	uint8_t *mstart, *mend;
-	long *length;
-	Object **objptr;
+#ifdef USE_SSE2
+/*
+ *	load one or two floats from the file into the low lanes of
+ *	an SSE register; the data has no particular alignment, so
+ *	it goes through a local variable (the compiler turns this
+ *	into a single unaligned load)
+ */
+static __m128
+load1f(p)
+	uint8_t *p;
 {
-	int done;
-	uint8_t *nobj, *nobjend;	/* name object */
-	uint8_t *ntriobj;		/* n-tri object */
-	uint8_t *p;			/* points array */
-	int i;
-	char *objname = NULL;
+	float f;
 
-	/*
-	 *	let's find a named, n-tri object
-	 */
-	ntriobj = 0;
-	p = mstart;
-	done = 0;
-	do {
-		if ((nobj = getchunk(p, mend, NAMED_OBJECT, length)) == NULL) {
-			done = -1;
-			break;
-		}
-		p = nobj + *length;
-
-		objname = (char *)nobj;
-		for (i = 0; *nobj && (i < 512); i++) /* skip object's name */
-			nobj++;
-		nobj++;	i++;
-		*length -= i;
-		nobjend = nobj + *length;
-	
-		if ((ntriobj = getchunk(nobj, nobjend, N_TRI_OBJECT, length))
-		 != NULL) {
-			done = 1;
-		}
+	memcpy(&f, p, sizeof(f));
+	return _mm_load_ss(&f);
+}
 
-	} while (!done);
+static __m128
+load2f(p)
+	uint8_t *p;
+{
+	double d;
 
-	if (done == -1)		/* no n-tri object found */
-		return NULL;
-	else {
-		if (objptr)
-			*objptr = CreateObject( objname );
-		return ntriobj;
-	}
+	memcpy(&d, p, sizeof(d));
+	return _mm_castpd_ps(_mm_load_sd(&d));
 }
+#endif
 
 /*
- *	get a specific chunk
+ *	convert a POINT_ARRAY to vertices: re-orient the points
+ *	from 3D Studio's coordinate system to ours, and scale them
+ *	p points at the first coordinate, after the count
  */
-
-static uint8_t
-*getchunk(fbp, fbend, id, length)
-	uint8_t *fbp, *fbend;		/* start & end of buffer */
-	unsigned id;			     	/* chunk id */
-	long * length;		     		/* return size of chunk in here */
+static void
+decodepoints(p, n, V, first, scale)
+	uint8_t *p;		/* x, y, z floats for each point */
+	int n;			/* number of points */
+	VertexArrays *V;	/* where to put them */
+	int first;		/* index of the first one */
+	double scale;		/* what to divide the coordinates by */
 {
-	int32_t chunklen = 0L;
-	unsigned chunkid;
-
-#ifdef DEBUGCHUNK
-fprintf(stderr, "getchunk: looking for (%04x)\n", id);
+	int i;
+	double x, y, z;
+	double *vx, *vy, *vz;
+
+	vx = V->x + first;
+	vy = V->y + first;
+	vz = V->z + first;
+	memset(V->vx + first, 0, n * sizeof(double));
+	memset(V->vy + first, 0, n * sizeof(double));
+	memset(V->vz + first, 0, n * sizeof(double));
+	memset(V->u + first, 0, n * sizeof(double));
+	memset(V->v + first, 0, n * sizeof(double));
+
+#ifdef USE_SSE2
+	/* two points at a time; note that dividing (rather than
+	 * multiplying by 1/scale) keeps the results identical to
+	 * the scalar code
+	 */
+	{
+		__m128d s = _mm_set1_pd(scale);
+		__m128d sign = _mm_set1_pd(-0.0);
+
+		for (i = 0; i + 2 <= n; i += 2, p += 24) {
+			__m128d xy0, xy1, z01;
+
+			xy0 = _mm_cvtps_pd(load2f(p));
+			xy1 = _mm_cvtps_pd(load2f(p+12));
+			z01 = _mm_cvtps_pd(_mm_unpacklo_ps(load1f(p+8), load1f(p+20)));
+			_mm_storeu_pd(vx + i, _mm_div_pd(_mm_unpacklo_pd(xy0, xy1), s));
+			_mm_storeu_pd(vy + i, _mm_xor_pd(_mm_div_pd(z01, s), sign));
+			_mm_storeu_pd(vz + i, _mm_div_pd(_mm_unpackhi_pd(xy0, xy1), s));
+		}
+	}
+#else
+	i = 0;
 #endif
+	for (; i < n; i++, p += 12) {
+		x = lefloat(p);
+		y = lefloat(p+4);
+		z = lefloat(p+8);
+		vx[i] = x/scale;
+		vy[i] = -z/scale;
+		vz[i] = y/scale;
+	}
+}
 
-	while (fbp < fbend) {
-		chunkid = getshort(fbp);
-#ifdef DEBUGCHUNK
-fprintf(stderr, "\tlooked at %04x\n", chunkid);
+/*
+ *	fill in the texture coordinates of vertices from a
+ *	TEX_VERTS chunk; p points at the first coordinate
+ */
+static void
+decodetexverts(p, n, V)
+	uint8_t *p;		/* u, v floats for each vertex */
+	int n;			/* number of vertices */
+	VertexArrays *V;	/* vertices to fill in, starting at 0 */
+{
+	int i;
+#ifdef USE_SSE2
+	/* (u, 1-v) for two vertices at a time, clamped to [0,1];
+	 * the operand order of max and min is chosen so that NaNs
+	 * and -0 come through just like they do in the scalar code
+	 */
+	__m128d zero = _mm_setzero_pd();
+	__m128d one = _mm_set1_pd(1.0);
+	__m128d uv0, uv1, u, v;
+
+	for (i = 0; i + 2 <= n; i += 2, p += 16) {
+		uv0 = _mm_cvtps_pd(load2f(p));
+		uv1 = _mm_cvtps_pd(load2f(p+8));
+		u = _mm_unpacklo_pd(uv0, uv1);
+		v = _mm_sub_pd(one, _mm_unpackhi_pd(uv0, uv1));	/* 3DS is weird! */
+		_mm_storeu_pd(V->u + i, _mm_min_pd(one, _mm_max_pd(zero, u)));
+		_mm_storeu_pd(V->v + i, _mm_min_pd(one, _mm_max_pd(zero, v)));
+	}
+#else
+	i = 0;
 #endif
-		fbp += 2;
-		chunklen = getlong(fbp) - 6;
-		fbp += 4;
-		if (chunkid == id) {
-			*length = chunklen;
-			return fbp;
-		}
-		fbp += chunklen;
+	for (; i < n; i++, p += 8) {
+		double u, v;
+
+		u = lefloat(p);
+		v = 1.0 - lefloat(p+4);		/* 3DS is weird! */
+		if (u < 0.0)
+			u = 0.0;
+		else if (u > 1.0)
+			u = 1.0;
+		if (v < 0.0)
+			v = 0.0;
+		else if (v > 1.0)
+			v = 1.0;
+
+		V->u[i] = u;
+		V->v[i] = v;
 	}
-	return NULL;
 }
 
+
 /*
- * get any chunk whose id appears in the
- * array "idset". "idset" is terminated
- * by an id of 0
+ *	build the chunk index for the file
+ *	returns: 0 on success, otherwise -1
  */
+static int
+buildchunkindex(tf, id, start, end)
+	TDSFile *tf;			/* file being read */
+	unsigned id;			/* id of the file's top level chunk */
+	uint8_t *start, *end;		/* its contents */
+{
+	int child;
 
+	tf->numChunks = 0;
+	tf->maxChunks = 256;
+	tf->chunktab = mymalloc(tf->maxChunks * sizeof(ChunkNode));
+	if (!tf->chunktab) {
+		fprintf(stderr, "%s: insufficient memory for chunk index\n", tf->cv->progname);
+		return -1;
+	}
+	tf->chunktab[0].id = id;
+	tf->chunktab[0].data = start;
+	tf->chunktab[0].length = end - start;
+	tf->chunktab[0].parent = tf->chunktab[0].next = -1;
+	tf->numChunks = 1;
+
+	/* careful: indexchunks() may move chunktab */
+	child = indexchunks(tf, start, end, 0);
+	if (tf->numChunks == 0)
+		return -1;
+	tf->chunktab[0].child = child;
+	return 0;
+}
+
+/*
+ *	where do the subchunks of a chunk start? returns
+ *	NULL for chunks which don't have any we care about
+ */
 static uint8_t
-*getchunkfromset(fbp, fbend, idset, length, foundid)
-	uint8_t *fbp, *fbend;		/* start & end of buffer */
-	unsigned *idset;		     	/* chunk id set */
-	long * length;		     		/* return size of chunk in here */
-	unsigned *foundid;			/* return which id was found here */
+*subchunks(id, p, end)
+	unsigned id;			/* chunk id */
+	uint8_t *p, *end;		/* chunk data */
 {
-	uint32_t chunklen = 0L;
-	unsigned chunkid;
 	int i;
 
-	while (fbp < fbend) {
-		chunkid = getshort(fbp);
-		fbp += 2;
-		chunklen = getlong(fbp) - 6;
-		fbp += 4;
-		for (i = 0; idset[i]; i++) {
-			if (chunkid == idset[i]) {
-				*length = chunklen;
-				*foundid = chunkid;
-				return fbp;
+	switch (id) {
+	case MDATA:
+	case MAT_ENTRY:
+	case MAT_AMBIENT:
+	case MAT_DIFFUSE:
+	case MAT_SPECULAR:
+	case MAT_TEXMAP:
+	case N_TRI_OBJECT:
+	case KFDATA:
+	case OBJECT_NODE_TAG:
+	case CAMERA_NODE_TAG:
+	case TARGET_NODE_TAG:
+	case LIGHT_NODE_TAG:
+	case L_TARGET_NODE_TAG:
+	case SPOTLIGHT_NODE_TAG:
+		return p;
+	case NAMED_OBJECT:
+		/* skip object's name */
+		for (i = 0; p < end && *p && (i < 512); i++)
+			p++;
+		return p+1;
+	case FACE_ARRAY:
+		/* skip the faces themselves */
+		if (end - p < 2)
+			return NULL;
+		return p + 2 + 8L * getshort(p);
+	default:
+		return NULL;
+	}
+}
+
+/*
+ *	add all the chunks between p and end (and their
+ *	subchunks) to the index
+ *	returns: index of the first chunk added, or -1 if there
+ *	weren't any
+ */
+static int
+indexchunks(tf, p, end, parent)
+	TDSFile *tf;			/* file being read */
+	uint8_t *p, *end;		/* start & end of buffer */
+	int parent;			/* chunk containing these */
+{
+	int first, last, cur;
+	long chunklen;
+	uint8_t *sub;
+	ChunkNode *chunktab = tf->chunktab;
+
+	first = last = -1;
+	while (end - p >= 6) {
+		chunklen = getlong(p+2);
+		if (chunklen < 6 || chunklen > end - p)
+			break;			/* bad length; file is truncated or corrupt */
+
+		if (tf->numChunks == tf->maxChunks) {
+			chunktab = myrealloc(tf->chunktab, 2 * tf->maxChunks * sizeof(ChunkNode));
+			if (!chunktab) {
+				fprintf(stderr, "%s: insufficient memory for chunk index\n", tf->cv->progname);
+				tf->numChunks = 0;
+				return -1;
 			}
+			tf->chunktab = chunktab;
+			tf->maxChunks *= 2;
 		}
-		fbp += chunklen;
+		cur = tf->numChunks++;
+		chunktab[cur].id = getshort(p);
+		chunktab[cur].data = p + 6;
+		chunktab[cur].length = chunklen - 6;
+		chunktab[cur].parent = parent;
+		chunktab[cur].child = chunktab[cur].next = -1;
+		if (last >= 0)
+			chunktab[last].next = cur;
+		else
+			first = cur;
+		last = cur;
+
+		sub = subchunks(chunktab[cur].id, p + 6, p + chunklen);
+		if (sub && sub < p + chunklen) {
+			int child = indexchunks(tf, sub, p + chunklen, cur);
+
+			if (tf->numChunks == 0)
+				return -1;
+			chunktab = tf->chunktab;
+			chunktab[cur].child = child;
+		}
+		p += chunklen;
 	}
-	return NULL;
+	return first;
+}
+
+/*
+ *	find the first subchunk of parent with a specific id
+ *	returns -1 if there isn't one
+ */
+static int
+findchild(tf, parent, id)
+	TDSFile *tf;			/* file being read */
+	int parent;			/* chunk to look in */
+	unsigned id;			/* chunk id */
+{
+	ChunkNode *chunktab = tf->chunktab;
+	int n;
+
+	if (parent < 0)
+		return -1;
+	for (n = chunktab[parent].child; n >= 0; n = chunktab[n].next) {
+		if (chunktab[n].id == id)
+			return n;
+	}
+	return -1;
+}
+
+/*
+ *	find the next chunk after "node" at the same level
+ *	with a specific id
+ *	returns -1 if there isn't one
+ */
+static int
+findnext(tf, node, id)
+	TDSFile *tf;			/* file being read */
+	int node;			/* chunk to start after */
+	unsigned id;			/* chunk id */
+{
+	ChunkNode *chunktab = tf->chunktab;
+	int n;
+
+	for (n = chunktab[node].next; n >= 0; n = chunktab[n].next) {
+		if (chunktab[n].id == id)
+			return n;
+	}
+	return -1;
+}
+
+/*
+ *	get a pointer to a chunk's data, or NULL if
+ *	the chunk wasn't found
+ */
+static uint8_t
+*chunkdata(tf, n)
+	TDSFile *tf;
+	int n;
+{
+	return (n < 0) ? NULL : tf->chunktab[n].data;
 }
 
 
@@ -636,70 +1096,93 @@ typedef struct ObjKFdata {
 	int kfdatanum;		/* identifying integer for this data in file */
 } KFdata;
 
-/* create new keyframe data */
+/* create new keyframe data; returns NULL on error */
 static KFdata *
-NewKF(char *name, int numframes)
+NewKF(Converter *cv, char *name, int numframes)
 {
 	Object *o;
 	KFdata *kf;
-	int i;
 
-	o = FindObject(name);
+	o = FindObject(cv, name);
 	if (!o) {
 		fprintf(stderr, "ERROR: Object `%s' referenced in key frame data does not exist.\n", name);
-		exit(1);
+		return NULL;
 	}
 
-	kf = malloc(sizeof(KFdata));
+	kf = ArenaMalloc(cv->arena, sizeof(KFdata));
+	if (kf)
+		kf->frames = ArenaCalloc(cv->arena, numframes, sizeof(Frame));
+	if (!kf || !kf->frames) {
+		fprintf(stderr, "ERROR: out of memory\n");
+		return NULL;
+	}
 	kf->obj = o;
-	kf->frames = malloc(numframes * sizeof(Frame));
-	kf->pivx = kf->pivy = kf->pivz = 0.0;
-
 	/* no key frames yet */
-	for (i = 0; i < numframes; i++) {
-		kf->frames[i].isposkf = 0;
-		kf->frames[i].isrotkf = 0;
-	}
+	kf->pivx = kf->pivy = kf->pivz = 0.0;
 	kf->next = 0;
 	kf->kfdatanum = -1;
 	return kf;
 }
 
+/*
+ * a list of keyframe structures, in file order, which can
+ * also be looked up by their number in the file
+ */
+typedef struct kflist {
+	KFdata *head, *tail;
+	KFdata **bynum;		/* bynum[n] has kfdatanum n, or is 0 */
+	int numnums;		/* size of bynum */
+} KFlist;
+
+/*
+ * start a list for keyframe numbers 0 to numnums-1
+ * returns: 0 on success, otherwise -1
+ */
+static int
+InitKFlist(Converter *cv, KFlist *list, int numnums)
+{
+	list->head = list->tail = 0;
+	list->numnums = numnums;
+	list->bynum = ArenaCalloc(cv->arena, numnums > 0 ? numnums : 1, sizeof(KFdata *));
+	if (!list->bynum) {
+		fprintf(stderr, "ERROR: out of memory\n");
+		return -1;
+	}
+	return 0;
+}
+
 /*
  * add a new keyframe structure to a list
  */
 static void
-AddKF(KFdata **listptr, KFdata *entry, int kfdatanum)
+AddKF(KFlist *list, KFdata *entry, int kfdatanum)
 {
-	KFdata *list;
-
 	entry->kfdatanum = kfdatanum;
-	list = *listptr;
-	if (!list) {
-		*listptr = entry;
-		return;
-	}
-	while (list->next)
-		list = list->next;
-	list->next = entry;
+	if (list->tail)
+		list->tail->next = entry;
+	else
+		list->head = entry;
+	list->tail = entry;
+	if (kfdatanum >= 0 && kfdatanum < list->numnums)
+		list->bynum[kfdatanum] = entry;
 }
 
 /*
  * find the n'th entry in a keyframe list
  */
 static KFdata *
-GetKF(KFdata *list, int n)
+GetKF(KFlist *list, int n)
 {
-	while (list && list->kfdatanum != n) {
-		list = list->next;
-	}
-	return list;
+	if (n < 0 || n >= list->numnums)
+		return 0;
+	return list->bynum[n];
 }
 
 /*
  * interpolate between key frames
+ * returns: 0 on success, otherwise -1
  */
-static void
+static int
 InterpolateKF(KFdata *kflist, int numframes) {
 	KFdata *kfcur;
 	int i0, i1, i;
@@ -710,7 +1193,7 @@ InterpolateKF(KFdata *kflist, int numframes) {
 	/* first, do position */
 		if (!kfcur->frames[0].isposkf) {
 			fprintf(stderr, "ERROR in data for `%s': first frame is not a key frame\n", kfcur->obj->name);
-			exit(1);
+			return -1;
 		}
 		if (!kfcur->frames[numframes-1].isposkf) {
 		/* find the last key frame */
@@ -747,7 +1230,7 @@ InterpolateKF(KFdata *kflist, int numframes) {
 	/* next, do rotation */
 		if (!kfcur->frames[0].isrotkf) {
 			fprintf(stderr, "ERROR: first frame is not a key frame\n");
-			exit(1);
+			return -1;
 		}
 		if (!kfcur->frames[numframes-1].isrotkf) {
 		/* find the last key frame */
@@ -767,7 +1250,7 @@ InterpolateKF(KFdata *kflist, int numframes) {
 		a0 = kfcur->frames[0].angle;
 		i1 = 1;
 		while (i1 < numframes) {
-			if (kfcur->frames[i1].isposkf) {
+			if (kfcur->frames[i1].isrotkf) {
 				x1 = kfcur->frames[i1].xaxis;
 				y1 = kfcur->frames[i1].yaxis;
 				z1 = kfcur->frames[i1].zaxis;
@@ -793,13 +1276,15 @@ InterpolateKF(KFdata *kflist, int numframes) {
 			i1++;
 		}
 	}
+	return 0;
 }
 
 /*
  * convert key frames to matrices
+ * returns: 0 on success, otherwise -1
  */
-static void
-ConvertKF(KFdata *kflistptr, int numframes)
+static int
+ConvertKF(Converter *cv, KFdata *kflistptr, int numframes)
 {
 	Object *obj;
 	KFdata *kfcur;
@@ -812,7 +1297,11 @@ ConvertKF(KFdata *kflistptr, int numframes)
 	for (kfcur = kflistptr; kfcur; kfcur = kfcur->next) {
 		obj = kfcur->obj;
 		obj->numframes = numframes;
-		obj->frames = malloc(numframes * sizeof(Matrix));
+		obj->frames = ArenaMalloc(cv->arena, numframes * sizeof(Matrix));
+		if (!obj->frames) {
+			fprintf(stderr, "ERROR: out of memory\n");
+			return -1;
+		}
 	}
 
 	for (i = 0; i < numframes; i++) {
@@ -896,36 +1385,37 @@ B.xdown, B.ydown, B.zdown, B.xhead, B.yhead, B.zhead, B.xposn, B.yposn, B.zposn)
 			obj->frames[i] = MMult(Coord3DS, C);
 		}
 	}
+	return 0;
 }
 
 static int
-buildkfdata(uint8_t *kstart, uint8_t *kend)
+buildkfdata(TDSFile *tf, int knode)
 {
+	ChunkNode *chunktab = tf->chunktab;
 	int i;
 	int32_t numframes;
 	long length;
 	int32_t numkeys;
 	uint8_t *p;
-	uint8_t *onode, *onodeend;
+	int hdr, onode;
 	double x, y, z, angle;
 	double pivx, pivy, pivz;
 	int32_t frame;
 	short splinebits;
 	int parent;
-	KFdata *kflist, *kfpar, *kfcur;
+	KFlist kflist;
+	KFdata *kfpar, *kfcur;
 	int kfdatanum;			/* number of the current set of key frame data */
-	static unsigned kfdataset[] = { OBJECT_NODE_TAG, CAMERA_NODE_TAG, TARGET_NODE_TAG, LIGHT_NODE_TAG, L_TARGET_NODE_TAG,
-					SPOTLIGHT_NODE_TAG, 0};
-	unsigned whichnode;
 
-	kflist = (KFdata *)0;
 	kfdatanum = 0;
 
-	p = getchunk(kstart, kend, KFHDR, &length);
-	if (!p) {
+	hdr = findchild(tf, knode, KFHDR);
+	if (hdr < 0) {
 		fprintf(stderr, "ERROR: no keyframe header present in file\n");
 		return -1;
 	}
+	p = chunktab[hdr].data;
+	length = chunktab[hdr].length;
 	p += 2;		/* skip version */
 	for (i = 0; i < length-6; i++)
 		p++;		/* skip file name, if any */
@@ -935,32 +1425,45 @@ buildkfdata(uint8_t *kstart, uint8_t *kend)
 printf("%ld frames\n", numframes);
 printf("Getting Object Node Chunks:\n");
 #endif
-	onodeend = kstart;
-	for(;;) {
-		onode = getchunkfromset(onodeend, kend, kfdataset, &length, &whichnode);
-		if (!onode) {
+	/* every node is numbered, so there are no more numbers than children */
+	i = 0;
+	for (onode = chunktab[knode].child; onode >= 0; onode = chunktab[onode].next)
+		i++;
+	if (InitKFlist(tf->cv, &kflist, i) != 0)
+		return -1;
+	for (onode = chunktab[knode].child; onode >= 0; onode = chunktab[onode].next) {
+		switch (chunktab[onode].id) {
+		case OBJECT_NODE_TAG:
 			break;
-		}
-		onodeend = onode + length;
-		if (whichnode != OBJECT_NODE_TAG) {
+		case CAMERA_NODE_TAG:
+		case TARGET_NODE_TAG:
+		case LIGHT_NODE_TAG:
+		case L_TARGET_NODE_TAG:
+		case SPOTLIGHT_NODE_TAG:
 			kfdatanum++;
 			continue;
+		default:
+			continue;
 		}
-		p = getchunk(onode, onodeend, NODE_HDR, &length);
-		if (!p) {
+		hdr = findchild(tf, onode, NODE_HDR);
+		if (hdr < 0) {
 			fprintf(stderr, "Missing node header in keyframe data\n");
 			return -1;
 		}
+		p = chunktab[hdr].data;
+		length = chunktab[hdr].length;
 #ifdef DEBUG_KF
 			printf("Getting keyframe data for: %s\n", p);
 #endif
-		kfcur = NewKF((char *)p, numframes);
+		kfcur = NewKF(tf->cv, (char *)p, numframes);
+		if (!kfcur)
+			return -1;
 		AddKF(&kflist, kfcur, kfdatanum++);
 
 		p += length-2;		/* skip name and flags */
 		parent = (short)getshort(p);
 		if (parent >= 0) {
-			kfpar = GetKF(kflist, parent);
+			kfpar = GetKF(&kflist, parent);
 			if (!kfpar) {
 				fprintf(stderr, "ERROR: bad key frame index (%d)\n", parent);
 			} else {
@@ -975,7 +1478,7 @@ printf("Getting Object Node Chunks:\n");
 			kfpar = 0;
 		}
 
-		p = getchunk(onode, onodeend, PIVOT, &length);
+		p = chunkdata(tf, findchild(tf, onode, PIVOT));
 		pivx = pivy = pivz = 0.0;
 		if (p) {
 			get3dpoint(p, &pivx, &pivy, &pivz);
@@ -988,7 +1491,7 @@ printf("  pivot: %f, %f, %f\n", pivx, pivy, pivz);
 		kfcur->pivy = pivy;
 		kfcur->pivz = pivz;
 
-		p = getchunk(onode, onodeend, POS_TRACK_TAG, &length);
+		p = chunkdata(tf, findchild(tf, onode, POS_TRACK_TAG));
 		if (p) {
 			/* get track header */
 			p += 10;		/* skip internal stuff */
@@ -1002,7 +1505,7 @@ printf("  pivot: %f, %f, %f\n", pivx, pivy, pivz);
 				if ((frame < 0) || (frame >= numframes)) {
 					fprintf(stderr, "ERROR: bad frame number (%" PRId32 ") in keyframe data for `%s'\n",
 						frame, kfcur->obj->name);
-					exit(1);
+					return -1;
 				}
 				p += 4;
 				splinebits = getshort(p);
@@ -1030,7 +1533,7 @@ printf("  pivot: %f, %f, %f\n", pivx, pivy, pivz);
 			}
 		}
 
-		p = getchunk(onode, onodeend, ROT_TRACK_TAG, &length);
+		p = chunkdata(tf, findchild(tf, onode, ROT_TRACK_TAG));
 		if (p) {
 			/* get track header */
 			p += 10;		/* skip internal stuff */
@@ -1067,10 +1570,12 @@ printf("  pivot: %f, %f, %f\n", pivx, pivy, pivz);
 	}
 
 /* interpolate between key frames */
-	InterpolateKF(kflist, numframes);
+	if (InterpolateKF(kflist.head, numframes) != 0)
+		return -1;
 
 /* now convert key frames to matrices */
-	ConvertKF(kflist, numframes);
+	if (ConvertKF(tf->cv, kflist.head, numframes) != 0)
+		return -1;
 
 #ifdef DEBUG_KF
 printf("Done keyframe stuff\n");
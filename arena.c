@@ -0,0 +1,271 @@
+/*
+ * Memory arenas for 3DSCONV.
+ *
+ * Almost everything we allocate while converting a file (the
+ * object and material tables, the geometry, names, keyframe
+ * data) lives until the output has been written, so instead of
+ * keeping track of each piece every conversion takes it all
+ * from its own arena, and gives it back in a single FreeArena()
+ * call.
+ *
+ * There are two kinds of allocation:
+ *   - blocks (ArenaMalloc/ArenaCalloc/ArenaRealloc) are ordinary
+ *     heap blocks with a small header that links them into the
+ *     arena, so tables can still be grown or freed early;
+ *   - small things that are never freed by themselves (names
+ *     and the like) are bump allocated from large chunks with
+ *     ArenaAlloc and ArenaStrdup.
+ *
+ * Worker threads grow geometry tables too, so the arena is
+ * protected by a lock.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#define USE_WIN32_THREADS
+#elif !defined(__DUMB_MSDOS__) && !defined(__MSDOS__) && !defined(NO_THREADS)
+#include <pthread.h>
+#define USE_PTHREADS
+#endif
+
+#ifdef __DUMB_MSDOS__
+#include <alloc.h>
+#define mymalloc farmalloc
+#define myrealloc farrealloc
+#define myfree farfree
+#else
+#define mymalloc malloc
+#define myrealloc realloc
+#define myfree free
+#endif
+
+#include "internal.h"
+#include "proto.h"
+
+/*
+ * header in front of every block; the union keeps the data
+ * that follows it aligned for doubles
+ */
+typedef union blockhdr {
+	struct {
+		union blockhdr *prev, *next;
+	} link;
+	double align[2];
+} BlockHdr;
+
+/*
+ * a chunk that bump allocations are carved out of
+ */
+typedef struct bumpchunk {
+	struct bumpchunk *next;		/* previously filled chunk */
+	size_t used;			/* bytes handed out so far */
+	size_t size;			/* bytes available after the header */
+	double align;
+} BumpChunk;
+
+#define BUMP_CHUNK_SIZE	16384
+#define BUMP_ALIGN	sizeof(double)
+
+struct arena {
+	BlockHdr blocks;		/* list of live blocks */
+	BumpChunk *bumpchunks;		/* current bump chunk */
+#if defined(USE_PTHREADS)
+	pthread_mutex_t lock;
+#elif defined(USE_WIN32_THREADS)
+	SRWLOCK lock;
+#endif
+};
+
+#if defined(USE_PTHREADS)
+#define LOCK(a)		pthread_mutex_lock(&(a)->lock)
+#define UNLOCK(a)	pthread_mutex_unlock(&(a)->lock)
+#elif defined(USE_WIN32_THREADS)
+#define LOCK(a)		AcquireSRWLockExclusive(&(a)->lock)
+#define UNLOCK(a)	ReleaseSRWLockExclusive(&(a)->lock)
+#else
+#define LOCK(a)
+#define UNLOCK(a)
+#endif
+
+/*
+ * make a new, empty arena; returns NULL if there's no memory
+ */
+Arena *
+NewArena(void)
+{
+	Arena *a;
+
+	a = mymalloc(sizeof(Arena));
+	if (!a)
+		return NULL;
+	a->blocks.link.prev = a->blocks.link.next = &a->blocks;
+	a->bumpchunks = NULL;
+#if defined(USE_PTHREADS)
+	pthread_mutex_init(&a->lock, NULL);
+#elif defined(USE_WIN32_THREADS)
+	InitializeSRWLock(&a->lock);
+#endif
+	return a;
+}
+
+static void
+linkblock(Arena *a, BlockHdr *h)
+{
+	LOCK(a);
+	h->link.prev = &a->blocks;
+	h->link.next = a->blocks.link.next;
+	a->blocks.link.next->link.prev = h;
+	a->blocks.link.next = h;
+	UNLOCK(a);
+}
+
+static void
+unlinkblock(Arena *a, BlockHdr *h)
+{
+	LOCK(a);
+	h->link.prev->link.next = h->link.next;
+	h->link.next->link.prev = h->link.prev;
+	UNLOCK(a);
+}
+
+/*
+ * allocate a block of "size" bytes; returns NULL if there's
+ * no memory left, just like malloc
+ */
+void *
+ArenaMalloc(Arena *a, size_t size)
+{
+	BlockHdr *h;
+
+	h = mymalloc(sizeof(BlockHdr) + size);
+	if (!h)
+		return NULL;
+	linkblock(a, h);
+	return h+1;
+}
+
+void *
+ArenaCalloc(Arena *a, size_t count, size_t size)
+{
+	void *p;
+
+	if (size && count > ((size_t)-1 - sizeof(BlockHdr)) / size)
+		return NULL;
+	p = ArenaMalloc(a, count * size);
+	if (p)
+		memset(p, 0, count * size);
+	return p;
+}
+
+/*
+ * resize a block from ArenaMalloc (or allocate a new one if p is NULL);
+ * on failure the old block is left alone and NULL is returned
+ */
+void *
+ArenaRealloc(Arena *a, void *p, size_t size)
+{
+	BlockHdr *h, *newh;
+
+	if (!p)
+		return ArenaMalloc(a, size);
+	h = (BlockHdr *)p - 1;
+	/* the block may move, so take it off the list while we do this */
+	unlinkblock(a, h);
+	newh = myrealloc(h, sizeof(BlockHdr) + size);
+	if (!newh) {
+		linkblock(a, h);
+		return NULL;
+	}
+	linkblock(a, newh);
+	return newh+1;
+}
+
+/*
+ * give a block back before the end of the conversion
+ */
+void
+ArenaFree(Arena *a, void *p)
+{
+	BlockHdr *h;
+
+	if (!p)
+		return;
+	h = (BlockHdr *)p - 1;
+	unlinkblock(a, h);
+	myfree(h);
+}
+
+/*
+ * bump allocate "size" bytes; these can't be freed or resized,
+ * they go away with the arena
+ */
+void *
+ArenaAlloc(Arena *a, size_t size)
+{
+	BumpChunk *c;
+	void *p;
+
+	size = (size + BUMP_ALIGN - 1) & ~(BUMP_ALIGN - 1);
+	LOCK(a);
+	c = a->bumpchunks;
+	if (!c || c->size - c->used < size) {
+		size_t chunksize = (size > BUMP_CHUNK_SIZE) ? size : BUMP_CHUNK_SIZE;
+
+		c = mymalloc(sizeof(BumpChunk) + chunksize);
+		if (!c) {
+			UNLOCK(a);
+			return NULL;
+		}
+		c->used = 0;
+		c->size = chunksize;
+		c->next = a->bumpchunks;
+		a->bumpchunks = c;
+	}
+	p = (char *)(c+1) + c->used;
+	c->used += size;
+	UNLOCK(a);
+	return p;
+}
+
+char *
+ArenaStrdup(Arena *a, const char *s)
+{
+	char *p;
+	size_t len = strlen(s) + 1;
+
+	p = ArenaAlloc(a, len);
+	if (p)
+		memcpy(p, s, len);
+	return p;
+}
+
+/*
+ * free an arena, along with everything allocated from it; all
+ * pointers into it are invalid afterwards
+ */
+void
+FreeArena(Arena *a)
+{
+	BlockHdr *h, *next;
+	BumpChunk *c, *nextc;
+
+	if (!a)
+		return;
+	for (h = a->blocks.link.next; h != &a->blocks; h = next) {
+		next = h->link.next;
+		myfree(h);
+	}
+	for (c = a->bumpchunks; c; c = nextc) {
+		nextc = c->next;
+		myfree(c);
+	}
+#if defined(USE_PTHREADS)
+	pthread_mutex_destroy(&a->lock);
+#endif
+	myfree(a);
+}
@@ -0,0 +1,676 @@
+/*
+ * Binary output for 3DSCONV (-f bin and -f abin).
+ *
+ * The text formats have to be assembled before they can be used,
+ * and for a big model that takes longer than converting it. A
+ * binary model is the data the N3D (or animation) format would have
+ * assembled to, ready to be pulled in with .incbin: a "blob" (the
+ * output file), and a small assembler stub next to it (with the
+ * extension .s) that includes the blob and knows how to relocate it.
+ *
+ * The blob is big endian, like the Jaguar's 68000. It starts with
+ * the same structures as the N3D format, in the same order:
+ *   - with animation, the pointer to the root object, and the
+ *     objects' hierarchy entries;
+ *   - for each object: its header, face list and vertex list;
+ *     after the first object, the material list and the bitmap
+ *     headers of the textures; with animation, the object's frames.
+ * Each of these starts on a phrase (8 byte) boundary. Where the N3D
+ * format has the address of something in the model, the blob has its
+ * offset from the start of the blob. Where it has anything else that
+ * only the assembler knows (the texture labels, and the blitter flags
+ * for the bitmaps) the blob has 0.
+ *
+ * After that come, also phrase aligned:
+ *   - the relocation table: the offset of every long that holds an
+ *     offset, one long each;
+ *   - the fixup table: for every long the stub has to fill in, its
+ *     offset, the offset of the expression to put there (a string,
+ *     below), and flags (FIXUP_EXTERN if it names a texture);
+ *   - the expressions, each with a trailing 0;
+ *   - the trailer, which is the blob's last 16 bytes: BLOB_MAGIC,
+ *     the offset of the relocation table, the number of relocations
+ *     and the number of fixups (the fixup table follows the
+ *     relocation table directly).
+ *
+ * The stub defines the usual label (e.g. _robotdata) at the start
+ * of the blob, and a routine (_robotreloc) to call before the model
+ * is used: it adds the blob's address to all the offsets, and fills
+ * in the fixups. Calling it again does nothing. Everything the stub
+ * needs is in the blob, so it can be written again from the blob
+ * alone (which is what happens when the blob comes from the cache).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <stdint.h>
+
+#ifdef __DUMB_MSDOS__
+#include <alloc.h>
+#define mymalloc farmalloc
+#define myfree farfree
+#else
+#define mymalloc malloc
+#define myfree free
+#endif
+
+#include "internal.h"
+#include "proto.h"
+
+#define BLOB_MAGIC	0x4e334442		/* "N3DB" */
+#define BLOB_TRAILER	16			/* size of the trailer */
+#define FIXUP_EXTERN	1			/* the fixup is an external label */
+#define MAXSTUBSIZE	(16L*1024*1024)		/* most fixup data we believe in */
+
+/* convert a float to a signed integer */
+#define TOINT(x) ((int)rint((x)))
+
+/* convert a float to a 0.14 fixed point number: uses the "tofixed" function */
+#define TOFIXED(x)  ( ((int)rint(16384.0*(x))) & 0x0000ffff)
+
+/* convert a float to a 0.8 fixed point number */
+#define TOBYTE(x) ((int)((x)*255.9))
+
+/* default texture coordinates */
+static double
+default_u[MAXVERTICES] = { 0.0, 0.0, 1.0, 1.0, 0.0, 0.0, 1.0, 1.0 };
+
+static double
+default_v[MAXVERTICES] = { 0.0, 1.0, 0.0, 1.0, 0.0, 1.0, 0.0, 1.0 };
+
+/*
+ * where an object's structures are in the blob
+ */
+typedef struct objlabels {
+	long node;			/* hierarchy entry (with animation) */
+	long data;			/* header */
+	long faces;			/* face list */
+	long verts;			/* vertex list */
+	long anim;			/* animation frames, or 0 */
+} ObjLabels;
+
+typedef struct fixup {
+	long where;			/* offset of the long to fill in */
+	long expr;			/* offset of its expression in the string table */
+	int flags;			/* FIXUP_xxx */
+} Fixup;
+
+/*
+ * The blob is laid out twice: once to find out where everything
+ * goes (e == 0), and then again to write it (when e is where it
+ * goes). The relocations and fixups are collected the first time.
+ */
+typedef struct binwriter {
+	Converter *cv;
+	Emitter	*e;			/* where the blob is written, or 0 when laying it out */
+	long	pos;			/* offset of the next byte */
+	int	err;			/* set if we ran out of memory */
+
+	ObjLabels *objs;		/* one per object */
+	long	*bitmaps;		/* bitmap header of each material with a texture */
+	long	matlist;		/* material list */
+
+	long	*relocs;		/* relocation table */
+	int	numrelocs, maxrelocs;
+	Fixup	*fixups;		/* fixup table */
+	int	numfixups, maxfixups;
+	char	*strings;		/* the fixups' expressions */
+	long	strsize, maxstrings;
+} BinWriter;
+
+static void
+put(BinWriter *w, const unsigned char *p, int n)
+{
+	if (w->e)
+		EmitBytes(w->e, p, n);
+	w->pos += n;
+}
+
+static void
+put16(BinWriter *w, unsigned x)
+{
+	unsigned char p[2];
+
+	p[0] = x >> 8; p[1] = x;
+	put(w, p, 2);
+}
+
+static void
+put32(BinWriter *w, uint32_t x)
+{
+	unsigned char p[4];
+
+	p[0] = x >> 24; p[1] = x >> 16; p[2] = x >> 8; p[3] = x;
+	put(w, p, 4);
+}
+
+/* pad with zeros to the next phrase boundary */
+static void
+phrase(BinWriter *w)
+{
+	static const unsigned char zeros[8];
+
+	put(w, zeros, (int)(-w->pos & 7));
+}
+
+/*
+ * a long holding the address of something in the blob (at offset
+ * "target"; only known the second time round, if it comes later)
+ */
+static void
+putaddr(BinWriter *w, long target)
+{
+	void *tab;
+
+	if (!w->e) {
+		if (w->numrelocs >= w->maxrelocs) {
+			tab = ArenaRealloc(w->cv->arena, w->relocs, (w->maxrelocs + 256) * sizeof(long));
+			if (!tab) {
+				w->err = 1;
+				return;
+			}
+			w->relocs = tab;
+			w->maxrelocs += 256;
+		}
+		w->relocs[w->numrelocs++] = w->pos;
+	}
+	put32(w, target);
+}
+
+/*
+ * a long that the stub fills in with the value of "expr"
+ */
+static void
+putfixup(BinWriter *w, char *expr, int flags)
+{
+	void *tab;
+	long len = strlen(expr) + 1;
+
+	if (!w->e) {
+		if (w->numfixups >= w->maxfixups) {
+			tab = ArenaRealloc(w->cv->arena, w->fixups, (w->maxfixups + 16) * sizeof(Fixup));
+			if (!tab) {
+				w->err = 1;
+				return;
+			}
+			w->fixups = tab;
+			w->maxfixups += 16;
+		}
+		if (w->strsize + len > w->maxstrings) {
+			tab = ArenaRealloc(w->cv->arena, w->strings, w->strsize + len + 1024);
+			if (!tab) {
+				w->err = 1;
+				return;
+			}
+			w->strings = tab;
+			w->maxstrings = w->strsize + len + 1024;
+		}
+		w->fixups[w->numfixups].where = w->pos;
+		w->fixups[w->numfixups].expr = w->strsize;
+		w->fixups[w->numfixups].flags = flags;
+		w->numfixups++;
+		memcpy(w->strings + w->strsize, expr, len);
+		w->strsize += len;
+	}
+	put32(w, 0);
+}
+
+static void
+putheader(BinWriter *w, int i)
+{
+	Converter *cv = w->cv;
+	Object *obj = OBJECT(cv, i);
+
+	phrase(w);
+	w->objs[i].data = w->pos;
+	put16(w, obj->numPolys);
+	put16(w, obj->numVerts);
+	put16(w, cv->numMaterials);
+	put16(w, 0);
+	putaddr(w, w->objs[i].faces);
+	putaddr(w, w->objs[i].verts);
+	putaddr(w, w->matlist);
+}
+
+static void
+putfaces(BinWriter *w, int i)
+{
+	Converter *cv = w->cv;
+	Object *obj = OBJECT(cv, i);
+	VertexArrays *V = &obj->verts;
+	Face *p;
+	FaceNormal *n;
+	Corner *c;
+	double fd, text_u, text_v;
+	int f, j;
+
+	phrase(w);
+	w->objs[i].faces = w->pos;
+	if (!w->e) {
+		/* all we need to know is how big it is */
+		for (f = 0, p = obj->facetab; f < obj->numPolys; f++, p++)
+			w->pos += 12 + 4 * p->numverts;
+		return;
+	}
+	p = obj->facetab;
+	n = obj->normtab;
+	for (f = 0; f < obj->numPolys; f++, p++, n++) {
+		c = &obj->corntab[p->first];
+		fd = n->fx * V->x[c[0].vert] + n->fy * V->y[c[0].vert] + n->fz * V->z[c[0].vert];
+		put16(w, TOFIXED(n->fx));
+		put16(w, TOFIXED(n->fy));
+		put16(w, TOFIXED(n->fz));
+		put16(w, TOINT(-fd));
+		put16(w, p->numverts);
+		put16(w, p->material);
+		for (j = 0; j < p->numverts; j++) {
+			/* if texture coordinates are provided, use those */
+			if (cv->mattab[p->material].texmap) {
+				text_u = c[j].u; text_v = c[j].v;
+			} else {
+				text_u = default_u[j]; text_v = default_v[j];
+			}
+			put16(w, c[j].vert);
+			put16(w, ((TOBYTE(text_u) & 0xff) << 8) | (TOBYTE(text_v) & 0xff));
+		}
+	}
+}
+
+static void
+putverts(BinWriter *w, int i)
+{
+	Object *obj = OBJECT(w->cv, i);
+	VertexArrays *V = &obj->verts;
+	int j;
+
+	phrase(w);
+	w->objs[i].verts = w->pos;
+	if (!w->e) {
+		w->pos += 12L * obj->numVerts;
+		return;
+	}
+	for (j = 0; j < obj->numVerts; j++) {
+		put16(w, TOINT(V->x[j]));
+		put16(w, TOINT(V->y[j]));
+		put16(w, TOINT(V->z[j]));
+		put16(w, TOFIXED(V->vx[j]));
+		put16(w, TOFIXED(V->vy[j]));
+		put16(w, TOFIXED(V->vz[j]));
+	}
+}
+
+static void
+putmats(BinWriter *w)
+{
+	Converter *cv = w->cv;
+	Material *m;
+	char label[LABELSIZE];
+	char flags[64];
+	int i;
+
+	phrase(w);
+	w->matlist = w->pos;
+	for (i = 0, m = cv->mattab; i < cv->numMaterials; i++, m++) {
+		put16(w, rgb2cry(m->red, m->green, m->blue));
+		put16(w, 0);
+		if (m->texmap)
+			putaddr(w, w->bitmaps[i]);
+		else
+			put32(w, 0);			/* no texture */
+	}
+
+	/* now the bitmap definitions for the textures */
+	for (i = 0, m = cv->mattab; i < cv->numMaterials; i++, m++) {
+		if (m->texmap) {
+			phrase(w);
+			w->bitmaps[i] = w->pos;
+			put16(w, m->twidth);
+			put16(w, m->theight);
+			sprintf(flags, "PITCH1|PIXEL16|WID%d", m->twidth);
+			putfixup(w, flags, 0);
+			putfixup(w, name2label(cv, m->texmap, label), FIXUP_EXTERN);
+		}
+	}
+}
+
+static void
+putanims(BinWriter *w, int i)
+{
+	Object *obj = OBJECT(w->cv, i);
+	Matrix *M;
+	int j;
+
+	if (!obj->numframes)
+		return;
+	phrase(w);
+	w->objs[i].anim = w->pos;
+	put16(w, 1);				/* frame animation */
+	put16(w, 0);
+	put16(w, obj->numframes);
+	put16(w, 2);				/* frames per 300th of a second */
+	put32(w, 0);				/* current frame number */
+	for (j = 0; j < obj->numframes; j++) {
+		M = &obj->frames[j];
+		put16(w, TOFIXED(M->xrite)); put16(w, TOFIXED(M->yrite)); put16(w, TOFIXED(M->zrite));
+		put16(w, TOFIXED(M->xdown)); put16(w, TOFIXED(M->ydown)); put16(w, TOFIXED(M->zdown));
+		put16(w, TOFIXED(M->xhead)); put16(w, TOFIXED(M->yhead)); put16(w, TOFIXED(M->zhead));
+		put16(w, TOINT(M->xposn)); put16(w, TOINT(M->yposn)); put16(w, TOINT(M->zposn));
+	}
+}
+
+/*
+ * the hierarchy: the pointer to the root object, and an entry for
+ * each object, as in write_output_file()
+ */
+static void
+puttree(BinWriter *w, Object *rootobj)
+{
+	Converter *cv = w->cv;
+	Object *obj;
+	int i;
+
+	putaddr(w, w->objs[rootobj->index].node);
+	phrase(w);		/* the entries are 40 bytes, so they all stay phrase aligned */
+	for (i = 0; i < cv->numObjs; i++) {
+		obj = OBJECT(cv, i);
+		w->objs[i].node = w->pos;
+		putaddr(w, w->objs[i].data);
+		put16(w, 0x4000); put16(w, 0); put16(w, 0);
+		put16(w, 0); put16(w, 0x4000); put16(w, 0);
+		put16(w, 0); put16(w, 0); put16(w, 0x4000);
+		put16(w, 0); put16(w, 0); put16(w, 0);
+		if (obj->siblings)
+			putaddr(w, w->objs[obj->siblings->index].node);
+		else
+			put32(w, 0);
+		if (obj->children)
+			putaddr(w, w->objs[obj->children->index].node);
+		else
+			put32(w, 0);
+		if (obj->numframes)
+			putaddr(w, w->objs[i].anim);
+		else
+			put32(w, 0);		/* no animation */
+	}
+}
+
+/*
+ * the blob itself; the first time round this works out where
+ * everything goes
+ */
+static void
+putmodel(BinWriter *w, Object *rootobj)
+{
+	Converter *cv = w->cv;
+	int i;
+
+	w->pos = 0;
+	if (rootobj)
+		puttree(w, rootobj);
+	for (i = 0; i < cv->numObjs; i++) {
+		putheader(w, i);
+		putfaces(w, i);
+		putverts(w, i);
+		if (i == 0)
+			putmats(w);
+		if (rootobj)
+			putanims(w, i);
+	}
+}
+
+/*
+ * the relocation and fixup tables, and the trailer
+ */
+static void
+puttables(BinWriter *w)
+{
+	long reloctab, strtab;
+	int i;
+
+	phrase(w);
+	reloctab = w->pos;
+	for (i = 0; i < w->numrelocs; i++)
+		put32(w, w->relocs[i]);
+	strtab = w->pos + 12L * w->numfixups;
+	for (i = 0; i < w->numfixups; i++) {
+		put32(w, w->fixups[i].where);
+		put32(w, strtab + w->fixups[i].expr);
+		put32(w, w->fixups[i].flags);
+	}
+	put(w, (unsigned char *)w->strings, (int)w->strsize);
+	while (w->pos & 3)
+		put(w, (unsigned char *)"", 1);
+	put32(w, BLOB_MAGIC);
+	put32(w, reloctab);
+	put32(w, w->numrelocs);
+	put32(w, w->numfixups);
+}
+
+/*
+ * the name of the stub for the blob in fname
+ * returns: the name, or 0 (after printing an error) if there isn't one
+ */
+static char *
+stubfilename(Converter *cv, char *fname)
+{
+	char *stubname;
+
+	stubname = change_extension(cv, fname, ".s");
+	if (stubname && !strcmp(stubname, fname)) {
+		fprintf(stderr, "%s: the output file for a binary model can't end in .s\n", fname);
+		return 0;
+	}
+	return stubname;
+}
+
+/*
+ * write the model as a blob, in fname, and its stub
+ * returns: 0 on success, 1 on failure
+ */
+int
+BINwritefile(Converter *cv, char *fname)
+{
+	BinWriter bw;
+	BinWriter *w = &bw;
+	Object *rootobj;
+	Output *f;
+	Emitter em;
+	int ret;
+
+	if (!stubfilename(cv, fname))
+		return 1;
+	memset(w, 0, sizeof(*w));
+	w->cv = cv;
+	rootobj = 0;
+	if (cv->animflag) {
+		rootobj = FixObjectLists(cv);
+		if (!rootobj)
+			return 1;
+	}
+	w->objs = ArenaCalloc(cv->arena, cv->numObjs + 1, sizeof(ObjLabels));
+	w->bitmaps = ArenaCalloc(cv->arena, cv->numMaterials + 1, sizeof(long));
+	if (!w->objs || !w->bitmaps) {
+		fprintf(stderr, "%s: insufficient memory\n", cv->progname);
+		return 1;
+	}
+
+	/* find out where everything goes */
+	putmodel(w, rootobj);
+	if (w->err) {
+		fprintf(stderr, "%s: insufficient memory\n", cv->progname);
+		return 1;
+	}
+
+	/* and write it there */
+	f = OpenOutput(fname, 1);
+	if (!f)
+		return 1;
+	if (InitEmitter(&em, f) != 0) {
+		fprintf(stderr, "%s: insufficient memory\n", cv->progname);
+		CloseOutput(f);
+		return 1;
+	}
+	w->e = &em;
+	putmodel(w, rootobj);
+	puttables(w);
+	ret = 0;
+	if (FinishEmitter(&em) != 0)
+		ret = 1;
+	if (CloseOutput(f) != 0)
+		ret = 1;
+	if (ret) {
+		fprintf(stderr, "%s: error writing %s\n", cv->progname, fname);
+		return 1;
+	}
+	return BINwritestub(cv, fname) ? 1 : 0;
+}
+
+/* a big endian long from the blob */
+static long
+get32(const unsigned char *p)
+{
+	return (long)(((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3]);
+}
+
+/*
+ * write the stub for the blob in fname (in a file with the same
+ * name but the extension .s), from what the blob says about itself
+ * returns: 0 on success, 1 on failure
+ */
+int
+BINwritestub(Converter *cv, char *fname)
+{
+	FILE *f;
+	Output *out;
+	Emitter em;
+	Emitter *e = &em;
+	unsigned char trailer[BLOB_TRAILER];
+	unsigned char *tab, *fix;
+	char *stubname, *blobname, *expr, *s;
+	long size, reloctab, numrelocs, numfixups, fixtab, tabsize, where, str;
+	char *label = cv->defaultlabel;
+	int i, ret;
+
+	stubname = stubfilename(cv, fname);
+	if (!stubname)
+		return 1;
+	/* the stub goes next to the blob, so it refers to it by its
+	 * name alone; the directory is only right from where we are
+	 */
+	blobname = fname;
+	for (s = fname; *s; s++) {
+		if (*s == '\\' || *s == '/' || *s == ':')
+			blobname = s + 1;
+	}
+
+	/* read the fixup table and the expressions */
+	f = fopen(fname, "rb");
+	if (!f) {
+		perror(fname);
+		return 1;
+	}
+	tab = 0;
+	ret = -1;
+	if (fseek(f, 0L, SEEK_END) == 0 && (size = ftell(f)) >= BLOB_TRAILER &&
+	    fseek(f, size - BLOB_TRAILER, SEEK_SET) == 0 &&
+	    fread(trailer, 1, BLOB_TRAILER, f) == BLOB_TRAILER &&
+	    get32(trailer) == BLOB_MAGIC) {
+		reloctab = get32(trailer+4);
+		numrelocs = get32(trailer+8);
+		numfixups = get32(trailer+12);
+		fixtab = reloctab + 4 * numrelocs;
+		tabsize = size - BLOB_TRAILER - fixtab;
+		if (reloctab >= 0 && numrelocs >= 0 && numfixups >= 0 && fixtab >= reloctab &&
+		    tabsize >= 12 * numfixups && tabsize <= MAXSTUBSIZE &&
+		    (tab = mymalloc(tabsize + 1)) != NULL &&
+		    fseek(f, fixtab, SEEK_SET) == 0 &&
+		    fread(tab, 1, tabsize, f) == (size_t)tabsize)
+			ret = 0;
+	}
+	fclose(f);
+	if (ret == 0) {
+		tab[tabsize] = 0;	/* so every expression ends */
+		for (i = 0, fix = tab; i < numfixups; i++, fix += 12) {
+			str = get32(fix+4) - fixtab;
+			if (str < 12 * numfixups || str >= tabsize)
+				ret = -1;
+		}
+	}
+	if (ret != 0) {
+		fprintf(stderr, "%s: not a binary model\n", fname);
+		myfree(tab);
+		return 1;
+	}
+
+	out = OpenOutput(stubname, 0);
+	if (!out) {
+		myfree(tab);
+		return 1;
+	}
+	if (InitEmitter(e, out) != 0) {
+		fprintf(stderr, "%s: insufficient memory\n", cv->progname);
+		CloseOutput(out);
+		myfree(tab);
+		return 1;
+	}
+
+	EmitStr(e, ";*========================================\n");
+	EmitStr(e, "; 3D Library Binary Data File\n");
+	EmitStr(e, ";*========================================\n\n");
+	if (cv->outputheader) {
+		EmitStr(e, "\n\t.include\t'jaguar.inc'\n\n");
+		if (cv->usedataseg)
+			EmitStr(e, "\t.data\n");
+	}
+	for (i = 0, fix = tab; i < numfixups; i++, fix += 12) {
+		if (get32(fix+8) & FIXUP_EXTERN)
+			EmitPrintf(e, "\t.extern\t%s\n", (char *)tab + get32(fix+4) - fixtab);
+	}
+	EmitPrintf(e, "\t.globl\t%sdata\n", label);
+	EmitPrintf(e, "\t.globl\t%sreloc\n", label);
+	EmitStr(e, "\t.phrase\n");
+	EmitPrintf(e, "%sdata:\n", label);
+	EmitPrintf(e, "\t.incbin\t\"%s\"\n", blobname);
+	EmitPrintf(e, "%sdata_end:\n\n", label);
+
+	EmitPrintf(e, "; %sreloc: call this once before using the model; it turns the\n", label);
+	EmitStr(e, "; offsets in it into addresses, and fills in the texture addresses\n");
+	if (cv->outputheader && cv->usedataseg)
+		EmitStr(e, "\t.text\n");
+	EmitPrintf(e, "%sreloc:\n", label);
+	EmitStr(e, "\tmovem.l\td0-d2/a0-a2,-(sp)\n");
+	EmitPrintf(e, "\tlea\t%sdata,a0\n", label);
+	EmitStr(e, "\tmove.l\ta0,d0\n");
+	EmitPrintf(e, "\tlea\t%sdata_end,a2\n", label);
+	EmitStr(e, "\tmovea.l\t-12(a2),a1\t; relocation table\n");
+	EmitStr(e, "\tadda.l\td0,a1\n");
+	EmitStr(e, "\tmove.l\t-8(a2),d1\t; number of relocations\n");
+	EmitStr(e, "\tclr.l\t-8(a2)\t\t; (they only need doing once)\n");
+	EmitStr(e, "\tbra.s\t.next\n");
+	EmitStr(e, ".reloc:\n");
+	EmitStr(e, "\tmove.l\t(a1)+,d2\n");
+	EmitStr(e, "\tadd.l\td0,0(a0,d2.l)\n");
+	EmitStr(e, ".next:\n");
+	EmitStr(e, "\tsubq.l\t#1,d1\n");
+	EmitStr(e, "\tbpl.s\t.reloc\n");
+	for (i = 0, fix = tab; i < numfixups; i++, fix += 12) {
+		where = get32(fix);
+		expr = (char *)tab + get32(fix+4) - fixtab;
+		EmitPrintf(e, "\tmove.l\t#$%lx,d2\n", where);
+		EmitPrintf(e, "\tmove.l\t#%s,0(a0,d2.l)\n", expr);
+	}
+	EmitStr(e, "\tmovem.l\t(sp)+,d0-d2/a0-a2\n");
+	EmitStr(e, "\trts\n");
+	myfree(tab);
+
+	ret = 0;
+	if (FinishEmitter(e) != 0)
+		ret = 1;
+	if (CloseOutput(out) != 0)
+		ret = 1;
+	if (ret)
+		fprintf(stderr, "%s: error writing %s\n", cv->progname, stubname);
+	return ret;
+}
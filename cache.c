@@ -0,0 +1,782 @@
+/*
+ * Conversion cache for 3DSCONV.
+ *
+ * With -cache dir, every conversion is saved in "dir", and
+ * converting the same thing again just copies the saved output.
+ * "The same thing" means the same input file contents, the same
+ * options, the same converter version (CACHE_VERSION in internal.h)
+ * and the same texture files, so the cache never has to be cleared
+ * by hand; files in it that are no longer wanted can simply be
+ * deleted.
+ *
+ * Which textures a model uses isn't known until it has been read,
+ * so there are two kinds of file in the cache:
+ *   - key.dep, where the key is a hash of the version, options
+ *     and input file: the names of the textures the conversion
+ *     looked for;
+ *   - key.out, where the key is a hash of the .dep key and the
+ *     names and contents of those textures: the output itself.
+ * The hash is 128 bit FNV-1a, which is plenty to make accidental
+ * collisions a non-issue (it is not meant to stand up to anyone
+ * deliberately making them).
+ *
+ * The model the output was written from (see model.c) is saved as
+ * well, the same way but under keys that leave out the options that
+ * only affect how it is written out: key.dep for its textures, and
+ * key.mdl for the model. So converting a file to another format
+ * only has to load the model and write it out.
+ *
+ * When a multi-object 3DS file has changed, most of its objects
+ * usually haven't; so each of those is saved too, after it has been
+ * cleaned up, in key.geo, where the key is a hash of the object's
+ * mesh chunk, the materials it uses and the options that affect its
+ * cleanup. Only the objects whose keys aren't there get cleaned up.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+
+#if defined(_WIN32)
+#include <process.h>
+#define getpid _getpid
+#elif !defined(__DUMB_MSDOS__) && !defined(__MSDOS__)
+#include <unistd.h>
+#else
+#define getpid() 0
+#endif
+
+#ifdef __DUMB_MSDOS__
+#include <alloc.h>
+#define mymalloc farmalloc
+#define myfree farfree
+#else
+#define mymalloc malloc
+#define myfree free
+#endif
+
+#include "internal.h"
+#include "proto.h"
+
+#define CACHE_MAGIC	"3dsconv cache 1"	/* first line of a .dep file */
+#define GEO_MAGIC	"3dsconv geo 2"		/* start of a .geo file */
+#define GEO_HEADERSIZE	28			/* the magic (16 bytes) and 3 counts */
+#define GEO_BUFSIZE	8192
+#define COPYBUFSIZE	65536
+
+typedef struct hash128 {
+	uint64_t hi, lo;
+} Hash128;
+
+static void
+hashinit(Hash128 *h)
+{
+	h->hi = 0x6c62272e07bb0142u;		/* the FNV-1a 128 bit offset basis */
+	h->lo = 0x62b821756295c58du;
+}
+
+static void
+hashbytes(Hash128 *h, const void *data, size_t n)
+{
+	const unsigned char *p = data;
+	uint64_t hi = h->hi, lo = h->lo;
+	uint64_t p0, p1;
+
+	while (n-- > 0) {
+		lo ^= *p++;
+		/* multiply by the FNV prime, 2^88 + 0x13b */
+		p0 = (lo & 0xffffffffu) * 0x13b;
+		p1 = (lo >> 32) * 0x13b + (p0 >> 32);
+		hi = hi * 0x13b + (p1 >> 32) + (lo << 24);
+		lo = (p1 << 32) | (p0 & 0xffffffffu);
+	}
+	h->hi = hi;
+	h->lo = lo;
+}
+
+/* hash a string, with its trailing 0 so that strings can't run together */
+static void
+hashstring(Hash128 *h, const char *s)
+{
+	hashbytes(h, s, strlen(s) + 1);
+}
+
+/* turn a hash into a key: 32 hex digits */
+static void
+hashkey(Hash128 *h, char *key)
+{
+	sprintf(key, "%016" PRIx64 "%016" PRIx64, h->hi, h->lo);
+}
+
+/*
+ * make the name of file "key" + "ext" in the cache directory;
+ * returns 0 on success, -1 if the name is too long
+ */
+static int
+cachename(Converter *cv, char *key, char *ext, char *name)
+{
+	size_t len = strlen(cv->cachedir);
+	char *sep = "/";
+
+	if (len > 0 && (cv->cachedir[len-1] == '/' || cv->cachedir[len-1] == '\\'))
+		sep = "";
+	if (len + strlen(key) + strlen(ext) + 2 > FILENAME_MAX) {
+		fprintf(stderr, "%s: cache directory name too long\n", cv->cachedir);
+		return -1;
+	}
+	sprintf(name, "%s%s%s%s", cv->cachedir, sep, key, ext);
+	return 0;
+}
+
+/*
+ * make a temporary name to write "name" under, so that nobody
+ * (not even another 3dsconv) ever sees it half written; "owner"
+ * is whatever is writing it (a converter or an object)
+ */
+static int
+tempname(void *owner, char *name, char *temp)
+{
+	char suffix[64];
+
+	sprintf(suffix, ".%ld.%lx.tmp", (long)getpid(), (unsigned long)(uintptr_t)owner);
+	if (strlen(name) + strlen(suffix) >= FILENAME_MAX)
+		return -1;
+	sprintf(temp, "%s%s", name, suffix);
+	return 0;
+}
+
+/*
+ * put a finished temporary file in place; if that fails because
+ * some other conversion got there first, that's fine too
+ */
+static void
+replacefile(char *temp, char *name)
+{
+	if (rename(temp, name) != 0)
+		remove(temp);
+}
+
+/*
+ * copy file "from" to "to" (leaving "to" alone if it's the same)
+ * returns: 0 on success, otherwise -1
+ */
+static int
+copy_file(char *from, char *to)
+{
+	FILE *in;
+	Output *out;
+	char *buf;
+	size_t n;
+	int ret;
+
+	buf = mymalloc(COPYBUFSIZE);
+	if (!buf)
+		return -1;
+	in = fopen(from, "rb");
+	if (!in) {
+		myfree(buf);
+		return -1;
+	}
+	out = OpenOutput(to, 1);
+	if (!out) {
+		fclose(in);
+		myfree(buf);
+		return -1;
+	}
+	ret = 0;
+	while ((n = fread(buf, 1, COPYBUFSIZE, in)) > 0)
+		buf = OutputBuffer(out, buf, n, COPYBUFSIZE);
+	if (ferror(in))
+		ret = -1;
+	fclose(in);
+	if (CloseOutput(out) != 0)
+		ret = -1;
+	myfree(buf);
+	return ret;
+}
+
+/*
+ * work out the key for a conversion's output (or model), from its
+ * .dep key and the textures in cv->texdeps
+ * returns: 0 on success, otherwise -1
+ */
+static int
+outputkey(Converter *cv, char *depkey, char *key)
+{
+	Hash128 h;
+	FILE *f;
+	char *buf;
+	char path[FILENAME_MAX];
+	size_t n;
+	int i;
+
+	buf = mymalloc(COPYBUFSIZE);
+	if (!buf)
+		return -1;
+	hashinit(&h);
+	hashstring(&h, depkey);
+	for (i = 0; i < cv->numtexdeps; i++) {
+		hashstring(&h, cv->texdeps[i]);
+		f = NULL;
+		if (strlen(cv->filepath) + strlen(cv->texdeps[i]) < FILENAME_MAX)
+			f = open_texture(cv->filepath, cv->texdeps[i], path);
+		if (!f) {
+			hashbytes(&h, "-", 1);		/* it's missing */
+			continue;
+		}
+		hashbytes(&h, "+", 1);
+		while ((n = fread(buf, 1, COPYBUFSIZE, f)) > 0)
+			hashbytes(&h, buf, n);
+		fclose(f);
+		hashbytes(&h, "+", 1);
+	}
+	myfree(buf);
+	hashkey(&h, key);
+	return 0;
+}
+
+/*
+ * read the texture names from a .dep file into cv->texdeps
+ * returns: 0 on success, otherwise -1 (the file isn't there,
+ * or is no good)
+ */
+static int
+readdeps(Converter *cv, char *name)
+{
+	FILE *f;
+	char line[FILENAME_MAX+2];
+	char *s;
+	int ret;
+
+	f = fopen(name, "r");
+	if (!f)
+		return -1;
+	ret = -1;
+	if (fgets(line, sizeof(line), f) && !strcmp(line, CACHE_MAGIC "\n")) {
+		ret = 0;
+		while (ret == 0 && fgets(line, sizeof(line), f)) {
+			s = strchr(line, '\n');
+			if (!s) {
+				ret = -1;	/* too long, or cut short */
+				break;
+			}
+			*s = 0;
+			ret = CacheAddTexture(cv, line);
+		}
+	}
+	fclose(f);
+	return ret;
+}
+
+/*
+ * write the texture names in cv->texdeps to the .dep file for key
+ * returns: 0 on success, otherwise -1
+ */
+static int
+writedeps(Converter *cv, char *key)
+{
+	FILE *f;
+	char name[FILENAME_MAX], temp[FILENAME_MAX];
+	int i;
+
+	for (i = 0; i < cv->numtexdeps; i++) {
+		if (strchr(cv->texdeps[i], '\n'))
+			return -1;	/* can't be written in a .dep file */
+	}
+	if (cachename(cv, key, ".dep", name) != 0 || tempname(cv, name, temp) != 0 ||
+	    (f = fopen(temp, "w")) == NULL)
+		return -1;
+	fprintf(f, "%s\n", CACHE_MAGIC);
+	for (i = 0; i < cv->numtexdeps; i++)
+		fprintf(f, "%s\n", cv->texdeps[i]);
+	if (ferror(f) | fclose(f)) {
+		remove(temp);
+		return -1;
+	}
+	replacefile(temp, name);
+	return 0;
+}
+
+/*
+ * remember that the conversion looked for texture file "texmap"
+ * (in cv->filepath); the texture becomes part of the cache key
+ * returns: 0 on success, -1 if we ran out of memory (in which
+ * case the conversion won't be saved)
+ */
+int
+CacheAddTexture(Converter *cv, char *texmap)
+{
+	void *tab;
+	int i;
+
+	for (i = 0; i < cv->numtexdeps; i++) {
+		if (!strcmp(cv->texdeps[i], texmap))
+			return 0;
+	}
+	if (cv->numtexdeps >= cv->maxtexdeps) {
+		tab = ArenaRealloc(cv->arena, cv->texdeps, (cv->maxtexdeps + 16) * sizeof(char *));
+		if (!tab) {
+			cv->cachekey[0] = 0;
+			return -1;
+		}
+		cv->texdeps = tab;
+		cv->maxtexdeps += 16;
+	}
+	cv->texdeps[cv->numtexdeps] = ArenaStrdup(cv->arena, texmap);
+	if (!cv->texdeps[cv->numtexdeps]) {
+		cv->cachekey[0] = 0;
+		return -1;
+	}
+	cv->numtexdeps++;
+	return 0;
+}
+
+/*
+ * look for a saved conversion of cv->infilename (with the options
+ * in cv), and if there is one copy it to cv->outfilename. This also
+ * works out the keys that CacheStore() and CacheSaveModel() will
+ * save the conversion and its model under.
+ * returns: 1 if the output was found in the cache, 0 if it has to
+ * be converted, -1 if the input file can't be read
+ */
+int
+CacheLookup(Converter *cv, char *filetype)
+{
+	Hash128 h;
+	MappedFile mf;
+	char buf[512];
+	char depname[FILENAME_MAX], outname[FILENAME_MAX];
+	char inkey[CACHEKEYSIZE], outkey[CACHEKEYSIZE];
+
+	cv->cachekey[0] = 0;
+	cv->modelkey[0] = 0;
+	cv->numtexdeps = 0;
+
+	/* the input file, which both keys depend on */
+	hashinit(&h);
+	hashstring(&h, filetype);
+	if (map_file(cv->infilename, &mf) != 0)
+		return -1;
+	hashbytes(&h, mf.data, mf.size);
+	unmap_file(&mf);
+	hashkey(&h, inkey);
+
+	/* the model depends on the options used to read and clean it up */
+	hashinit(&h);
+	hashstring(&h, "3dsconv model " VERSION "/" CACHE_VERSION);
+	sprintf(buf, "scale %.17g merge %d maxmerge %d multiobj %d anim %d "
+		"pointdelta %.17g facedelta %.17g",
+		cv->uscale, cv->merge_tris, cv->maxmerge, cv->multiobject, cv->animflag,
+		cv->pointdelta, cv->facedelta);
+	hashstring(&h, buf);
+	hashstring(&h, inkey);
+	hashkey(&h, cv->modelkey);
+
+	/* and the output on all of them */
+	hashinit(&h);
+	hashstring(&h, "3dsconv " VERSION "/" CACHE_VERSION);
+	sprintf(buf, "format %d scale %.17g clabels %d merge %d maxmerge %d multiobj %d anim %d "
+		"dataseg %d header %d pointdelta %.17g facedelta %.17g compact %d",
+		cv->output_format, cv->uscale, cv->clabels, cv->merge_tris, cv->maxmerge,
+		cv->multiobject, cv->animflag, cv->usedataseg, cv->outputheader,
+		cv->pointdelta, cv->facedelta, cv->compact);
+	hashstring(&h, buf);
+	hashstring(&h, cv->defaultlabel);
+	hashstring(&h, inkey);
+	hashkey(&h, cv->cachekey);
+
+	if (cachename(cv, cv->cachekey, ".dep", depname) != 0) {
+		cv->cachekey[0] = cv->modelkey[0] = 0;
+		return 0;
+	}
+	if (readdeps(cv, depname) != 0 || outputkey(cv, cv->cachekey, outkey) != 0 ||
+	    cachename(cv, outkey, ".out", outname) != 0 ||
+	    copy_file(outname, cv->outfilename) != 0) {
+		/* start again, and find out what the conversion really uses */
+		cv->numtexdeps = 0;
+		return 0;
+	}
+	if (cv->verbose)
+		fprintf(stdout, "Using saved conversion %s\n", outname);
+	return 1;
+}
+
+/*
+ * save a finished conversion (cv->outfilename) in the cache;
+ * if that can't be done we just warn about it, since the
+ * conversion itself worked
+ */
+void
+CacheStore(Converter *cv)
+{
+	char name[FILENAME_MAX], temp[FILENAME_MAX];
+	char outkey[CACHEKEYSIZE];
+	int ok;
+
+	if (!cv->cachekey[0])
+		return;			/* something went wrong earlier */
+
+	ok = 0;
+	if (writedeps(cv, cv->cachekey) == 0 && outputkey(cv, cv->cachekey, outkey) == 0 &&
+	    cachename(cv, outkey, ".out", name) == 0 && tempname(cv, name, temp) == 0) {
+		if (copy_file(cv->outfilename, temp) == 0) {
+			replacefile(temp, name);
+			ok = 1;
+		} else {
+			remove(temp);
+		}
+	}
+	if (!ok)
+		fprintf(stderr, "Warning: unable to save %s in the cache (%s)\n", cv->outfilename, cv->cachedir);
+}
+
+/*
+ * look for the model of cv->infilename (read with the options in
+ * cv) in the cache, and load it if it's there; CacheLookup() must
+ * have been called first
+ * returns: 0 if the model was loaded, -1 if it has to be made
+ */
+int
+CacheLoadModel(Converter *cv)
+{
+	char name[FILENAME_MAX];
+	char key[CACHEKEYSIZE];
+
+	if (!cv->modelkey[0])
+		return -1;
+	cv->numtexdeps = 0;
+	if (cachename(cv, cv->modelkey, ".dep", name) != 0 || readdeps(cv, name) != 0 ||
+	    outputkey(cv, cv->modelkey, key) != 0 || cachename(cv, key, ".mdl", name) != 0 ||
+	    LoadModel(cv, name, 1) != 0) {
+		cv->numtexdeps = 0;
+		return -1;
+	}
+	if (cv->verbose)
+		fprintf(stdout, "Using saved model %s\n", name);
+	return 0;
+}
+
+/*
+ * save the model in cv (read and cleaned up, but not yet written
+ * out) in the cache; like CacheStore(), this only warns if it
+ * can't be done
+ */
+void
+CacheSaveModel(Converter *cv)
+{
+	char name[FILENAME_MAX], temp[FILENAME_MAX];
+	char key[CACHEKEYSIZE];
+	int ok;
+
+	if (!cv->modelkey[0] || !cv->cachekey[0])
+		return;			/* something went wrong earlier */
+
+	ok = 0;
+	if (writedeps(cv, cv->modelkey) == 0 && outputkey(cv, cv->modelkey, key) == 0 &&
+	    cachename(cv, key, ".mdl", name) == 0 && tempname(cv, name, temp) == 0) {
+		if (SaveModel(cv, temp) == 0) {
+			replacefile(temp, name);
+			ok = 1;
+		}
+	}
+	if (!ok)
+		fprintf(stderr, "Warning: unable to save the model of %s in the cache (%s)\n", cv->infilename, cv->cachedir);
+}
+
+/*
+ * work out the key for an object's cleaned up geometry: "data" is
+ * its mesh chunk (all "length" bytes of it), "scale" what its
+ * coordinates are divided by, and "mats" the materials its
+ * material groups refer to, in order. The key is left in
+ * obj->geokey; if the object has a .geo file under that key,
+ * CacheLoadGeometry() will load it.
+ */
+void
+CacheGeometryKey(Object *obj, const void *data, long length, double scale, int *mats, int nmats)
+{
+	Converter *cv = obj->cv;
+	Hash128 h;
+	char buf[256];
+	int i;
+
+	hashinit(&h);
+	hashstring(&h, "3dsconv geo " VERSION "/" CACHE_VERSION);
+	sprintf(buf, "scale %.17g merge %d maxmerge %d pointdelta %.17g facedelta %.17g",
+		scale, cv->merge_tris, cv->maxmerge, cv->pointdelta, cv->facedelta);
+	hashstring(&h, buf);
+	for (i = 0; i < nmats; i++) {
+		sprintf(buf, "%d", mats[i]);
+		hashstring(&h, buf);
+	}
+	hashbytes(&h, "|", 1);
+	hashbytes(&h, data, (size_t)length);
+	hashkey(&h, obj->geokey);
+}
+
+/*
+ * a .geo file holds the object's vertex, face, face normal and
+ * corner tables, one field at a time in little endian order (as
+ * saved models are, see model.c), so it doesn't depend on how this
+ * compiler lays out the structures
+ */
+typedef struct geofile {
+	FILE	*f;
+	unsigned char buf[GEO_BUFSIZE];
+	size_t	pos;			/* next byte of buf to use */
+	size_t	len;			/* bytes of buf read in */
+	int	err;			/* set if a read or write failed */
+} GeoFile;
+
+static void
+put32(unsigned char *p, uint32_t x)
+{
+	p[0] = x; p[1] = x >> 8; p[2] = x >> 16; p[3] = x >> 24;
+}
+
+static void
+putdouble(unsigned char *p, double d)
+{
+	uint64_t x;
+
+	memcpy(&x, &d, sizeof(x));
+	put32(p, (uint32_t)x);
+	put32(p+4, (uint32_t)(x >> 32));
+}
+
+static uint32_t
+get32(const unsigned char *p)
+{
+	return p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static double
+getdouble(const unsigned char *p)
+{
+	uint64_t x;
+	double d;
+
+	x = get32(p) | ((uint64_t)get32(p+4) << 32);
+	memcpy(&d, &x, sizeof(d));
+	return d;
+}
+
+static void
+geoflush(GeoFile *g)
+{
+	if (g->pos > 0 && fwrite(g->buf, 1, g->pos, g->f) != g->pos)
+		g->err = 1;
+	g->pos = 0;
+}
+
+/* make room for n (<= GEO_BUFSIZE) bytes, and return where to put them */
+static unsigned char *
+geospace(GeoFile *g, size_t n)
+{
+	unsigned char *p;
+
+	if (g->pos + n > GEO_BUFSIZE)
+		geoflush(g);
+	p = g->buf + g->pos;
+	g->pos += n;
+	return p;
+}
+
+/*
+ * the next n (<= GEO_BUFSIZE) bytes of the file; if they aren't
+ * there, g->err is set (and what comes back is rubbish)
+ */
+static unsigned char *
+geodata(GeoFile *g, size_t n)
+{
+	unsigned char *p;
+
+	if (g->pos + n > g->len) {
+		memmove(g->buf, g->buf + g->pos, g->len - g->pos);
+		g->len -= g->pos;
+		g->pos = 0;
+		g->len += fread(g->buf + g->len, 1, GEO_BUFSIZE - g->len, g->f);
+		if (n > g->len) {
+			g->err = 1;
+			g->len = n;
+		}
+	}
+	p = g->buf + g->pos;
+	g->pos += n;
+	return p;
+}
+
+/* the vertex arrays of an object, in the order they are saved */
+static void
+vertexarrays(Object *obj, double **arrays)
+{
+	VertexArrays *V = &obj->verts;
+
+	arrays[0] = V->x; arrays[1] = V->y; arrays[2] = V->z;
+	arrays[3] = V->vx; arrays[4] = V->vy; arrays[5] = V->vz;
+	arrays[6] = V->u; arrays[7] = V->v;
+}
+
+/*
+ * load an object's cleaned up geometry from the cache, using the
+ * key in obj->geokey; the object must not have any geometry yet
+ * returns: 0 on success, -1 if it isn't there (or is no good)
+ */
+int
+CacheLoadGeometry(Object *obj)
+{
+	Converter *cv = obj->cv;
+	GeoFile *g;
+	Face *F;
+	FaceNormal *N;
+	Corner *C;
+	unsigned char *p;
+	char name[FILENAME_MAX];
+	double *arrays[8];
+	int numverts, numpolys, numcorners;
+	long size;
+	int i, j, ok;
+
+	if (!obj->geokey[0] || cachename(cv, obj->geokey, ".geo", name) != 0)
+		return -1;
+	g = mymalloc(sizeof(GeoFile));
+	if (!g)
+		return -1;
+	memset(g, 0, sizeof(GeoFile));
+	g->f = fopen(name, "rb");
+	if (!g->f) {
+		myfree(g);
+		return -1;
+	}
+	size = -1;
+	if (fseek(g->f, 0L, SEEK_END) == 0)
+		size = ftell(g->f);
+	rewind(g->f);
+	p = geodata(g, GEO_HEADERSIZE);
+	numverts = (int32_t)get32(p+16);
+	numpolys = (int32_t)get32(p+20);
+	numcorners = (int32_t)get32(p+24);
+	/* the counts have to match the size of the file, before
+	 * anything is allocated for them
+	 */
+	if (g->err || memcmp(p, GEO_MAGIC, sizeof(GEO_MAGIC)) != 0 ||
+	    numverts < 0 || numpolys < 0 || numcorners < 0 || size < 0 ||
+	    GEO_HEADERSIZE + 64 * (uint64_t)numverts + 36 * (uint64_t)numpolys +
+	    20 * (uint64_t)numcorners != (uint64_t)size ||
+	    ReserveVertices(obj, numverts) != 0 ||
+	    ReservePolygons(obj, numpolys, numcorners) != 0) {
+		fclose(g->f);
+		myfree(g);
+		FreeGeometry(obj);
+		return -1;
+	}
+
+	vertexarrays(obj, arrays);
+	for (i = 0; i < 8; i++) {
+		for (j = 0; j < numverts; j++)
+			arrays[i][j] = getdouble(geodata(g, 8));
+	}
+	for (i = 0, F = obj->facetab; i < numpolys; i++, F++) {
+		p = geodata(g, 12);
+		F->material = (int32_t)get32(p);
+		F->first = (int32_t)get32(p+4);
+		F->numverts = (int32_t)get32(p+8);
+	}
+	for (i = 0, N = obj->normtab; i < numpolys; i++, N++) {
+		p = geodata(g, 24);
+		N->fx = getdouble(p);
+		N->fy = getdouble(p+8);
+		N->fz = getdouble(p+16);
+	}
+	for (i = 0, C = obj->corntab; i < numcorners; i++, C++) {
+		p = geodata(g, 20);
+		C->vert = (int32_t)get32(p);
+		C->u = getdouble(p+4);
+		C->v = getdouble(p+12);
+	}
+	ok = !g->err && g->pos == g->len && getc(g->f) == EOF;
+	fclose(g->f);
+	myfree(g);
+	if (ok) {
+		obj->numVerts = numverts;
+		obj->numPolys = numpolys;
+		obj->numCorners = numcorners;
+		/* make sure a damaged file can't send us off the end of a table */
+		ok = (CheckGeometry(obj) == 0);
+	}
+	if (!ok) {
+		FreeGeometry(obj);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * save an object's cleaned up geometry in the cache, under the
+ * key in obj->geokey; like CacheStore(), this only warns if it
+ * can't be done
+ */
+void
+CacheSaveGeometry(Object *obj)
+{
+	Converter *cv = obj->cv;
+	GeoFile *g;
+	Face *F;
+	FaceNormal *N;
+	Corner *C;
+	unsigned char *p;
+	char name[FILENAME_MAX], temp[FILENAME_MAX];
+	double *arrays[8];
+	int i, j, ok;
+
+	if (!obj->geokey[0] || cachename(cv, obj->geokey, ".geo", name) != 0)
+		return;
+	ok = 0;
+	g = mymalloc(sizeof(GeoFile));
+	if (g && tempname(obj, name, temp) == 0 && (g->f = fopen(temp, "wb")) != NULL) {
+		g->pos = 0;
+		g->err = 0;
+		p = geospace(g, GEO_HEADERSIZE);
+		memset(p, 0, 16);
+		strcpy((char *)p, GEO_MAGIC);
+		put32(p+16, (uint32_t)obj->numVerts);
+		put32(p+20, (uint32_t)obj->numPolys);
+		put32(p+24, (uint32_t)obj->numCorners);
+
+		vertexarrays(obj, arrays);
+		for (i = 0; i < 8; i++) {
+			for (j = 0; j < obj->numVerts; j++)
+				putdouble(geospace(g, 8), arrays[i][j]);
+		}
+		for (i = 0, F = obj->facetab; i < obj->numPolys; i++, F++) {
+			p = geospace(g, 12);
+			put32(p, (uint32_t)F->material);
+			put32(p+4, (uint32_t)F->first);
+			put32(p+8, (uint32_t)F->numverts);
+		}
+		for (i = 0, N = obj->normtab; i < obj->numPolys; i++, N++) {
+			p = geospace(g, 24);
+			putdouble(p, N->fx);
+			putdouble(p+8, N->fy);
+			putdouble(p+16, N->fz);
+		}
+		for (i = 0, C = obj->corntab; i < obj->numCorners; i++, C++) {
+			p = geospace(g, 20);
+			put32(p, (uint32_t)C->vert);
+			putdouble(p+4, C->u);
+			putdouble(p+12, C->v);
+		}
+		geoflush(g);
+		if (g->err | ferror(g->f) | fclose(g->f)) {
+			remove(temp);
+		} else {
+			replacefile(temp, name);
+			ok = 1;
+		}
+	}
+	if (g)
+		myfree(g);
+	if (!ok)
+		fprintf(stderr, "Warning: unable to save object %s in the cache (%s)\n", obj->name, cv->cachedir);
+}
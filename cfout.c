@@ -7,27 +7,29 @@
 
 
 static void
-writeheader(FILE *f, Object *obj)
+writeheader(Converter *cv, Emitter *e, Object *obj)
 {
-	char *label = name2label(obj->name);
-
-	fprintf(f, "\nstatic C3DObjdata %s_data = {\n", label);
-	fprintf(f, "\t%d,\t/* Number of faces */\n", obj->numPolys);
-	fprintf(f, "\t%d,\t/* Number of points */\n", obj->numVerts);
-	fprintf(f, "\t%d,\t/* Number of materials */\n", numMaterials);
-	fprintf(f, "\t0,\t/* reserved word */\n");
-	fprintf(f, "\tfacelist%s,\n", label);
-	fprintf(f, "\tvertlist%s,\n", label);
-	fprintf(f, "\tmatlist\n");
-	fprintf(f, "};\n\n");
-
-	fprintf(f, "C3DObject %s = {\n", label);
-	fprintf(f, "\t&%s_data,\n", label);
-	fprintf(f, "\t{ 1.0, 0, 0,\n");
-	fprintf(f, "\t  0, 1.0, 0,\n");
-	fprintf(f, "\t  0, 0, 1.0,\n");
-	fprintf(f, "\t  0, 0, 0 },\n");
-	fprintf(f, "};\n");
+	char label[LABELSIZE];
+
+	name2label(cv, obj->name, label);
+
+	EmitPrintf(e, "\nstatic C3DObjdata %s_data = {\n", label);
+	EmitPrintf(e, "\t%d,\t/* Number of faces */\n", obj->numPolys);
+	EmitPrintf(e, "\t%d,\t/* Number of points */\n", obj->numVerts);
+	EmitPrintf(e, "\t%d,\t/* Number of materials */\n", cv->numMaterials);
+	EmitStr(e, "\t0,\t/* reserved word */\n");
+	EmitPrintf(e, "\tfacelist%s,\n", label);
+	EmitPrintf(e, "\tvertlist%s,\n", label);
+	EmitStr(e, "\tmatlist\n");
+	EmitStr(e, "};\n\n");
+
+	EmitPrintf(e, "C3DObject %s = {\n", label);
+	EmitPrintf(e, "\t&%s_data,\n", label);
+	EmitStr(e, "\t{ 1.0, 0, 0,\n");
+	EmitStr(e, "\t  0, 1.0, 0,\n");
+	EmitStr(e, "\t  0, 0, 1.0,\n");
+	EmitStr(e, "\t  0, 0, 0 },\n");
+	EmitStr(e, "};\n");
 }
 
 /* convert a float to a signed integer */
@@ -41,114 +43,241 @@ writeheader(FILE *f, Object *obj)
 
 /* default texture coordinates */
 static double
-default_u[] = { 0.0, 0.0, 1.0, 1.0 };
+default_u[MAXVERTICES] = { 0.0, 0.0, 1.0, 1.0, 0.0, 0.0, 1.0, 1.0 };
 
 static double
-default_v[] = { 0.0, 1.0, 0.0, 1.0 };
+default_v[MAXVERTICES] = { 0.0, 1.0, 0.0, 1.0, 0.0, 1.0, 0.0, 1.0 };
+
+/* most values (or points) on one line with -compact */
+#define ITEMSPERLINE	16
+#define POINTSPERLINE	4
+
+/*
+ * the face list with -compact: the same data, without the comments
+ */
+static void
+packfaces(Converter *cv, Emitter *e, Object *obj)
+{
+	int i, j;
+	double fd;
+	Face *p;
+	Corner *c;
+	FaceNormal *n;
+	double text_u, text_v;
+	VertexArrays *V = &obj->verts;
+
+	p = obj->facetab;
+	n = obj->normtab;
+	EmitListStart(e, "\t", ",\n", ITEMSPERLINE);
+	for (i = 0; i < obj->numPolys; i++,p++,n++) {
+		c = &obj->corntab[p->first];
+		EmitItem(e);
+		EmitInt(e, p->numverts);
+		EmitItem(e);
+		EmitInt(e, p->material);
+
+		fd = n->fx * V->x[c[0].vert] + n->fy * V->y[c[0].vert] + n->fz * V->z[c[0].vert];
+		EmitItem(e);
+		EmitStr(e, "0x");
+		EmitHex(e, TOFIXED(n->fx), 1);
+		EmitItem(e);
+		EmitStr(e, "0x");
+		EmitHex(e, TOFIXED(n->fy), 1);
+		EmitItem(e);
+		EmitStr(e, "0x");
+		EmitHex(e, TOFIXED(n->fz), 1);
+		EmitItem(e);
+		EmitStr(e, "0x");
+		EmitHex(e, TOINT(-fd) & 0x0000ffff, 1);
+		for (j = 0; j < p->numverts; j++) {
+			if (cv->mattab[p->material].texmap) {
+				text_u = c[j].u; text_v = c[j].v;
+			} else {
+				text_u = default_u[j]; text_v = default_v[j];
+			}
+			EmitItem(e);
+			EmitInt(e, c[j].vert);
+			EmitItem(e);
+			EmitStr(e, "0x");
+			EmitHex(e, TOBYTE(text_u), 2);
+			EmitHex(e, TOBYTE(text_v), 2);
+		}
+	}
+	EmitListEnd(e);
+}
 
 static void
-writefaces(FILE *f, Object *obj)
+writefaces(Converter *cv, Emitter *e, Object *obj)
 {
+	char label[LABELSIZE];
 	int i, j;
 	double fd;
-	Polygon *p;
-	double *text_u, *text_v;
-	Vertex *verttab;
-
-	fprintf(f, "static short facelist%s[] = {\n", name2label(obj->name));
-	p = obj->polytab;
-	verttab = obj->verttab;
-
-	for (i = 0; i < obj->numPolys; i++,p++) {
-		fprintf(f, "/* Face %d */\n", i);
-		fprintf(f, "\t%d,\t\t/* number of points */\n", p->numverts);
-		fprintf(f, "\t%d,\t\t/* material %s */\n", p->material, mattab[p->material].name);
-
-		fd = p->fx * verttab[p->vert[0]].x + p->fy * verttab[p->vert[0]].y + p->fz * verttab[p->vert[0]].z;
-		fprintf(f, "\t0x%x,0x%x,0x%x,0x%x,\t/* face normal */\n",
-			TOFIXED(p->fx), TOFIXED(p->fy), TOFIXED(p->fz),
-			TOINT(-fd) & 0x0000ffff
-		);
+	Face *p;
+	Corner *c;
+	FaceNormal *n;
+	double text_u, text_v;
+	VertexArrays *V;
+
+	EmitPrintf(e, "static short facelist%s[] = {\n", name2label(cv, obj->name, label));
+	if (cv->compact) {
+		packfaces(cv, e, obj);
+		EmitStr(e, "};\n");
+		return;
+	}
+	p = obj->facetab;
+	n = obj->normtab;
+	V = &obj->verts;
+
+	for (i = 0; i < obj->numPolys; i++,p++,n++) {
+		c = &obj->corntab[p->first];
+		EmitStr(e, "/* Face ");
+		EmitInt(e, i);
+		EmitStr(e, " */\n\t");
+		EmitInt(e, p->numverts);
+		EmitStr(e, ",\t\t/* number of points */\n\t");
+		EmitInt(e, p->material);
+		EmitStr(e, ",\t\t/* material ");
+		EmitStr(e, cv->mattab[p->material].name);
+		EmitStr(e, " */\n");
+
+		fd = n->fx * V->x[c[0].vert] + n->fy * V->y[c[0].vert] + n->fz * V->z[c[0].vert];
+		EmitStr(e, "\t0x");
+		EmitHex(e, TOFIXED(n->fx), 1);
+		EmitStr(e, ",0x");
+		EmitHex(e, TOFIXED(n->fy), 1);
+		EmitStr(e, ",0x");
+		EmitHex(e, TOFIXED(n->fz), 1);
+		EmitStr(e, ",0x");
+		EmitHex(e, TOINT(-fd) & 0x0000ffff, 1);
+		EmitStr(e, ",\t/* face normal */\n");
 		for (j = 0; j < p->numverts; j++) {
-			fprintf(f, "\t%d, ", p->vert[j]);
+			EmitChar(e, '\t');
+			EmitInt(e, c[j].vert);
 			/* if texture coordinates are provided, use those */
-			if (mattab[p->material].texmap) {
-				text_u = p->u; text_v = p->v;
+			if (cv->mattab[p->material].texmap) {
+				text_u = c[j].u; text_v = c[j].v;
 			} else {
-				text_u = default_u; text_v = default_v;
+				text_u = default_u[j]; text_v = default_v[j];
 			}
-			fprintf(f, "0x%02x%02x,\t/* Point index, texture coordinates */\n", TOBYTE(text_u[j]), TOBYTE(text_v[j]));
+			EmitStr(e, ", 0x");
+			EmitHex(e, TOBYTE(text_u), 2);
+			EmitHex(e, TOBYTE(text_v), 2);
+			EmitStr(e, ",\t/* Point index, texture coordinates */\n");
 		}
 	}
-	fprintf(f, "};\n");
+	EmitStr(e, "};\n");
 }
 
+/*
+ * the vertex list with -compact
+ */
 static void
-writeverts(FILE *f, Object *obj)
+packverts(Emitter *e, Object *obj)
 {
+	VertexArrays *V = &obj->verts;
 	int i;
-	Vertex *verttab = obj->verttab;
 
-	fprintf(f, "\nstatic Point vertlist%s[] = {\n", name2label(obj->name));
+	EmitListStart(e, "\t", ",\n", POINTSPERLINE);
 	for (i = 0; i < obj->numVerts; i++) {
-		fprintf(f, "\t/* Vertex %d */\n", i);
-		fprintf(f, "\t{%f,%f,%f,\t/* coordinates */\n",
-			verttab[i].x, verttab[i].y, verttab[i].z );
-		fprintf(f, "\t%f,%f,%f\t/* vertex normal */},\n",
-			verttab[i].vx, verttab[i].vy, verttab[i].vz );
+		EmitItem(e);
+		EmitStr(e, "{");
+		EmitFloat(e, V->x[i]);
+		EmitChar(e, ',');
+		EmitFloat(e, V->y[i]);
+		EmitChar(e, ',');
+		EmitFloat(e, V->z[i]);
+		EmitChar(e, ',');
+		EmitFloat(e, V->vx[i]);
+		EmitChar(e, ',');
+		EmitFloat(e, V->vy[i]);
+		EmitChar(e, ',');
+		EmitFloat(e, V->vz[i]);
+		EmitChar(e, '}');
 	}
-	fprintf(f, "};\n");
+	EmitListEnd(e);
 }
 
-/* flag: set to 1 when the materials are output for the first time */
-static int wrotemats;
+static void
+writeverts(Converter *cv, Emitter *e, Object *obj)
+{
+	char label[LABELSIZE];
+	int i;
+	VertexArrays *V = &obj->verts;
 
+	EmitPrintf(e, "\nstatic Point vertlist%s[] = {\n", name2label(cv, obj->name, label));
+	if (cv->compact) {
+		packverts(e, obj);
+		EmitStr(e, "};\n");
+		return;
+	}
+	for (i = 0; i < obj->numVerts; i++) {
+		EmitStr(e, "\t/* Vertex ");
+		EmitInt(e, i);
+		EmitStr(e, " */\n\t{");
+		EmitFloat(e, V->x[i]);
+		EmitChar(e, ',');
+		EmitFloat(e, V->y[i]);
+		EmitChar(e, ',');
+		EmitFloat(e, V->z[i]);
+		EmitStr(e, ",\t/* coordinates */\n\t");
+		EmitFloat(e, V->vx[i]);
+		EmitChar(e, ',');
+		EmitFloat(e, V->vy[i]);
+		EmitChar(e, ',');
+		EmitFloat(e, V->vz[i]);
+		EmitStr(e, "\t/* vertex normal */},\n");
+	}
+	EmitStr(e, "};\n");
+}
+
+/* flag: set to 1 when the materials are output for the first time */
 static void
-writemats(FILE *f, Object *obj)
+writemats(Converter *cv, Emitter *e, Object *obj)
 {
+	char label[LABELSIZE];
 	int i;
 
-	if (wrotemats != 0)
+	if (cv->wrotemats != 0)
 		return;
-	wrotemats++;
+	cv->wrotemats++;
 
-	for (i = 0; i < numMaterials; i++) {
-		if (mattab[i].texmap) {
-			fprintf(f, "extern short %s[];\n", name2label(mattab[i].texmap));
+	for (i = 0; i < cv->numMaterials; i++) {
+		if (cv->mattab[i].texmap) {
+			EmitPrintf(e, "extern short %s[];\n", name2label(cv, cv->mattab[i].texmap, label));
 		}
 	}
 
 	/* now output bitmap definitions for the textures */
-	for (i = 0; i < numMaterials; i++) {
-		if (mattab[i].texmap) {
-			fprintf(f, "static Bitmap %s_bitmap = {\n", name2label(mattab[i].texmap));
-			fprintf(f, "\t%d, %d,\n", mattab[i].twidth, mattab[i].theight);
-			fprintf(f, "\t%s\n", name2label(mattab[i].texmap));
-			fprintf(f, "};\n\n");
+	for (i = 0; i < cv->numMaterials; i++) {
+		if (cv->mattab[i].texmap) {
+			EmitPrintf(e, "static Bitmap %s_bitmap = {\n", name2label(cv, cv->mattab[i].texmap, label));
+			EmitPrintf(e, "\t%d, %d,\n", cv->mattab[i].twidth, cv->mattab[i].theight);
+			EmitPrintf(e, "\t%s\n", name2label(cv, cv->mattab[i].texmap, label));
+			EmitStr(e, "};\n\n");
 		}
 	}
-	fprintf(f, "\n");
-
-	fprintf(f, "\nstatic Material matlist[] = {\n");
-	for (i = 0; i < numMaterials; i++) {
-		fprintf(f, "{ /* Material %d: %s */\n", i, mattab[i].name);
-		fprintf(f, "\t0x%04x, 0,\n", rgb2cry( mattab[i].red, mattab[i].green, mattab[i].blue ) );
-		if (mattab[i].texmap) {
-			fprintf(f, "\t%s_bitmap\t/* texture */\n},\n", name2label(mattab[i].texmap));
+	EmitStr(e, "\n");
+
+	EmitStr(e, "\nstatic Material matlist[] = {\n");
+	for (i = 0; i < cv->numMaterials; i++) {
+		EmitPrintf(e, "{ /* Material %d: %s */\n", i, cv->mattab[i].name);
+		EmitPrintf(e, "\t0x%04x, 0,\n", rgb2cry( cv->mattab[i].red, cv->mattab[i].green, cv->mattab[i].blue ) );
+		if (cv->mattab[i].texmap) {
+			EmitPrintf(e, "\t%s_bitmap\t/* texture */\n},\n", name2label(cv, cv->mattab[i].texmap, label));
 		} else {
-			fprintf(f, "\t0\t\t/* no texture */\n},\n");
+			EmitStr(e, "\t0\t\t/* no texture */\n},\n");
 		}
 	}
-	fprintf(f, "};\n");
+	EmitStr(e, "};\n");
 
 }
 
 int
-CFwritefile(FILE *outf, Object *obj)
+CFwritefile(Converter *cv, Emitter *e, Object *obj)
 {
-	writefaces(outf, obj);
-	writeverts(outf, obj);
-	writemats(outf, obj);
-	writeheader(outf, obj);
+	writefaces(cv, e, obj);
+	writeverts(cv, e, obj);
+	writemats(cv, e, obj);
+	writeheader(cv, e, obj);
 	return 0;
 }
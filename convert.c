@@ -0,0 +1,664 @@
+/*
+ * The converter proper: read a model, clean it up, and
+ * write it out again. Everything one conversion needs is in
+ * its Converter, so a program can run as many of these as
+ * it likes, one after another or at the same time in several
+ * threads; 3dsconv.c is just a command line front end for it.
+ *
+ * To convert a file:
+ *	Converter cv;
+ *
+ *	InitConverter(&cv);
+ *	cv.infilename = "model.3ds";
+ *	... set any other options ...
+ *	if (ConvertFile(&cv) != 0)
+ *		... it failed; the reason has been printed on stderr ...
+ *	FreeConverter(&cv);
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#ifndef _WIN32
+#define stricmp strcasecmp
+#else
+#define stricmp _stricmp
+#endif
+
+#include "internal.h"
+#include "proto.h"
+
+#define DEFAULT_PROGNAME	"3dsconv"
+
+/*
+ * set up a converter with the default options
+ */
+void
+InitConverter( Converter *cv )
+{
+	memset(cv, 0, sizeof(*cv));
+	cv->progname = DEFAULT_PROGNAME;
+	cv->pointdelta = 1.0;
+	cv->facedelta = 0.01;
+	cv->merge_tris = 1;
+	cv->maxmerge = 0;
+	cv->uscale = 1.0;
+	cv->output_format = FORMAT_N3D;
+	cv->verbose = 0;
+	cv->usedataseg = 1;
+	cv->outputheader = 1;
+	cv->clabels = -1;	/* a default value, overridden later */
+	cv->multiobject = 0;
+	cv->animflag = 0;
+	cv->compact = 0;
+	cv->numthreads = NumCPUs();
+}
+
+/*
+ * throw away everything a conversion allocated; the options
+ * that ConvertFile() filled in (outfilename, defaultlabel)
+ * go too, so start again from InitConverter() to reuse the
+ * converter
+ */
+void
+FreeConverter( Converter *cv )
+{
+	FreeArena(cv->arena);
+	cv->arena = 0;
+	cv->mattab = 0;
+	cv->numMaterials = cv->maxMaterials = 0;
+	memset(&cv->matnames, 0, sizeof(cv->matnames));
+	cv->objpages = 0;
+	cv->numpages = 0;
+	cv->numObjs = cv->maxObjs = 0;
+	memset(&cv->objnames, 0, sizeof(cv->objnames));
+	FreeMutex(cv->objlock);
+	cv->objlock = 0;
+	cv->filepath = 0;
+	cv->outfilename = 0;
+	cv->labelobject = 0;
+	cv->cachekey[0] = 0;
+	cv->modelkey[0] = 0;
+	cv->texdeps = 0;
+	cv->numtexdeps = cv->maxtexdeps = 0;
+	cv->defaultlabel = 0;
+}
+
+/*
+ * the clean up passes for one object, and what they did
+ */
+typedef struct objjob {
+	Object	*obj;
+	int	size;			/* rough measure of how much work it is */
+	int	numthreads;		/* threads its passes may use */
+	int	oldverts, newverts;	/* vertices before and after merging them */
+	int	oldpolys, newpolys;	/* faces before and after merging them */
+} ObjJob;
+
+/* biggest objects first */
+static int
+cmpjobsize(const void *a, const void *b)
+{
+	const ObjJob *ja = *(const ObjJob **)a;
+	const ObjJob *jb = *(const ObjJob **)b;
+
+	if (ja->size != jb->size)
+		return (ja->size > jb->size) ? -1 : 1;
+	return (ja < jb) ? -1 : (ja > jb);
+}
+
+static void
+cleanupobject(void *arg, int n)
+{
+	ObjJob *job = ((ObjJob **)arg)[n];
+	Object *obj = job->obj;
+
+	job->oldverts = job->newverts = obj->numVerts;
+	job->oldpolys = job->newpolys = obj->numPolys;
+	if (obj->cached)
+		return;			/* it was saved like this */
+
+	MergeVertices(obj, job->numthreads);
+	job->newverts = obj->numVerts;
+
+	CalcVertexNormals(obj, job->numthreads);
+
+	if (obj->cv->merge_tris)
+		MergeFaces(obj, job->numthreads);
+	job->newpolys = obj->numPolys;
+
+	if (obj->geokey[0])
+		CacheSaveGeometry(obj);
+}
+
+/*
+ * merge the vertices of every object, calculate its vertex normals,
+ * and merge its faces. Objects don't share any geometry, so they
+ * are done in parallel; the biggest ones are started first, so that
+ * the workers all finish at about the same time. An object that is
+ * big enough to deserve more than one thread (going by its share of
+ * the total size) is done first, on its own, with all the threads,
+ * so that one huge object can still use them all; the rest are then
+ * done a thread each. That way there are never more than
+ * cv->numthreads threads at once. Messages are
+ * printed afterwards, in object order, so the output is the same
+ * whatever order the work was done in. Objects that were loaded
+ * from the cache are already cleaned up; the others are saved
+ * there when they're done, if they have a cache key.
+ * returns: 0 on success, otherwise -1
+ */
+int
+CleanupObjects( Converter *cv )
+{
+	ObjJob *jobs, *job;
+	ObjJob **queue;			/* the jobs, in the order to start them */
+	int i, nbig, oldpolys, newpolys;
+	double total;			/* size of all the jobs */
+
+	if (cv->numObjs == 0)
+		return 0;
+	jobs = malloc(cv->numObjs * sizeof(ObjJob));
+	queue = malloc(cv->numObjs * sizeof(ObjJob *));
+	if (!jobs || !queue) {
+		fprintf(stderr, "%s: insufficient memory\n", cv->progname);
+		if (jobs) free(jobs);
+		if (queue) free(queue);
+		return -1;
+	}
+	total = 0.0;
+	for (i = 0; i < cv->numObjs; i++) {
+		jobs[i].obj = OBJECT(cv, i);
+		jobs[i].size = jobs[i].obj->cached ? 0 : jobs[i].obj->numVerts + jobs[i].obj->numCorners;
+		total += jobs[i].size;
+		queue[i] = &jobs[i];
+	}
+	qsort(queue, cv->numObjs, sizeof(ObjJob *), cmpjobsize);
+
+	for (nbig = 0; nbig < cv->numObjs && cv->numthreads > 1 && total > 0.0; nbig++) {
+		job = queue[nbig];
+		if (cv->numthreads * (job->size / total) < 1.5)
+			break;
+		job->numthreads = cv->numthreads;
+		cleanupobject(queue, nbig);
+	}
+	for (i = nbig; i < cv->numObjs; i++)
+		queue[i]->numthreads = 1;
+	ParallelFor(cv->numthreads, cv->numObjs - nbig, cleanupobject, queue + nbig);
+
+	if (cv->verbose) {
+		for (i = 0, job = jobs; i < cv->numObjs; i++, job++) {
+			if (job->obj->cached)
+				fprintf(stdout, "Object %s: using saved geometry\n", job->obj->name);
+		}
+		fprintf(stdout, "Merging vertices\n");
+		for (i = 0, job = jobs; i < cv->numObjs; i++, job++) {
+			if (job->newverts != job->oldverts)
+				fprintf(stdout, "Object %s: merged %d points into %d\n",
+					job->obj->name, job->oldverts, job->newverts);
+		}
+		fprintf(stdout, "Calculating vertex normals\n");
+		if (cv->merge_tris) {
+			fprintf(stdout, "Merging faces\n");
+			oldpolys = newpolys = 0;
+			for (i = 0, job = jobs; i < cv->numObjs; i++, job++) {
+				if (job->newpolys != job->oldpolys)
+					fprintf(stdout, "Object %s: merged %d triangles into %d polygons\n",
+						job->obj->name, job->oldpolys, job->newpolys);
+				oldpolys += job->oldpolys;
+				newpolys += job->newpolys;
+			}
+			fprintf(stdout, "Merged %d faces into %d polygons\n", oldpolys, newpolys);
+		}
+	}
+	free(queue);
+	free(jobs);
+	return 0;
+}
+
+/*
+ * convert cv->infilename, according to the options in cv
+ * returns: 0 on success, otherwise -1 (after printing an error)
+ */
+int
+ConvertFile( Converter *cv )
+{
+	int retval;
+	char *extension;
+	int islw;			/* it's a LightWave file */
+	int loaded;			/* the model came from the cache */
+	char filelabel[LABELSIZE];
+
+	if (!cv->arena)
+		cv->arena = NewArena();
+	if (!cv->objlock)
+		cv->objlock = NewMutex();
+	if (!cv->arena || !cv->objlock) {
+		fprintf(stderr, "%s: insufficient memory\n", cv->progname);
+		return -1;
+	}
+	if (cv->output_format == FORMAT_ANIM || cv->output_format == FORMAT_ABIN)
+		cv->animflag = cv->multiobject = 1;
+
+	if (!cv->outfilename) {
+		if (cv->output_format == FORMAT_JAG)
+			cv->outfilename = change_extension(cv, cv->infilename, ".j3d");
+		else if (cv->output_format == FORMAT_ANIM)
+			cv->outfilename = change_extension(cv, cv->infilename, ".a3d");
+		else if (cv->output_format == FORMAT_C || cv->output_format == FORMAT_CFLOAT)
+			cv->outfilename = change_extension(cv, cv->infilename, ".c");
+		else if (cv->output_format == FORMAT_BIN || cv->output_format == FORMAT_ABIN)
+			cv->outfilename = change_extension(cv, cv->infilename, ".b3d");
+		else
+			cv->outfilename = change_extension(cv, cv->infilename, ".n3d");
+		if (!cv->outfilename)
+			return -1;
+	}
+
+	/* if neither -clabels nor -noclabels was given explicitly, default to
+	 * C style labels for new output format, and non-C style for the old
+	 * output format
+	 */
+	if (cv->clabels == -1) {		/* option wasn't explicitly given by the user */
+		cv->clabels = (cv->output_format == FORMAT_JAG) ? 0 : 1;
+	}
+
+	cv->filepath = ArenaStrdup(cv->arena, cv->infilename);
+	if (!cv->filepath) {
+		fprintf(stderr, "%s: insufficient memory\n", cv->progname);
+		return -1;
+	}
+	/* replace the last path separator with a null */
+	/* also, if no label has been specified, make one out
+	 * of the file name
+	 */
+	{
+		char *s;
+
+		s = strrchr(cv->filepath, '\\');
+		if (!s)
+			s = strrchr(cv->filepath, '/');
+		if (!s)
+			s = strrchr(cv->filepath, ':');
+
+		if (s) {
+			++s;
+			name2label(cv, s, filelabel);
+			*s = 0;
+		} else {
+			name2label(cv, cv->filepath, filelabel);
+			*cv->filepath = 0;
+		}
+		if (!cv->defaultlabel) {
+			cv->defaultlabel = ArenaStrdup(cv->arena, filelabel);
+			if (!cv->defaultlabel) {
+				fprintf(stderr, "%s: insufficient memory\n", cv->progname);
+				return -1;
+			}
+		}
+	}
+
+	extension  = strrchr(cv->infilename, '.');
+
+	/* Assume 3D Studio as default */
+	if (!extension) extension = "3ds";
+	else extension++;
+
+	islw = !stricmp(extension, "lw") || !stricmp(extension, "lwob");
+
+	/* a model file is ready to be written out as it is */
+	if (IsModelFile(cv->infilename)) {
+		if (LoadModel(cv, cv->infilename, 0) != 0)
+			return -1;
+		if (cv->modelname && SaveModel(cv, cv->modelname) != 0)
+			return -1;
+		return write_output_file(cv, cv->outfilename) ? -1 : 0;
+	}
+
+	/* if this has been converted before, the output (or at least the model) is in the cache */
+	loaded = 0;
+	if (cv->cachedir) {
+		retval = CacheLookup(cv, islw ? "lw" : "3ds");
+		if (retval < 0)
+			return -1;
+		if (retval > 0) {
+			/* a binary model's stub isn't saved, but it can be made from the model */
+			if ((cv->output_format == FORMAT_BIN || cv->output_format == FORMAT_ABIN) &&
+			    BINwritestub(cv, cv->outfilename) != 0)
+				return -1;
+			if (!cv->modelname)
+				return 0;
+			/* -model still needs the model; if it isn't there, convert it all again */
+			if (CacheLoadModel(cv) == 0)
+				return SaveModel(cv, cv->modelname) ? -1 : 0;
+		}
+		loaded = (CacheLoadModel(cv) == 0);
+	}
+
+	if (!loaded) {
+		if (islw)
+			retval = readlwfile(cv, cv->infilename);
+		else
+			retval = read3dsfile(cv, cv->infilename);
+
+		if (retval)
+			return -1;
+
+
+		if (CleanupObjects(cv) != 0)
+			return -1;
+
+		if (CheckUncoloredFaces(cv) != 0)
+			return -1;
+		if (cv->cachedir)
+			CacheSaveModel(cv);
+	}
+
+	if (cv->modelname && SaveModel(cv, cv->modelname) != 0)
+		return -1;
+	if (write_output_file( cv, cv->outfilename ) != 0)
+		return -1;
+	if (cv->cachedir)
+		CacheStore(cv);
+	return 0;
+}
+
+/*************************************************************************
+change_extension(name, ext): creates a duplicate string, containing the
+given file name but with its extension changed to ext; if the file had
+no extension, one is added.
+ext must contain the appropriate '.' character
+Returns NULL (after printing an error) if there's no memory for it.
+**************************************************************************/
+
+char *
+change_extension(Converter *cv, char *name, char *ext)
+{
+	char *s;		/* temporary string pointer */
+	size_t len;		/* length of the string */
+	size_t extpos;		/* position where the extension is to be added */
+	char *newname;
+
+	len = extpos = 0;
+
+	for (s = name; *s; s++) {
+		if (*s == '\\' || *s == '/') {		/* account for both UNIX and DOS path separators */
+			extpos = 0;			/* no extension yet, the name isn't finished */
+		} else if (*s == '.') {
+			extpos = len;
+		}
+		len++;
+	}
+	if (extpos == 0)
+		extpos = len;
+
+	newname = ArenaAlloc(cv->arena, len+strlen(ext)+1);	/* the "+1" is for the trailing 0 */
+	if (!newname) {
+		fprintf(stderr, "Fatal error: insufficient memory\n");
+		return NULL;
+	}
+	strcpy(newname, name);
+	strcpy(newname+extpos, ext);
+	return newname;
+}
+
+
+/*
+ * converts a file name (fname) into a label, which is put
+ * in buf (which must have room for LABELSIZE characters);
+ * returns buf
+ */
+
+char *
+name2label( Converter *cv, char *fname, char *buf )
+{
+	char *s = buf;
+	char *end = buf + LABELSIZE - 1;
+	char c;
+
+	if (cv->output_format == FORMAT_C || cv->output_format == FORMAT_CFLOAT) {
+		*s++ = 'C';
+		*s++ = '3';
+		*s++ = 'D';
+		*s++ = '_';
+	} else if (cv->clabels)
+		*s++ = '_';
+	while (*fname && *fname != '.' && s < end) {
+		c = *fname++;
+		if (c == ' ' || c == '-')
+			c = '_';
+		else
+			c = tolower(c);
+		*s++ = c;
+	}
+	*s++ = 0;
+	return buf;
+}
+
+/*
+ * one object being written into memory by writeobjects()
+ */
+typedef struct writejob {
+	Converter cv;			/* copy of the converter, as it would be when the object is written */
+	Emitter	e;			/* the object's output */
+	int	ret;			/* what the writer returned */
+} WriteJob;
+
+typedef struct writebatch {
+	Converter *cv;
+	int	(*writefile)(Converter *, Emitter *, Object *);
+	WriteJob *jobs;			/* one for each object in the batch */
+	int	first;			/* number of the batch's first object */
+} WriteBatch;
+
+/* how many objects each thread has to write in a batch */
+#define WRITEBATCH	4
+
+static void
+writeobject(void *arg, int n)
+{
+	WriteBatch *b = arg;
+	WriteJob *job = &b->jobs[n];
+
+	if (InitEmitter(&job->e, 0) != 0) {
+		job->e.err = 1;
+		job->ret = 1;
+		return;
+	}
+	job->ret = b->writefile(&job->cv, &job->e, OBJECT(b->cv, b->first + n));
+}
+
+/*
+ * write out all the objects with writefile(). Each object's output
+ * doesn't depend on the others', so with more than one thread they
+ * are written into memory at the same time, a batch at a time, and
+ * then copied to e in object order. The only state the writers
+ * share is cv->wrotemats (the material list goes out once, with the
+ * first object) and cv->tboxnum (the JAG writer numbers the texture
+ * boxes on from the previous objects'); each object gets a copy of
+ * the converter with the values they would have had if the objects
+ * were written one after another.
+ * returns: 0 on success, otherwise nonzero
+ */
+static int
+writeobjects(Converter *cv, Emitter *e, int (*writefile)(Converter *, Emitter *, Object *))
+{
+	WriteBatch b;
+	WriteJob *job;
+	Object *obj;
+	int i, j, n, ret, batchsize;
+
+	batchsize = cv->numthreads * WRITEBATCH;
+	if (batchsize > cv->numObjs)
+		batchsize = cv->numObjs;
+	b.jobs = 0;
+	if (cv->numthreads > 1 && cv->numObjs > 1)
+		b.jobs = malloc(batchsize * sizeof(WriteJob));
+	if (!b.jobs) {
+		/* just write them straight out */
+		for (i = 0; i < cv->numObjs; i++) {
+			ret = writefile(cv, e, OBJECT(cv, i));
+			if (ret)
+				return ret;
+		}
+		return 0;
+	}
+
+	b.cv = cv;
+	b.writefile = writefile;
+	ret = 0;
+	for (b.first = 0; b.first < cv->numObjs && !ret; b.first += n) {
+		n = cv->numObjs - b.first;
+		if (n > batchsize)
+			n = batchsize;
+		for (i = 0; i < n; i++) {
+			b.jobs[i].cv = *cv;
+			obj = OBJECT(cv, b.first + i);
+			cv->wrotemats = 1;
+			for (j = 0; j < obj->numPolys; j++) {
+				if (cv->mattab[obj->facetab[j].material].texmap)
+					cv->tboxnum++;
+			}
+		}
+
+		ParallelFor(cv->numthreads, n, writeobject, &b);
+
+		for (i = 0, job = b.jobs; i < n; i++, job++) {
+			if (!ret && job->e.err) {
+				fprintf(stderr, "%s: insufficient memory\n", cv->progname);
+				ret = 1;
+			}
+			if (!ret)
+				ret = job->ret;
+			if (!ret)
+				EmitBytes(e, job->e.buf, job->e.len);
+			if (job->e.buf)
+				FinishEmitter(&job->e);
+		}
+	}
+	free(b.jobs);
+	return ret;
+}
+
+/*************************************************************************
+write_output_file(): write out appropriate headers, and then the
+object(s)
+**************************************************************************/
+
+int
+write_output_file( Converter *cv, char *outfname )
+{
+	int ret;
+	int (*writefile)(Converter *, Emitter *, Object *);
+	int i;
+	Output *f;
+	Emitter em;
+	Emitter *e = &em;
+	Object *rootobj;
+	int output_format = cv->output_format;
+	char label[LABELSIZE];
+
+	if (output_format == FORMAT_BIN || output_format == FORMAT_ABIN)
+		return BINwritefile(cv, outfname);
+
+	f = OpenOutput(outfname, 0);
+	if (!f)
+		return 1;
+	if (InitEmitter(e, f) != 0) {
+		fprintf(stderr, "%s: insufficient memory\n", cv->progname);
+		CloseOutput(f);
+		return 1;
+	}
+	cv->wrotemats = 0;
+	cv->tboxnum = 0;
+
+	if (output_format == FORMAT_JAG) {
+		EmitStr(e, ";*========================================\n");
+		EmitStr(e, "; .JAG/.J3D format file\n");
+		EmitStr(e, ";*========================================\n\n");
+
+		writefile = JAGwritefile;
+	} else if (output_format == FORMAT_ANIM) {
+		EmitStr(e, ";*========================================\n");
+		EmitStr(e, "; 3D Animation Data File\n");
+		EmitStr(e, ";*========================================\n\n");
+
+		writefile = N3Dwritefile;
+	} else if (output_format == FORMAT_C) {
+		EmitStr(e, "/*========================================\n");
+		EmitStr(e, "  3D Library Data File\n");
+		EmitStr(e, " *=======================================*/\n\n");
+
+		writefile = Cwritefile;
+	} else if (output_format == FORMAT_CFLOAT) {
+		EmitStr(e, "/*========================================\n");
+		EmitStr(e, "  3D Library Data File\n");
+		EmitStr(e, " *=======================================*/\n\n");
+
+		writefile = CFwritefile;
+	} else {
+		EmitStr(e, ";*========================================\n");
+		EmitStr(e, "; 3D Library Data File\n");
+		EmitStr(e, ";*========================================\n\n");
+
+		writefile = N3Dwritefile;
+	}
+	if (output_format == FORMAT_C) {
+		EmitStr(e, "#include \"c3d.h\"\n");
+	} else if (output_format == FORMAT_CFLOAT) {
+		EmitStr(e, "#define USE_FLOAT\n");
+		EmitStr(e, "#include \"c3d.h\"\n");
+	} else {
+		if (cv->outputheader) {
+			EmitStr(e, "\n\t.include\t'jaguar.inc'\n\n");
+			if (cv->usedataseg)
+				EmitStr(e, "\t.data\n");
+		}
+		EmitPrintf(e, "\t.globl\t%sdata\n", cv->defaultlabel);
+		EmitPrintf(e, "%sdata:\n", cv->defaultlabel);
+	}
+
+	if (cv->animflag && (output_format == FORMAT_N3D || output_format == FORMAT_ANIM)) {
+		rootobj = FixObjectLists(cv);
+		if (!rootobj) {
+			FinishEmitter(e);
+			CloseOutput(f);
+			return 1;
+		}
+		EmitPrintf(e, "\t.dc.l\t.%s\t; pointer to root object\n", name2label(cv, rootobj->name, label));
+		for (i = 0; i < cv->numObjs; i++) {
+			Object *obj;
+
+			EmitPrintf(e, ".%s:\n", name2label(cv, OBJECT(cv, i)->name, label));
+			EmitPrintf(e, "\t.dc.l\t.%s_data\n", label);
+			EmitStr(e, "\t.dc.w\t$4000, 0, 0\n");
+			EmitStr(e, "\t.dc.w\t0, $4000, 0\n");
+			EmitStr(e, "\t.dc.w\t0, 0, $4000\n");
+			EmitStr(e, "\t.dc.w\t0, 0, 0\n");
+			obj = OBJECT(cv, i)->siblings;
+			if (obj)
+				EmitPrintf(e, "\t.dc.l\t.%s\t; siblings\n", name2label(cv, obj->name, label));
+			else
+				EmitStr(e, "\t.dc.l\t0\t; siblings\n");
+			obj = OBJECT(cv, i)->children;
+			if (obj)
+				EmitPrintf(e, "\t.dc.l\t.%s\t; children\n", name2label(cv, obj->name, label));
+			else
+				EmitStr(e, "\t.dc.l\t0\t; children\n");
+			if (OBJECT(cv, i)->numframes) {
+				EmitPrintf(e, "\t.dc.l\t.%s_anim\n", name2label(cv, OBJECT(cv, i)->name, label));
+			} else {
+				EmitStr(e, "\t.dc.l\t0\t; no animation\n");
+			}
+		}
+	}
+	ret = writeobjects(cv, e, writefile);
+	if (FinishEmitter(e) != 0)
+		ret = 1;
+	if (CloseOutput(f) != 0)
+		ret = 1;
+	if (ret)
+		fprintf(stderr, "%s: error writing %s\n", cv->progname, outfname);
+	return ret ? 1 : 0;
+}
@@ -0,0 +1,372 @@
+/*
+ * Buffered output for the 3DSCONV writers.
+ *
+ * The writers turn every face and vertex into a few lines of text,
+ * which for a big model is millions of numbers; going through
+ * fprintf() for each of them means parsing a format string (and, for
+ * floating point, going through the C library's general purpose,
+ * locale aware conversion) every time. An emitter collects the text
+ * in a large buffer instead, and formats the numbers the writers
+ * use itself. The output is exactly what fprintf() would have
+ * written: EmitInt() is %d, EmitHex() is %x (or %0Nx), and
+ * EmitFloat() is %f. Anything else can still go through
+ * EmitPrintf().
+ *
+ * An emitter can also collect its output in memory instead (so that
+ * several objects can be written at once, and the results put in the
+ * file in order afterwards): then the buffer just grows as needed.
+ * Otherwise each full buffer is handed over to the output's writer
+ * thread (see output.c), and the emitter carries on with another.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <float.h>
+#include <math.h>
+
+#ifdef __DUMB_MSDOS__
+#include <alloc.h>
+#define mymalloc farmalloc
+#define myrealloc farrealloc
+#define myfree farfree
+#else
+#define mymalloc malloc
+#define myrealloc realloc
+#define myfree free
+#endif
+
+#include "internal.h"
+#include "proto.h"
+
+#define EMITBUFSIZE	262144		/* size of the output buffer */
+#define EMITMEMSIZE	65536		/* starting size of an in-memory one */
+#define EMITSLACK	64		/* room always left for one number */
+
+/*
+ * EmitFloat() does its own conversion only where double arithmetic
+ * is done in double precision (not e.g. on the x87 without SSE2,
+ * where it may be done in extended precision), since it relies on
+ * products and sums being rounded exactly once.
+ */
+#if defined(FLT_EVAL_METHOD) && FLT_EVAL_METHOD == 0
+#define FAST_FLOAT
+#endif
+
+/* values of %f beyond this are left to the C library (so the whole part fits in an unsigned long) */
+#define MAXFASTFLOAT	4294967295.0
+
+/*
+ * set up an emitter to write to out, or if out is 0 to collect the
+ * output in e->buf (e->len bytes of it)
+ * returns: 0 on success, -1 if we ran out of memory
+ */
+int
+InitEmitter( Emitter *e, Output *out )
+{
+	e->out = out;
+	e->len = 0;
+	e->err = 0;
+	e->items = 0;
+	e->size = out ? EMITBUFSIZE : EMITMEMSIZE;
+	e->buf = mymalloc(e->size);
+	return e->buf ? 0 : -1;
+}
+
+/*
+ * make an in-memory emitter's buffer at least "need" bytes long;
+ * if we run out of memory the output so far is thrown away (so
+ * there is room to carry on), and the error is reported at the end
+ */
+static void
+growbuf( Emitter *e, size_t need )
+{
+	size_t size;
+	char *buf;
+
+	for (size = e->size; size < need; size *= 2)
+		;
+	buf = myrealloc(e->buf, size);
+	if (!buf) {
+		e->err = 1;
+		e->len = 0;
+		return;
+	}
+	e->buf = buf;
+	e->size = size;
+}
+
+/*
+ * hand anything still in the buffer over to be written (or for
+ * an in-memory emitter, make more room in it)
+ */
+void
+EmitFlush( Emitter *e )
+{
+	if (!e->out) {
+		growbuf(e, e->size * 2);
+		return;
+	}
+	if (e->len > 0)
+		e->buf = OutputBuffer(e->out, e->buf, e->len, e->size);
+	e->len = 0;
+}
+
+/*
+ * flush the emitter and free its buffer (the output is left open,
+ * and write errors are reported by CloseOutput(); an in-memory
+ * emitter's output goes with its buffer)
+ * returns: 0 on success, -1 if some of the output was lost
+ */
+int
+FinishEmitter( Emitter *e )
+{
+	if (e->out)
+		EmitFlush(e);
+	myfree(e->buf);
+	e->buf = 0;
+	return e->err ? -1 : 0;
+}
+
+/* make sure there is room for at least EMITSLACK more characters */
+#define ROOM(e)		do { if ((e)->len > (e)->size - EMITSLACK) EmitFlush(e); } while (0)
+
+/*
+ * n bytes of any kind (for binary output)
+ */
+void
+EmitBytes( Emitter *e, const void *s, size_t n )
+{
+	const char *p = s;
+	size_t room;
+
+	if (e->len + n > e->size && !e->out) {
+		growbuf(e, e->len + n);
+		if (e->len + n > e->size)
+			return;
+	}
+	/* (more than a buffer full goes over in pieces) */
+	while (e->len + n > e->size) {
+		room = e->size - e->len;
+		memcpy(e->buf + e->len, p, room);
+		e->len += room;
+		p += room;
+		n -= room;
+		EmitFlush(e);
+	}
+	memcpy(e->buf + e->len, p, n);
+	e->len += n;
+}
+
+void
+EmitStr( Emitter *e, const char *s )
+{
+	EmitBytes(e, s, strlen(s));
+}
+
+void
+EmitChar( Emitter *e, int c )
+{
+	ROOM(e);
+	e->buf[e->len++] = c;
+}
+
+/* put the decimal digits of x at the end of e's buffer */
+static void
+emitdigits( Emitter *e, unsigned long x )
+{
+	char tmp[24];
+	char *s = tmp + sizeof(tmp);
+
+	do {
+		*--s = '0' + x % 10;
+		x /= 10;
+	} while (x);
+	memcpy(e->buf + e->len, s, tmp + sizeof(tmp) - s);
+	e->len += tmp + sizeof(tmp) - s;
+}
+
+/*
+ * x in decimal, like %d
+ */
+void
+EmitInt( Emitter *e, int x )
+{
+	ROOM(e);
+	if (x < 0) {
+		e->buf[e->len++] = '-';
+		emitdigits(e, -(unsigned long)x);
+	} else {
+		emitdigits(e, x);
+	}
+}
+
+/*
+ * x in lower case hex, with at least "digits" digits: like %x if
+ * digits is 1, %02x if it's 2, and so on
+ */
+void
+EmitHex( Emitter *e, unsigned x, int digits )
+{
+	static const char hex[] = "0123456789abcdef";
+	char tmp[16];
+	char *s = tmp + sizeof(tmp);
+
+	ROOM(e);
+	do {
+		*--s = hex[x & 15];
+		x >>= 4;
+		digits--;
+	} while (x || digits > 0);
+	memcpy(e->buf + e->len, s, tmp + sizeof(tmp) - s);
+	e->len += tmp + sizeof(tmp) - s;
+}
+
+/*
+ * x with 6 decimal places, like %f. That means rounding x's exact
+ * binary value to the nearest millionth (ties to even). Writing
+ * x as whole + frac, frac*1e6 is worked out exactly as the sum of
+ * two doubles, the rounded product p and its error: frac is split
+ * into two halves of 26 bits, each of which can be multiplied by
+ * 1e6 (which only has 14 significant bits) without any rounding, and then
+ * adding them up with Fast2Sum gives p and the error. p rounds to
+ * the same integer as the exact product except when p is exactly
+ * half way between two integers, when the error decides it.
+ */
+void
+EmitFloat( Emitter *e, double x )
+{
+#ifdef FAST_FLOAT
+	double ax, whole, frac, hi, lo, a, b, p, err, r, t;
+	unsigned long ipart, fpart;
+	char *s;
+	int i;
+
+	ax = fabs(x);
+	if (!(ax < MAXFASTFLOAT)) {
+		EmitPrintf(e, "%f", x);		/* huge, infinite or not a number */
+		return;
+	}
+	whole = floor(ax);
+	frac = ax - whole;			/* exact */
+
+	t = frac * 134217729.0;			/* 2^27 + 1: split frac into hi + lo */
+	hi = t - (t - frac);
+	lo = frac - hi;
+	a = hi * 1e6;				/* both exact */
+	b = lo * 1e6;
+	p = a + b;
+	err = b - (p - a);			/* a + b == p + err exactly */
+
+	/* round the product (not p) to the nearest integer, ties to
+	 * even; rint() isn't used, since internal.c's own version
+	 * rounds ties up
+	 */
+	r = floor(p);
+	t = p - r;				/* exact */
+	if (t > 0.5 || (t == 0.5 && (err > 0.0 || (err == 0.0 && fmod(r, 2.0) != 0.0))))
+		r += 1.0;
+	ipart = (unsigned long)whole;
+	fpart = (unsigned long)r;
+	if (fpart >= 1000000) {
+		fpart -= 1000000;
+		ipart++;
+	}
+
+	ROOM(e);
+	if (signbit(x))
+		e->buf[e->len++] = '-';
+	emitdigits(e, ipart);
+	s = e->buf + e->len;
+	s[0] = '.';
+	for (i = 6; i > 0; i--) {
+		s[i] = '0' + fpart % 10;
+		fpart /= 10;
+	}
+	e->len += 7;
+#else
+	EmitPrintf(e, "%f", x);
+#endif
+}
+
+/*
+ * Lists of values, packed several to a line (for -compact): after
+ * EmitListStart(), call EmitItem() before writing each item, and
+ * EmitListEnd() after the last one. Each line starts with "head",
+ * has up to maxitems items separated by commas, and ends with
+ * "end"; e.g. for assembler, "\tdc.w\t" and "\n".
+ */
+void
+EmitListStart( Emitter *e, const char *head, const char *end, int maxitems )
+{
+	e->head = head;
+	e->end = end;
+	e->items = 0;
+	e->maxitems = maxitems;
+}
+
+void
+EmitItem( Emitter *e )
+{
+	if (e->items == e->maxitems) {
+		EmitStr(e, e->end);
+		e->items = 0;
+	}
+	if (e->items++ == 0)
+		EmitStr(e, e->head);
+	else
+		EmitChar(e, ',');
+}
+
+void
+EmitListEnd( Emitter *e )
+{
+	if (e->items > 0)
+		EmitStr(e, e->end);
+	e->items = 0;
+}
+
+/*
+ * anything else, in printf format
+ */
+void
+EmitPrintf( Emitter *e, const char *fmt, ... )
+{
+	va_list args;
+	size_t room;
+	char *tmp;
+	int n;
+
+	if (e->len > e->size / 2)
+		EmitFlush(e);
+	room = e->size - e->len;
+	va_start(args, fmt);
+	n = vsnprintf(e->buf + e->len, room, fmt, args);
+	va_end(args);
+	if (n < 0) {
+		e->err = 1;
+	} else if ((size_t)n < room) {
+		e->len += n;
+	} else if (!e->out) {
+		growbuf(e, e->len + n + 1);
+		if (e->len + n + 1 <= e->size) {
+			va_start(args, fmt);
+			vsnprintf(e->buf + e->len, n + 1, fmt, args);
+			va_end(args);
+			e->len += n;
+		}
+	} else {
+		/* too long for the buffer; format it separately */
+		tmp = mymalloc(n + 1);
+		if (!tmp) {
+			e->err = 1;
+			return;
+		}
+		va_start(args, fmt);
+		vsnprintf(tmp, n + 1, fmt, args);
+		va_end(args);
+		EmitBytes(e, tmp, n);
+		myfree(tmp);
+	}
+}
@@ -2,115 +2,553 @@
 #include <stdio.h>
 #include <math.h>
 #include <string.h>
+#include <stdint.h>
 
+/* scratch space comes from the heap; anything that has to last
+ * as long as the conversion comes from its arena (see arena.c)
+ */
 #ifdef __DUMB_MSDOS__
 #include <alloc.h>
+#define mymalloc farmalloc
 #define myrealloc farrealloc
 #define mycalloc farcalloc
 #define myfree farfree
 #else
+#define mymalloc malloc
 #define myrealloc realloc
 #define mycalloc calloc
 #define myfree free
 #endif
 
-#ifdef _WIN32
-#define strdup _strdup
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define USE_SSE2
 #endif
 
-#define EXTERN
 #include "internal.h"
+#include "proto.h"
+
+/*
+ * Make sure a table of "size" byte entries, currently with
+ * room for *max of them, can hold at least "need" entries.
+ * If "exact" is set the table grows to exactly "need" entries
+ * (the caller knows how many are coming); otherwise it at
+ * least doubles, so that adding entries one at a time takes
+ * amortized constant time.
+ * Returns 0 on success; if we run out of memory, -1 (and the
+ * table is left as it was).
+ */
 
-extern int verbose;
+static int
+GrowTable( Arena *a, void **tab, int *max, int need, size_t size, int exact )
+{
+	int newmax;
+	void *newtab;
+
+	if (need <= *max)
+		return 0;
+	if (exact) {
+		newmax = need;
+	} else {
+		newmax = (*max < 32) ? 64 : *max * 2;
+		if (newmax < need)
+			newmax = need;
+	}
+	newtab = ArenaRealloc(a, *tab, (size_t)newmax * size);
+	if (!newtab) {
+		fprintf(stderr, "ERROR: out of memory\n");
+		return -1;
+	}
+	*tab = newtab;
+	*max = newmax;
+	return 0;
+}
 
 /*
- * Add a material to the global "mattab" array.
- * this can involve reallocating that array, if there
- * isn't enough room in it now
+ * Objects and materials are found by name through hash
+ * tables of their indexes, so that scenes with thousands
+ * of them don't spend their time comparing names. Names
+ * are only ever added, in the same order as the entries
+ * of the table they belong to.
  */
+static unsigned int
+NameHash( const char *s )
+{
+	unsigned int h = 2166136261u;		/* FNV-1a */
 
-void
-AddMaterial( Material *mat )
+	while (*s) {
+		h ^= (unsigned char)*s++;
+		h *= 16777619u;
+	}
+	return h;
+}
+
+/*
+ * find the index of the entry called "name", or -1 if there
+ * isn't one
+ */
+static int
+FindName( NameTable *t, const char *name )
 {
+	unsigned int hash;
 	int i;
 
-	/* sanity check: is the material already in the table? */
-	for (i = 0; i < numMaterials; i++) {
-		if (!strcmp(mattab[i].name, mat->name)) {
-			fprintf(stderr, "Error: duplicate material name (%s)\n", mat->name);
-			return;
-		}
+	if (!t->bucket)
+		return -1;
+	hash = NameHash(name);
+	for (i = t->bucket[hash & t->mask]; i >= 0; i = t->entries[i].next) {
+		if (t->entries[i].hash == hash && !strcmp(t->entries[i].name, name))
+			return i;
 	}
-	numMaterials++;
-	if (numMaterials > maxMaterials) {
-		/* expand the table */
-		maxMaterials += 32;
-		mattab = myrealloc(mattab, maxMaterials*sizeof(Material));
-		if (!mattab) {
-			fprintf(stderr, "FATAL ERROR: out of memory\n");
-			exit(2);
+	return -1;
+}
+
+/*
+ * add "name" (which isn't copied) as the next entry of a table
+ * Returns 0 on success, -1 if we ran out of memory
+ */
+static int
+AddName( Arena *a, NameTable *t, char *name )
+{
+	NameEntry *e;
+	int *newbucket;
+	int i, h, numbuckets;
+	void *tab;
+
+	tab = t->entries;
+	if (GrowTable(a, &tab, &t->max, t->num + 1, sizeof(NameEntry), 0) != 0)
+		return -1;
+	t->entries = tab;
+
+	/* keep about one name per bucket */
+	if (!t->bucket || t->num > t->mask) {
+		numbuckets = t->bucket ? 2 * (t->mask + 1) : 64;
+		newbucket = ArenaMalloc(a, numbuckets * sizeof(int));
+		if (!newbucket) {
+			fprintf(stderr, "ERROR: out of memory\n");
+			return -1;
+		}
+		ArenaFree(a, t->bucket);
+		t->bucket = newbucket;
+		t->mask = numbuckets - 1;
+		for (h = 0; h < numbuckets; h++)
+			t->bucket[h] = -1;
+		for (i = 0, e = t->entries; i < t->num; i++, e++) {
+			h = e->hash & t->mask;
+			e->next = t->bucket[h];
+			t->bucket[h] = i;
 		}
 	}
-	mattab[numMaterials-1] = *mat;
+
+	e = &t->entries[t->num];
+	e->name = name;
+	e->hash = NameHash(name);
+	h = e->hash & t->mask;
+	e->next = t->bucket[h];
+	t->bucket[h] = t->num++;
+	return 0;
+}
+
+/*
+ * Add a material to the converter's "mattab" array.
+ * this can involve reallocating that array, if there
+ * isn't enough room in it now
+ * Returns 0 on success, -1 if we ran out of memory
+ */
+
+int
+AddMaterial( Converter *cv, Material *mat )
+{
+	void *tab;
+
+	/* sanity check: is the material already in the table? */
+	if (FindName(&cv->matnames, mat->name) >= 0) {
+		fprintf(stderr, "Error: duplicate material name (%s)\n", mat->name);
+		return 0;
+	}
+	tab = cv->mattab;
+	if (GrowTable(cv->arena, &tab, &cv->maxMaterials, cv->numMaterials + 1, sizeof(Material), 0) != 0)
+		return -1;
+	cv->mattab = tab;
+	if (AddName(cv->arena, &cv->matnames, mat->name) != 0)
+		return -1;
+	cv->mattab[cv->numMaterials++] = *mat;
+	return 0;
+}
+
+/*
+ * look for a material in the materials table, and return its
+ * index, or -1 if it isn't there
+ */
+int
+FindMaterial( Converter *cv, char *name )
+{
+	return FindName(&cv->matnames, name);
 }
 
 /*
  * look for a material in the materials table, and return its index
+ * (or complain, and use the first material, if it isn't there)
  */
 int
-GetMaterial(char *name)
+GetMaterial( Converter *cv, char *name )
 {
 	int i;
 
-	for (i = 0; i < numMaterials; i++) {
-		if (!strcmp(mattab[i].name, name)) {
-			return i;
-		}
-	}
+	i = FindMaterial(cv, name);
+	if (i >= 0)
+		return i;
 
 	fprintf(stderr, "Warning: material (%s) not found\n", name);
 	return 0;
 }
 
+/*
+ * the face and face normal tables always have the same size
+ */
+static int
+GrowFaces( Object *obj, int need, int exact )
+{
+	Arena *a = obj->cv->arena;
+	void *tab;
+	int max;
+
+	max = obj->maxPolys;
+	tab = obj->facetab;
+	if (GrowTable(a, &tab, &max, need, sizeof(Face), exact) != 0)
+		return -1;
+	obj->facetab = tab;
+	max = obj->maxPolys;
+	tab = obj->normtab;
+	if (GrowTable(a, &tab, &max, need, sizeof(FaceNormal), exact) != 0)
+		return -1;
+	obj->normtab = tab;
+	obj->maxPolys = max;
+	return 0;
+}
+
+/*
+ * grow all the arrays of a vertex table together
+ */
+static int
+GrowVerts( Object *obj, int need, int exact )
+{
+	VertexArrays *V = &obj->verts;
+	double **arrays[8];
+	void *tab;
+	int i, max;
+
+	arrays[0] = &V->x; arrays[1] = &V->y; arrays[2] = &V->z;
+	arrays[3] = &V->vx; arrays[4] = &V->vy; arrays[5] = &V->vz;
+	arrays[6] = &V->u; arrays[7] = &V->v;
+
+	for (i = 0; i < 8; i++) {
+		max = obj->maxVerts;
+		tab = *arrays[i];
+		if (GrowTable(obj->cv->arena, &tab, &max, need, sizeof(double), exact) != 0)
+			return -1;
+		*arrays[i] = tab;
+	}
+	obj->maxVerts = max;
+	return 0;
+}
+
+/*
+ * Make room for "count" more vertices (or polygons, with
+ * "corners" corners between them) in an object. The input
+ * readers call these when the file tells them up front how
+ * many are coming. Both return 0 on success, -1 if we ran
+ * out of memory.
+ */
+
+int
+ReserveVertices( Object *obj, int count )
+{
+	return GrowVerts(obj, obj->numVerts + count, 1);
+}
+
+int
+ReservePolygons( Object *obj, int count, int corners )
+{
+	void *tab;
+
+	if (GrowFaces(obj, obj->numPolys + count, 1) != 0)
+		return -1;
+	tab = obj->corntab;
+	if (GrowTable(obj->cv->arena, &tab, &obj->maxCorners, obj->numCorners + corners,
+		      sizeof(Corner), 1) != 0)
+		return -1;
+	obj->corntab = tab;
+	return 0;
+}
+
+/*
+ * Unpack vertex i of an object into a Vertex, or
+ * replace it with one.
+ */
+
+void
+GetVertex( Object *obj, int i, Vertex *vert )
+{
+	VertexArrays *V = &obj->verts;
+
+	vert->x = V->x[i]; vert->y = V->y[i]; vert->z = V->z[i];
+	vert->vx = V->vx[i]; vert->vy = V->vy[i]; vert->vz = V->vz[i];
+	vert->u = V->u[i]; vert->v = V->v[i];
+}
+
+void
+SetVertex( Object *obj, int i, Vertex *vert )
+{
+	VertexArrays *V = &obj->verts;
+
+	V->x[i] = vert->x; V->y[i] = vert->y; V->z[i] = vert->z;
+	V->vx[i] = vert->vx; V->vy[i] = vert->vy; V->vz[i] = vert->vz;
+	V->u[i] = vert->u; V->v[i] = vert->v;
+}
+
 /*
  * Add a new vertex to the vertex list for
  * a specific object.
+ * Returns 0 on success, -1 if we ran out of memory
  */
 
-void
+int
 AddVertex( Object *obj, Vertex *vert )
 {
-	obj->numVerts++;
-	if (obj->numVerts > obj->maxVerts) {
+	if (obj->numVerts >= obj->maxVerts) {
 		/* expand the table */
-		obj->maxVerts += 64;
-		obj->verttab = myrealloc(obj->verttab, obj->maxVerts*sizeof(Vertex));
-		if (!obj->verttab) {
-			fprintf(stderr, "FATAL ERROR: out of memory\n");
-			exit(2);
+		if (GrowVerts(obj, obj->numVerts + 1, 0) != 0)
+			return -1;
+	}
+	SetVertex(obj, obj->numVerts++, vert);
+	return 0;
+}
+
+/*
+ * Make room for "count" new vertices at the end of an
+ * object's vertex list, and return the index of the first
+ * of them (or -1 if we ran out of memory). The caller fills
+ * them in.
+ */
+
+int
+AllocVertices( Object *obj, int count )
+{
+	if (ReserveVertices(obj, count) != 0)
+		return -1;
+	obj->numVerts += count;
+	return obj->numVerts - count;
+}
+
+/*
+ * Free an object's vertex and face tables.
+ */
+
+void
+FreeGeometry( Object *obj )
+{
+	VertexArrays *V = &obj->verts;
+	Arena *a = obj->cv->arena;
+
+	ArenaFree(a, V->x);
+	ArenaFree(a, V->y);
+	ArenaFree(a, V->z);
+	ArenaFree(a, V->vx);
+	ArenaFree(a, V->vy);
+	ArenaFree(a, V->vz);
+	ArenaFree(a, V->u);
+	ArenaFree(a, V->v);
+	memset(V, 0, sizeof(*V));
+	obj->numVerts = obj->maxVerts = 0;
+
+	ArenaFree(a, obj->facetab);
+	ArenaFree(a, obj->normtab);
+	ArenaFree(a, obj->corntab);
+	obj->facetab = 0;
+	obj->normtab = 0;
+	obj->corntab = 0;
+	obj->numPolys = obj->maxPolys = 0;
+	obj->numCorners = obj->maxCorners = 0;
+}
+
+/*
+ * Check that an object's faces only refer to corners, and its
+ * corners only to vertices, that it has; for geometry that was
+ * loaded from a file rather than built by the input readers.
+ * Returns 0 if it's all good, -1 if not.
+ */
+
+int
+CheckGeometry( Object *obj )
+{
+	Face *f;
+	int i;
+
+	for (i = 0; i < obj->numPolys; i++) {
+		f = &obj->facetab[i];
+		if (f->numverts < 0 || f->numverts > MAXVERTICES)
+			return -1;
+		if (f->numverts > 0 && (f->first < 0 || f->first > obj->numCorners - f->numverts))
+			return -1;
+	}
+	for (i = 0; i < obj->numCorners; i++) {
+		if (obj->corntab[i].vert < 0 || obj->corntab[i].vert >= obj->numVerts)
+			return -1;
+	}
+	return 0;
+}
+
+/*
+ * Unpack face i of an object into a Polygon.
+ */
+
+void
+GetPolygon( Object *obj, int i, Polygon *p )
+{
+	Face *F = &obj->facetab[i];
+	Corner *C = &obj->corntab[F->first];
+	int j;
+
+	p->material = F->material;
+	p->fx = obj->normtab[i].fx;
+	p->fy = obj->normtab[i].fy;
+	p->fz = obj->normtab[i].fz;
+	if (obj->normrange) {
+		p->nlo[0] = obj->normrange[2*i].fx;
+		p->nlo[1] = obj->normrange[2*i].fy;
+		p->nlo[2] = obj->normrange[2*i].fz;
+		p->nhi[0] = obj->normrange[2*i+1].fx;
+		p->nhi[1] = obj->normrange[2*i+1].fy;
+		p->nhi[2] = obj->normrange[2*i+1].fz;
+	} else {
+		p->nlo[0] = p->nhi[0] = p->fx;
+		p->nlo[1] = p->nhi[1] = p->fy;
+		p->nlo[2] = p->nhi[2] = p->fz;
+	}
+	p->numverts = F->numverts;
+	for (j = 0; j < F->numverts; j++) {
+		p->vert[j] = C[j].vert;
+		p->u[j] = C[j].u;
+		p->v[j] = C[j].v;
+	}
+}
+
+/*
+ * Replace face i of an object with a Polygon. If the new
+ * polygon has more corners than the old face, the corners
+ * go at the end of the corner table, and the old ones are
+ * left unused until the next CompactFaces().
+ * Returns 0 on success, -1 if we ran out of memory (in which
+ * case the face is left alone).
+ */
+
+int
+SetPolygon( Object *obj, int i, Polygon *p )
+{
+	Face *F;
+	Corner *C;
+	int j;
+	void *tab;
+
+	if (p->numverts > obj->facetab[i].numverts) {
+		if (obj->numCorners + p->numverts > obj->maxCorners) {
+			/* expand the table */
+			tab = obj->corntab;
+			if (GrowTable(obj->cv->arena, &tab, &obj->maxCorners,
+				      obj->numCorners + p->numverts, sizeof(Corner), 0) != 0)
+				return -1;
+			obj->corntab = tab;
 		}
+		obj->facetab[i].first = obj->numCorners;
+		obj->numCorners += p->numverts;
+	}
+	F = &obj->facetab[i];
+	F->material = p->material;
+	F->numverts = p->numverts;
+	obj->normtab[i].fx = p->fx;
+	obj->normtab[i].fy = p->fy;
+	obj->normtab[i].fz = p->fz;
+	if (obj->normrange) {
+		obj->normrange[2*i].fx = p->nlo[0];
+		obj->normrange[2*i].fy = p->nlo[1];
+		obj->normrange[2*i].fz = p->nlo[2];
+		obj->normrange[2*i+1].fx = p->nhi[0];
+		obj->normrange[2*i+1].fy = p->nhi[1];
+		obj->normrange[2*i+1].fz = p->nhi[2];
 	}
-	obj->verttab[obj->numVerts-1] = *vert;
+	C = &obj->corntab[F->first];
+	for (j = 0; j < p->numverts; j++) {
+		C[j].vert = p->vert[j];
+		C[j].u = p->u[j];
+		C[j].v = p->v[j];
+	}
+	return 0;
 }
 
 /*
  * Add a new polygon to an object's polygon list.
+ * Returns 0 on success, -1 if we ran out of memory
  */
 
-void
+int
 AddPolygon( Object *obj, Polygon *p )
 {
-	obj->numPolys++;
-	if (obj->numPolys > obj->maxPolys) {
+	if (obj->numPolys >= obj->maxPolys) {
 		/* expand the table */
-		obj->maxPolys += 64;
-		obj->polytab = myrealloc(obj->polytab, obj->maxPolys*sizeof(Polygon));
-		if (!obj->polytab) {
-			fprintf(stderr, "FATAL ERROR: out of memory\n");
-			exit(2);
+		if (GrowFaces(obj, obj->numPolys + 1, 0) != 0)
+			return -1;
+	}
+	obj->facetab[obj->numPolys].first = obj->numCorners;
+	obj->facetab[obj->numPolys].numverts = 0;
+	if (SetPolygon(obj, obj->numPolys, p) != 0)
+		return -1;
+	obj->numPolys++;
+	return 0;
+}
+
+/*
+ * Squeeze out deleted faces (those with numverts set to 0),
+ * and any corners that are no longer in use (if there's
+ * memory for a new corner table; otherwise they stay).
+ */
+
+void
+CompactFaces( Object *obj )
+{
+	Corner *newcorntab;
+	int i, n, k;
+
+	newcorntab = NULL;
+	k = 0;
+	for (i = 0; i < obj->numPolys; i++)
+		k += obj->facetab[i].numverts;
+	if (k < obj->numCorners) {
+		newcorntab = ArenaMalloc(obj->cv->arena, (k > 0 ? k : 1) * sizeof(Corner));
+	}
+
+	n = k = 0;
+	for (i = 0; i < obj->numPolys; i++) {
+		if (obj->facetab[i].numverts <= 0)
+			continue;
+		if (newcorntab) {
+			memcpy(&newcorntab[k], &obj->corntab[obj->facetab[i].first],
+			       obj->facetab[i].numverts * sizeof(Corner));
+			obj->facetab[i].first = k;
+			k += obj->facetab[i].numverts;
 		}
+		if (i != n) {
+			obj->facetab[n] = obj->facetab[i];
+			obj->normtab[n] = obj->normtab[i];
+		}
+		n++;
+	}
+	obj->numPolys = n;
+	if (newcorntab) {
+		ArenaFree(obj->cv->arena, obj->corntab);
+		obj->corntab = newcorntab;
+		obj->numCorners = obj->maxCorners = k;
 	}
-	obj->polytab[obj->numPolys-1] = *p;
 }
 
 
@@ -120,164 +558,740 @@ AddPolygon( Object *obj, Polygon *p )
  */
 
 /*
- * Calculate the face normal of a polygon.
+ * Calculate the face normal of a face.
  * Uses Newell's method (see Graphics Gems III)
  */
 
-void
-CalcFaceNormal(Object *obj, Polygon *P)
+static void
+NewellNormal( VertexArrays *V, Corner *C, int numverts, FaceNormal *N )
 {
 	int i;
-	Vertex *p0, *p1;	/* start and end points */
+	int p0, p1;		/* start and end points */
 	double vx, vy, vz;
 	double length;
 
 	vx = vy = vz = 0.0;
 
-	p0 = &obj->verttab[P->vert[P->numverts-1]];
-	for (i = 0; i < P->numverts; i++) {
-		p1 = &obj->verttab[P->vert[i]];
-		vx += (p1->y - p0->y) * (p1->z + p0->z);
-		vy += (p1->z - p0->z) * (p1->x + p0->x);
-		vz += (p1->x - p0->x) * (p1->y + p0->y);
-		p0 = p1;
+	p0 = C[numverts-1].vert;
+	for (i = 0; i < numverts; i++) {
+		p1 = C[i].vert;
+		vx += (V->y[p1] - V->y[p0]) * (V->z[p1] + V->z[p0]);
+		vy += (V->z[p1] - V->z[p0]) * (V->x[p1] + V->x[p0]);
+		vz += (V->x[p1] - V->x[p0]) * (V->y[p1] + V->y[p0]);
+		p0 = p1;
+	}
+
+	length = sqrt(vx*vx + vy*vy + vz*vz);
+	vx /= length;
+	vy /= length;
+	vz /= length;
+
+	N->fx = vx;
+	N->fy = vy;
+	N->fz = vz;
+}
+
+#ifdef USE_SSE2
+/*
+ * Newell's method for two triangles at once, one in each
+ * half of the SSE registers. This does exactly the same
+ * arithmetic, in the same order, as NewellNormal(), so the
+ * results are identical.
+ */
+static void
+NewellNormal2( VertexArrays *V, Corner *C0, Corner *C1, FaceNormal *N0, FaceNormal *N1 )
+{
+	__m128d x0, y0, z0, x1, y1, z1;
+	__m128d vx, vy, vz, length;
+	double out[2];
+	int i;
+
+	vx = vy = vz = _mm_setzero_pd();
+	x0 = _mm_set_pd(V->x[C1[2].vert], V->x[C0[2].vert]);
+	y0 = _mm_set_pd(V->y[C1[2].vert], V->y[C0[2].vert]);
+	z0 = _mm_set_pd(V->z[C1[2].vert], V->z[C0[2].vert]);
+	for (i = 0; i < 3; i++) {
+		x1 = _mm_set_pd(V->x[C1[i].vert], V->x[C0[i].vert]);
+		y1 = _mm_set_pd(V->y[C1[i].vert], V->y[C0[i].vert]);
+		z1 = _mm_set_pd(V->z[C1[i].vert], V->z[C0[i].vert]);
+		vx = _mm_add_pd(vx, _mm_mul_pd(_mm_sub_pd(y1, y0), _mm_add_pd(z1, z0)));
+		vy = _mm_add_pd(vy, _mm_mul_pd(_mm_sub_pd(z1, z0), _mm_add_pd(x1, x0)));
+		vz = _mm_add_pd(vz, _mm_mul_pd(_mm_sub_pd(x1, x0), _mm_add_pd(y1, y0)));
+		x0 = x1; y0 = y1; z0 = z1;
+	}
+
+	length = _mm_sqrt_pd(_mm_add_pd(_mm_add_pd(_mm_mul_pd(vx, vx), _mm_mul_pd(vy, vy)),
+					_mm_mul_pd(vz, vz)));
+	vx = _mm_div_pd(vx, length);
+	vy = _mm_div_pd(vy, length);
+	vz = _mm_div_pd(vz, length);
+
+	_mm_storeu_pd(out, vx); N0->fx = out[0]; N1->fx = out[1];
+	_mm_storeu_pd(out, vy); N0->fy = out[0]; N1->fy = out[1];
+	_mm_storeu_pd(out, vz); N0->fz = out[0]; N1->fz = out[1];
+}
+#endif
+
+/*
+ * The clean up passes over a big object are split into chunks
+ * of consecutive faces or vertices, which are done in parallel
+ * (see threads.c). Every face or vertex is worked out exactly
+ * as it would be in a single pass, and anything collected by
+ * the chunks is put back together in order, so the results
+ * don't depend on how many threads there are.
+ */
+#define CHUNK_MIN	4096		/* smallest chunk worth a thread */
+
+typedef struct chunkjob {
+	Object	*obj;
+	int	first;			/* first item to work on */
+	int	count;			/* number of items to share out */
+	int	numchunks;
+	void	*data;			/* anything else the pass needs */
+} ChunkJob;
+
+/*
+ * how many chunks to split "count" items into, given
+ * "numthreads" threads to do them with; 1 means do them here
+ */
+static int
+NumChunks( int numthreads, int count )
+{
+	int n;
+
+	if (numthreads <= 1)
+		return 1;
+	n = count / CHUNK_MIN;
+	if (n > 4*numthreads)
+		n = 4*numthreads;
+	return (n > 1) ? n : 1;
+}
+
+/* chunk "n" of a job is items [*startp, *endp) */
+static void
+ChunkRange( ChunkJob *job, int n, int *startp, int *endp )
+{
+	*startp = job->first + (int)((int64_t)job->count * n / job->numchunks);
+	*endp = job->first + (int)((int64_t)job->count * (n+1) / job->numchunks);
+}
+
+/*
+ * Calculate the face normals of faces "start" to "end"-1
+ * of an object.
+ */
+static void
+FaceNormalRange( Object *obj, int start, int end )
+{
+	int i;
+	Face *F;
+#ifdef USE_SSE2
+	int pending = -1;	/* a triangle waiting for a partner */
+#endif
+
+	for (i = start; i < end; i++) {
+		F = &obj->facetab[i];
+		if (F->numverts <= 0)
+			continue;
+#ifdef USE_SSE2
+		if (F->numverts == 3) {
+			if (pending < 0) {
+				pending = i;
+			} else {
+				NewellNormal2(&obj->verts, &obj->corntab[obj->facetab[pending].first],
+					      &obj->corntab[F->first], &obj->normtab[pending], &obj->normtab[i]);
+				pending = -1;
+			}
+			continue;
+		}
+#endif
+		NewellNormal(&obj->verts, &obj->corntab[F->first], F->numverts, &obj->normtab[i]);
+	}
+#ifdef USE_SSE2
+	if (pending >= 0) {
+		F = &obj->facetab[pending];
+		NewellNormal(&obj->verts, &obj->corntab[F->first], F->numverts, &obj->normtab[pending]);
+	}
+#endif
+}
+
+static void
+facenormalchunk( void *arg, int n )
+{
+	ChunkJob *job = arg;
+	int start, end;
+
+	ChunkRange(job, n, &start, &end);
+	FaceNormalRange(job->obj, start, end);
+}
+
+/*
+ * Calculate the face normals of faces "first" onwards of
+ * an object, using up to "numthreads" threads. The input
+ * readers call this once they have read all of an object's
+ * faces.
+ */
+
+void
+CalcFaceNormals( Object *obj, int first, int numthreads )
+{
+	ChunkJob job;
+
+	job.obj = obj;
+	job.first = first;
+	job.count = obj->numPolys - first;
+	job.numchunks = NumChunks(numthreads, job.count);
+	if (job.numchunks > 1)
+		ParallelFor(numthreads, job.numchunks, facenormalchunk, &job);
+	else
+		FaceNormalRange(obj, first, obj->numPolys);
+}
+
+
+/*
+ * normalize vertex normals "start" to "end"-1
+ */
+static void
+NormalizeRange( VertexArrays *V, int start, int end )
+{
+	int i;
+	double length;
+
+	i = start;
+#ifdef USE_SSE2
+	{
+		__m128d x, y, z, len, keep;
+		__m128d zero = _mm_setzero_pd();
+
+		for (; i + 2 <= end; i += 2) {
+			x = _mm_loadu_pd(&V->vx[i]);
+			y = _mm_loadu_pd(&V->vy[i]);
+			z = _mm_loadu_pd(&V->vz[i]);
+			len = _mm_sqrt_pd(_mm_add_pd(_mm_add_pd(_mm_mul_pd(x, x), _mm_mul_pd(y, y)),
+						     _mm_mul_pd(z, z)));
+			/* leave alone any normal whose length isn't > 0 */
+			keep = _mm_cmpgt_pd(len, zero);
+			x = _mm_or_pd(_mm_and_pd(keep, _mm_div_pd(x, len)), _mm_andnot_pd(keep, x));
+			y = _mm_or_pd(_mm_and_pd(keep, _mm_div_pd(y, len)), _mm_andnot_pd(keep, y));
+			z = _mm_or_pd(_mm_and_pd(keep, _mm_div_pd(z, len)), _mm_andnot_pd(keep, z));
+			_mm_storeu_pd(&V->vx[i], x);
+			_mm_storeu_pd(&V->vy[i], y);
+			_mm_storeu_pd(&V->vz[i], z);
+		}
+	}
+#endif
+	for (; i < end; i++) {
+		length = sqrt(V->vx[i]*V->vx[i] + V->vy[i]*V->vy[i] + V->vz[i]*V->vz[i]);
+		if (length > 0.0) {
+			V->vx[i] /= length;
+			V->vy[i] /= length;
+			V->vz[i] /= length;
+		}
+	}
+}
+
+/*
+ * the faces using each vertex, in face order (a face that
+ * uses a vertex twice is listed twice)
+ */
+typedef struct vertfaces {
+	int *start;		/* faces of vertex k are face[start[k]..start[k+1]-1] */
+	int *face;
+} VertFaces;
+
+static void
+vertexnormalchunk( void *arg, int n )
+{
+	ChunkJob *job = arg;
+	VertFaces *vf = job->data;
+	VertexArrays *V = &job->obj->verts;
+	FaceNormal *N;
+	int start, end;
+	int k, f;
+
+	ChunkRange(job, n, &start, &end);
+	for (k = start; k < end; k++) {
+		for (f = vf->start[k]; f < vf->start[k+1]; f++) {
+			N = &job->obj->normtab[vf->face[f]];
+			V->vx[k] += N->fx;
+			V->vy[k] += N->fy;
+			V->vz[k] += N->fz;
+		}
+	}
+	NormalizeRange(V, start, end);
+}
+
+/*
+ * Build vertex normals for every point in a given
+ * object.
+ * For now, we use a very simple algorithm: the vertex
+ * normal is the average of the face normals of all
+ * faces that share the vertex.
+ */
+
+void
+CalcVertexNormals( Object *obj, int numthreads )
+{
+	int i, j;		/* loop counters */
+	Corner *C;
+	FaceNormal *N;
+	VertexArrays *V = &obj->verts;
+	int k;
+	ChunkJob job;
+	VertFaces vf;
+
+	/* first, for each vertex, add up all the polygon
+	 * face normals for faces using this vertex
+	 * (NOTE: we assume that the vertex normals were
+	 * initialized to 0!)
+	 * Faces can share vertices, so to do this in parallel
+	 * we first list the faces of each vertex; each vertex
+	 * then adds up the same normals in the same order as
+	 * the single threaded loop does.
+	 */
+	job.numchunks = NumChunks(numthreads, obj->numVerts);
+	if (job.numchunks > 1) {
+		vf.start = mycalloc( obj->numVerts + 1, sizeof(int) );
+		vf.face = mymalloc( (obj->numCorners > 0 ? obj->numCorners : 1) * sizeof(int) );
+		if (vf.start && vf.face) {
+			for (i = 0; i < obj->numPolys; i++) {
+				C = &obj->corntab[obj->facetab[i].first];
+				for (j = 0; j < obj->facetab[i].numverts; j++)
+					vf.start[C[j].vert+1]++;
+			}
+			for (k = 0; k < obj->numVerts; k++)
+				vf.start[k+1] += vf.start[k];
+			for (i = 0; i < obj->numPolys; i++) {
+				C = &obj->corntab[obj->facetab[i].first];
+				for (j = 0; j < obj->facetab[i].numverts; j++)
+					vf.face[vf.start[C[j].vert]++] = i;
+			}
+			/* the fill left start[k] pointing at the end of list k */
+			for (k = obj->numVerts; k > 0; k--)
+				vf.start[k] = vf.start[k-1];
+			vf.start[0] = 0;
+
+			job.obj = obj;
+			job.first = 0;
+			job.count = obj->numVerts;
+			job.data = &vf;
+			ParallelFor(numthreads, job.numchunks, vertexnormalchunk, &job);
+			myfree(vf.face);
+			myfree(vf.start);
+			return;
+		}
+		/* not enough memory for the lists; do it the slow way */
+		if (vf.start) myfree(vf.start);
+		if (vf.face) myfree(vf.face);
+	}
+
+	for (i = 0; i < obj->numPolys; i++) {
+		C = &obj->corntab[obj->facetab[i].first];
+		N = &obj->normtab[i];
+		for (j = 0; j < obj->facetab[i].numverts; j++) {
+			k = C[j].vert;
+			V->vx[k] += N->fx;
+			V->vy[k] += N->fy;
+			V->vz[k] += N->fz;
+		}
+	}
+
+	/* now normalize all the vertex normals */
+	NormalizeRange(V, 0, obj->numVerts);
+}
+
+/*
+ * Merge all vertices that are "sufficiently close".
+ */
+static int
+PointsSame(VertexArrays *V, int i, int j, double pointdelta)
+{
+	double dist;
+
+	dist = fabs(V->x[i] - V->x[j]) + fabs(V->y[i] - V->y[j]) +
+		fabs(V->z[i] - V->z[j]);
+	if (dist < pointdelta)
+		return 1;
+	else
+		return 0;
+}
+
+/*
+ * copy vertex "from" over vertex "to"
+ */
+static void
+MoveVertex(VertexArrays *V, int to, int from)
+{
+	if (to == from)
+		return;
+	V->x[to] = V->x[from]; V->y[to] = V->y[from]; V->z[to] = V->z[from];
+	V->vx[to] = V->vx[from]; V->vy[to] = V->vy[from]; V->vz[to] = V->vz[from];
+	V->u[to] = V->u[from]; V->v[to] = V->v[from];
+}
+
+/*
+ * To avoid comparing every point against every other
+ * point, the points are put into a hash table of grid cells,
+ * each 2*pointdelta on a side. Two points that are less than
+ * pointdelta apart differ by less than half a cell on every
+ * axis, so they are in the same or neighbouring cells even
+ * allowing for rounding; we only need to check the 27 cells
+ * around each point. (Cells are made twice as big as strictly
+ * necessary for exactly that reason.)
+ */
+#define CELL_LIMIT	1.0e15		/* clamp cell coordinates to this */
+
+typedef struct weldgrid {
+	double size;			/* length of a cell side */
+	double pointdelta;		/* how close points have to be to be merged */
+	int mask;			/* number of buckets - 1 */
+	int *bucket;			/* first point in each bucket, or -1 */
+	int *next;			/* next point in the same bucket */
+	int64_t *cell;			/* cell coordinates of each point */
+} WeldGrid;
+
+static int64_t
+CellCoord( double x, double size )
+{
+	double c;
+
+	c = floor(x / size);
+	if (c > CELL_LIMIT) c = CELL_LIMIT;
+	if (c < -CELL_LIMIT) c = -CELL_LIMIT;
+	return (int64_t)c;
+}
+
+static int
+CellHash( WeldGrid *g, int64_t x, int64_t y, int64_t z )
+{
+	uint64_t h;
+
+	h = (uint64_t)x * 73856093u ^ (uint64_t)y * 19349663u ^ (uint64_t)z * 83492791u;
+	h ^= h >> 29;
+	return (int)(h & (uint64_t)g->mask);
+}
+
+/*
+ * find the lowest numbered point in the grid that is the
+ * "same" as V, or -1 if there is none
+ */
+static int
+FindSamePoint( WeldGrid *g, VertexArrays *V, int i, int64_t *c )
+{
+	int dx, dy, dz;
+	int j, best;
+	int64_t *jc;
+
+	best = -1;
+	for (dx = -1; dx <= 1; dx++) {
+		for (dy = -1; dy <= 1; dy++) {
+			for (dz = -1; dz <= 1; dz++) {
+				j = g->bucket[CellHash(g, c[0]+dx, c[1]+dy, c[2]+dz)];
+				for (; j >= 0; j = g->next[j]) {
+					jc = &g->cell[3*j];
+					if (jc[0] != c[0]+dx || jc[1] != c[1]+dy || jc[2] != c[2]+dz)
+						continue;	/* different cell, same bucket */
+					if ((best < 0 || j < best) && PointsSame(V, i, j, g->pointdelta))
+						best = j;
+				}
+			}
+		}
+	}
+	return best;
+}
+
+/*
+ * For a big object the search is done in two passes. First, in
+ * parallel, every point looks among all the points before it for
+ * the earliest one it is the same as ("earlier"). Then the usual
+ * loop runs, but most points can use that answer: a point with no
+ * earlier twin is kept, and one whose earliest twin was kept is
+ * merged with it. Only a point whose twin was itself merged away
+ * has to search the grid of kept points; the answers are always
+ * the ones the usual loop would have found.
+ */
+typedef struct weldall {
+	WeldGrid *grid;
+	VertexArrays *V;
+	int64_t *cell;			/* cell coordinates of every point */
+	int *start;			/* points in bucket h are list[start[h]..start[h+1]-1] */
+	int *list;
+	int *earlier;			/* earliest point that is the same, or -1 */
+	char *merged;			/* point has been merged with another one */
+} WeldAll;
+
+/* infinities and NaNs are never the same as anything */
+#define FINITE_POINT(V, i) ((V)->x[i] - (V)->x[i] == 0.0 && (V)->y[i] - (V)->y[i] == 0.0 && \
+			    (V)->z[i] - (V)->z[i] == 0.0)
+
+static void
+weldcellchunk( void *arg, int n )
+{
+	ChunkJob *job = arg;
+	WeldAll *w = job->data;
+	VertexArrays *V = w->V;
+	int i, start, end;
+
+	ChunkRange(job, n, &start, &end);
+	for (i = start; i < end; i++) {
+		w->cell[3*i] = CellCoord(V->x[i], w->grid->size);
+		w->cell[3*i+1] = CellCoord(V->y[i], w->grid->size);
+		w->cell[3*i+2] = CellCoord(V->z[i], w->grid->size);
+	}
+}
+
+/*
+ * find the lowest numbered point before i that is the "same"
+ * as it, or -1 if there is none
+ */
+static int
+FindEarlierPoint( WeldAll *w, int i )
+{
+	int dx, dy, dz;
+	int j, k, h, best;
+	int64_t *c, *jc;
+
+	c = &w->cell[3*i];
+	best = -1;
+	for (dx = -1; dx <= 1; dx++) {
+		for (dy = -1; dy <= 1; dy++) {
+			for (dz = -1; dz <= 1; dz++) {
+				h = CellHash(w->grid, c[0]+dx, c[1]+dy, c[2]+dz);
+				/* the lists are in point order */
+				for (k = w->start[h]; k < w->start[h+1]; k++) {
+					j = w->list[k];
+					if (j >= i || (best >= 0 && j >= best))
+						break;
+					jc = &w->cell[3*j];
+					if (jc[0] != c[0]+dx || jc[1] != c[1]+dy || jc[2] != c[2]+dz)
+						continue;
+					if (PointsSame(w->V, i, j, w->grid->pointdelta)) {
+						best = j;
+						break;
+					}
+				}
+			}
+		}
 	}
+	return best;
+}
 
-	length = sqrt(vx*vx + vy*vy + vz*vz);
-	vx /= length;
-	vy /= length;
-	vz /= length;
+static void
+weldearlierchunk( void *arg, int n )
+{
+	ChunkJob *job = arg;
+	WeldAll *w = job->data;
+	int i, start, end;
 
-	P->fx = vx;
-	P->fy = vy;
-	P->fz = vz;
+	ChunkRange(job, n, &start, &end);
+	for (i = start; i < end; i++)
+		w->earlier[i] = FINITE_POINT(w->V, i) ? FindEarlierPoint(w, i) : -1;
 }
 
-
 /*
- * Build vertex normals for every point in a given
- * object.
- * For now, we use a very simple algorithm: the vertex
- * normal is the average of the face normals of all
- * faces that share the vertex.
+ * the first pass for big objects; returns 0 on success,
+ * -1 if we ran out of memory
  */
-
-void
-CalcVertexNormals( Object *obj )
+static int
+FindEarlierPoints( WeldAll *w, int numpoints, int numthreads )
 {
-	int i, j;		/* loop counters */
-	Polygon *P;
-	Vertex *V;
-	double length;
-
-	/* first, for each vertex, add up all the polygon
-	 * face normals for faces using this vertex
-	 * (NOTE: we assume that the vertex normals were
-	 * initialized to 0!)
-	 */
-	for (i = 0; i < obj->numPolys; i++) {
-		P = &obj->polytab[i];
-		for (j = 0; j < P->numverts; j++) {
-			V = &obj->verttab[P->vert[j]];
-			V->vx += P->fx;
-			V->vy += P->fy;
-			V->vz += P->fz;
+	ChunkJob job;
+	int i, h, numbuckets;
+
+	numbuckets = w->grid->mask + 1;
+	w->cell = mymalloc( numpoints * 3 * sizeof(int64_t) );
+	w->start = mycalloc( numbuckets + 1, sizeof(int) );
+	w->list = mymalloc( numpoints * sizeof(int) );
+	w->earlier = mymalloc( numpoints * sizeof(int) );
+	w->merged = mycalloc( numpoints, 1 );
+	if (!w->cell || !w->start || !w->list || !w->earlier || !w->merged)
+		return -1;
+
+	job.obj = NULL;
+	job.first = 0;
+	job.count = numpoints;
+	job.numchunks = NumChunks(numthreads, numpoints);
+	job.data = w;
+	ParallelFor(numthreads, job.numchunks, weldcellchunk, &job);
+
+	/* sort the finite points into their buckets */
+	for (i = 0; i < numpoints; i++) {
+		if (FINITE_POINT(w->V, i))
+			w->start[CellHash(w->grid, w->cell[3*i], w->cell[3*i+1], w->cell[3*i+2])+1]++;
+	}
+	for (h = 0; h < numbuckets; h++)
+		w->start[h+1] += w->start[h];
+	for (i = 0; i < numpoints; i++) {
+		if (FINITE_POINT(w->V, i)) {
+			h = CellHash(w->grid, w->cell[3*i], w->cell[3*i+1], w->cell[3*i+2]);
+			w->list[w->start[h]++] = i;
 		}
 	}
+	for (h = numbuckets; h > 0; h--)
+		w->start[h] = w->start[h-1];
+	w->start[0] = 0;
 
-	/* now normalize all the face normals */
-	for (i = 0; i < obj->numVerts; i++) {
-		V = &obj->verttab[i];
-		length = sqrt(V->vx*V->vx + V->vy*V->vy + V->vz*V->vz);
-		if (length > 0.0) {
-			V->vx /= length;
-			V->vy /= length;
-			V->vz /= length;
-		}
+	ParallelFor(numthreads, job.numchunks, weldearlierchunk, &job);
+	return 0;
+}
+
+static void
+FreeWeldAll( WeldAll *w )
+{
+	if (w->cell) myfree(w->cell);
+	if (w->start) myfree(w->start);
+	if (w->list) myfree(w->list);
+	if (w->earlier) myfree(w->earlier);
+	if (w->merged) myfree(w->merged);
+}
+
+/* copy the (u,v) information of corners "start" to "end"-1 into them */
+static void
+SaveCornerUV( Object *obj, int start, int end )
+{
+	int i;
+	Corner *C;
+
+	for (i = start, C = &obj->corntab[start]; i < end; i++, C++) {
+		C->u = obj->verts.u[C->vert];
+		C->v = obj->verts.v[C->vert];
 	}
 }
 
-/*
- * Merge all vertices that are "sufficiently close".
- */
-static int
-PointsSame(Vertex *v1, Vertex *v2)
+static void
+saveuvchunk( void *arg, int n )
 {
-	double dist;
-	extern double pointdelta;
+	ChunkJob *job = arg;
+	int start, end;
 
-	dist = fabs(v1->x - v2->x) + fabs(v1->y - v2->y) +
-		fabs(v1->z - v2->z);
-	if (dist < pointdelta)
-		return 1;
-	else
-		return 0;
+	ChunkRange(job, n, &start, &end);
+	SaveCornerUV(job->obj, start, end);
+}
+
+static void
+relabelchunk( void *arg, int n )
+{
+	ChunkJob *job = arg;
+	int *pointmap = job->data;
+	Corner *C;
+	int i, start, end;
+
+	ChunkRange(job, n, &start, &end);
+	for (i = start, C = &job->obj->corntab[start]; i < end; i++, C++)
+		C->vert = pointmap[C->vert];
 }
 
 void
-MergeVertices( Object *obj )
+MergeVertices( Object *obj, int numthreads )
 {
 	int *pointmap;
-	int i, j;
-	Polygon *P;
+	int i, j, e;
 	int newnumVerts;
-	Vertex *newverttab;
+	VertexArrays *V = &obj->verts;
+	WeldGrid grid;
+	WeldAll all, *w;
+	ChunkJob job;
+	int64_t *c;
+	int h;
+	double pointdelta = obj->cv->pointdelta;
+
+	/* first, save the (u,v) information into the face corners */
+	job.obj = obj;
+	job.first = 0;
+	job.count = obj->numCorners;
+	job.numchunks = NumChunks(numthreads, obj->numCorners);
+	if (job.numchunks > 1)
+		ParallelFor(numthreads, job.numchunks, saveuvchunk, &job);
+	else
+		SaveCornerUV(obj, 0, obj->numCorners);
 
-	/* first, save the (u,v) information into the polygon structure */
-	for (i = 0; i < obj->numPolys; i++) {
-		P = &obj->polytab[i];
-		for (j = 0; j < P->numverts; j++) {
-			P->u[j] = obj->verttab[P->vert[j]].u;
-			P->v[j] = obj->verttab[P->vert[j]].v;
-		}
-	}
+	/* nothing can be closer than a non-positive distance */
+	if (!(pointdelta > 0.0) || obj->numVerts < 2)
+		return;
 
+	for (h = 1; h < obj->numVerts; h <<= 1)
+		;
+	grid.size = 2.0 * pointdelta;
+	grid.pointdelta = pointdelta;
+	grid.mask = h - 1;
+	grid.bucket = mycalloc( h, sizeof(int) );
+	grid.next = mycalloc( obj->numVerts, sizeof(int) );
+	grid.cell = mycalloc( obj->numVerts, 3*sizeof(int64_t) );
 	pointmap = mycalloc( obj->numVerts, sizeof(int) );
-	if (!pointmap) {
+	memset(&all, 0, sizeof(all));
+	w = NULL;
+	if (!grid.bucket || !grid.next || !grid.cell || !pointmap) {
 		fprintf(stderr, "WARNING: unable to merge vertices (out of memory)\n");
-		return;
+		goto done;
 	}
-	newverttab = mycalloc( obj->numVerts, sizeof(Vertex) );
-	if (!newverttab) {
-		myfree(pointmap);
-		fprintf(stderr, "WARNING: unable to merge vertices (out of memory)\n");
-		return;
+	for (i = 0; i < h; i++)
+		grid.bucket[i] = -1;
+
+	if (NumChunks(numthreads, obj->numVerts) > 1) {
+		all.grid = &grid;
+		all.V = V;
+		if (FindEarlierPoints(&all, obj->numVerts, numthreads) == 0)
+			w = &all;
 	}
 
 	/* for each point, see if it is approximately the same as
-	 * a point occuring earlier in the list
+	 * a point occuring earlier in the list; if several are,
+	 * the earliest one wins, just as if we had searched the
+	 * whole list in order. The points we keep are moved down
+	 * in the table as we go (they never move up, so nothing
+	 * we still need gets overwritten).
 	 */
 	newnumVerts = 0;
 	for (i = 0; i < obj->numVerts; i++) {
-		for (j = 0; j < newnumVerts; j++) {
-			if (PointsSame(&obj->verttab[i], &newverttab[j])) {
-				pointmap[i] = j;
-				goto skippt;
-			}
+		if (!FINITE_POINT(V, i)) {
+			pointmap[i] = newnumVerts;
+			MoveVertex(V, newnumVerts++, i);
+			continue;
+		}
+		c = &grid.cell[3*newnumVerts];
+		if (w) {
+			c[0] = w->cell[3*i]; c[1] = w->cell[3*i+1]; c[2] = w->cell[3*i+2];
+			e = w->earlier[i];
+			if (e < 0)
+				j = -1;
+			else if (!w->merged[e])
+				j = pointmap[e];
+			else
+				j = FindSamePoint(&grid, V, i, c);
+		} else {
+			c[0] = CellCoord(V->x[i], grid.size);
+			c[1] = CellCoord(V->y[i], grid.size);
+			c[2] = CellCoord(V->z[i], grid.size);
+			j = FindSamePoint(&grid, V, i, c);
+		}
+		if (j >= 0) {
+			pointmap[i] = j;
+			if (w)
+				w->merged[i] = 1;
+			continue;
 		}
 		pointmap[i] = newnumVerts;
-		newverttab[newnumVerts++] = obj->verttab[i];
-skippt:
-		;
+		MoveVertex(V, newnumVerts, i);
+		h = CellHash(&grid, c[0], c[1], c[2]);
+		grid.next[newnumVerts] = grid.bucket[h];
+		grid.bucket[h] = newnumVerts;
+		newnumVerts++;
 	}
 
 	/* did we merge points? if so, relabel all the polygon vertices */
 	if (newnumVerts != obj->numVerts) {
-		if (verbose)
-			fprintf(stdout, "Object %s: merged %d points into %d\n", obj->name, obj->numVerts, newnumVerts);
-		myfree(obj->verttab);
-		obj->verttab = newverttab;
 		obj->numVerts = newnumVerts;
-		for (i = 0; i < obj->numPolys; i++) {
-			P = &obj->polytab[i];
-			for (j = 0; j < P->numverts; j++) {
-				P->vert[j] = pointmap[P->vert[j]];
-			}
-		}
-	} else {
-		myfree(newverttab);
+		job.data = pointmap;
+		if (job.numchunks > 1)
+			ParallelFor(numthreads, job.numchunks, relabelchunk, &job);
+		else
+			relabelchunk(&job, 0);
 	}
-	myfree(pointmap);
+done:
+	FreeWeldAll(&all);
+	if (pointmap) myfree(pointmap);
+	if (grid.cell) myfree(grid.cell);
+	if (grid.next) myfree(grid.next);
+	if (grid.bucket) myfree(grid.bucket);
 }
 
 
@@ -298,45 +1312,94 @@ skippt:
  * they point in different directions, the polygon is not convex.
  */
 static int
-Convex( Vertex *verttab, Polygon *A )
+Convex( VertexArrays *V, Polygon *A )
 {
-	Vertex *VA, *VB, *VC;
+	int a, b, c;		/* three consecutive vertices */
 	double vx, vy, vz;	/* cross product */
 	int i;
 
-	VA = &verttab[A->vert[A->numverts-2]];
-	VB = &verttab[A->vert[A->numverts-1]];
+	a = A->vert[A->numverts-2];
+	b = A->vert[A->numverts-1];
 
 	for (i = 0; i < A->numverts; i++) {
-		VC = &verttab[A->vert[i]];
+		c = A->vert[i];
 
-		vx = (VA->y - VB->y)*(VC->z - VB->z) - (VA->z - VB->z)*(VC->y - VB->y);
-		vy = (VA->z - VB->z)*(VC->x - VB->x) - (VA->x - VB->x)*(VC->z - VB->z);
-		vz = (VA->x - VB->x)*(VC->y - VB->y) - (VA->y - VB->y)*(VC->x - VB->x);
+		vx = (V->y[a] - V->y[b])*(V->z[c] - V->z[b]) - (V->z[a] - V->z[b])*(V->y[c] - V->y[b]);
+		vy = (V->z[a] - V->z[b])*(V->x[c] - V->x[b]) - (V->x[a] - V->x[b])*(V->z[c] - V->z[b]);
+		vz = (V->x[a] - V->x[b])*(V->y[c] - V->y[b]) - (V->y[a] - V->y[b])*(V->x[c] - V->x[b]);
 
 		/* check dot product with face normal */
 		if (vx * A->fx + vy * A->fy + vz * A->fz < 0.1)
 			return 0;
-		VA = VB;
-		VB = VC;
+		a = b;
+		b = c;
 	}
 	return 1;
 }
 
+/*
+ * work out the normal of a polygon from its vertices (Newell's
+ * method), pointing the same way as its old normal, and put it in
+ * P->fx, P->fy, P->fz; if the polygon has no area the old normal
+ * is just normalized
+ */
+static void
+PolygonNormal( VertexArrays *V, Polygon *P )
+{
+	double nx, ny, nz, len;
+	int a, b, i;
+
+	nx = ny = nz = 0.0;
+	a = P->vert[P->numverts-1];
+	for (i = 0; i < P->numverts; i++) {
+		b = P->vert[i];
+		nx += (V->y[a] - V->y[b]) * (V->z[a] + V->z[b]);
+		ny += (V->z[a] - V->z[b]) * (V->x[a] + V->x[b]);
+		nz += (V->x[a] - V->x[b]) * (V->y[a] + V->y[b]);
+		a = b;
+	}
+	if (nx * P->fx + ny * P->fy + nz * P->fz < 0.0) {
+		nx = -nx; ny = -ny; nz = -nz;
+	}
+	len = sqrt(nx*nx + ny*ny + nz*nz);
+	if (len == 0.0) {
+		nx = P->fx; ny = P->fy; nz = P->fz;
+		len = sqrt(nx*nx + ny*ny + nz*nz);
+		if (len == 0.0)
+			return;
+	}
+	P->fx = nx / len;
+	P->fy = ny / len;
+	P->fz = nz / len;
+}
+
 static int
-CanMerge( Vertex *verttab, Polygon *A, Polygon *B, Polygon *Merged )
+CanMerge( Object *obj, Polygon *A, Polygon *B, Polygon *Merged )
 {
-	extern double facedelta;
-	double normdiff;
-	int i, j, k;
+	double normdiff, d1, d2;
+	int i, j, k, k2;
 	int Astart, Aend;		/* start and end points of current edge of A */
 	int Bstart, Bend;		/* start and end points of currend edge of B */
 
 	if (A->material != B->material)
 		return 0;
 
-	normdiff = fabs(A->fx - B->fx) + fabs(A->fy - B->fy) + fabs(A->fz - B->fz);
-	if (normdiff > facedelta)
+	/* merging removes the two shared vertices; the rest must fit */
+	if (A->numverts + B->numverts - 2 > MAXVERTICES)
+		return 0;
+
+	/* every face that went into A must be close enough to every
+	 * one that went into B (comparing their average normals would
+	 * let a polygon keep growing round a gentle curve); for two
+	 * single faces this is just the difference of their normals
+	 */
+	normdiff = 0.0;
+	for (i = 0; i < 3; i++) {
+		d1 = A->nhi[i] - B->nlo[i];
+		d2 = B->nhi[i] - A->nlo[i];
+		normdiff += (d1 > d2) ? d1 : d2;
+	}
+	if (normdiff > obj->cv->facedelta)
 		return 0;
 
 	/* for each edge of A, see if there is a corresponding edge of B */
@@ -379,8 +1442,13 @@ mergepolys:
 				j++;
 				if (j >= B->numverts)
 					j = 0;
-				if (B->vert[j] == Aend)		/* this is guaranteed to happen eventually */
+				if (B->vert[j] == Aend) {	/* this is guaranteed to happen eventually */
+					/* the other end of the edge has to match, too */
+					k2 = (i+1 < A->numverts) ? i+1 : 0;
+					if ( (A->u[k2] != B->u[j]) || (A->v[k2] != B->v[j]) )
+						return 0;
 					break;
+				}
 				Merged->vert[k] = B->vert[j];
 				Merged->u[k] = B->u[j];
 				Merged->v[k] = B->v[j];
@@ -393,71 +1461,646 @@ mergepolys:
 	Merged->fx = (A->fx+B->fx)/2.0;
 	Merged->fy = (A->fy+B->fy)/2.0;
 	Merged->fz = (A->fz+B->fz)/2.0;
+	for (i = 0; i < 3; i++) {
+		Merged->nlo[i] = (A->nlo[i] < B->nlo[i]) ? A->nlo[i] : B->nlo[i];
+		Merged->nhi[i] = (A->nhi[i] > B->nhi[i]) ? A->nhi[i] : B->nhi[i];
+	}
+	/* with -maxmerge polygons can keep growing, so give each one
+	 * its own proper normal rather than an average of averages
+	 */
+	if (obj->normrange)
+		PolygonNormal(&obj->verts, Merged);
 
 /* make sure the merged triangles are still convex */
-	if (Convex(verttab, Merged))
+	if (Convex(&obj->verts, Merged))
 		return 1;
 	else
 		return 0;
 }
 
-void
-MergeFaces( Object *obj )
+/*
+ * an edge of a polygon, going from vertex "from" to vertex
+ * "to"; MergeFaces sorts these so that it can quickly find
+ * all the polygons on the other side of an edge
+ */
+typedef struct halfedge {
+	int from, to;
+	int poly;
+} HalfEdge;
+
+static int
+CompareEdges( const void *a, const void *b )
 {
-	int i;
-	Polygon *FirstPoly, *NextPoly;
+	const HalfEdge *A = a, *B = b;
+
+	if (A->from != B->from)
+		return (A->from < B->from) ? -1 : 1;
+	if (A->to != B->to)
+		return (A->to < B->to) ? -1 : 1;
+	if (A->poly != B->poly)
+		return (A->poly < B->poly) ? -1 : 1;
+	return 0;
+}
+
+/*
+ * find the first half edge going from "from" to "to"
+ * (or where it would be if there isn't one)
+ */
+static int
+FindEdge( HalfEdge *edges, int numedges, int from, int to )
+{
+	int lo, hi, mid;
+
+	lo = 0; hi = numedges;
+	while (lo < hi) {
+		mid = lo + (hi - lo)/2;
+		if (edges[mid].from < from || (edges[mid].from == from && edges[mid].to < to))
+			lo = mid+1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/*
+ * build the table of every edge of every (live) polygon in
+ * an object, sorted so that FindEdge can look them up;
+ * returns NULL if we run out of memory
+ */
+static HalfEdge *
+BuildEdgeTable( Object *obj, int *numedgesp )
+{
+	HalfEdge *edges;
+	Face *F;
+	Corner *C;
+	int numedges;
+	int i, j;
+	int from;
+
+	numedges = 0;
+	for (i = 0; i < obj->numPolys; i++)
+		if (obj->facetab[i].numverts > 0)
+			numedges += obj->facetab[i].numverts;
+	edges = mymalloc( (numedges > 0 ? numedges : 1) * sizeof(HalfEdge) );
+	if (!edges)
+		return NULL;
+
+	numedges = 0;
+	for (i = 0; i < obj->numPolys; i++) {
+		F = &obj->facetab[i];
+		if (F->numverts <= 0)
+			continue;
+		C = &obj->corntab[F->first];
+		from = C[F->numverts-1].vert;
+		for (j = 0; j < F->numverts; j++) {
+			edges[numedges].from = from;
+			edges[numedges].to = C[j].vert;
+			edges[numedges].poly = i;
+			numedges++;
+			from = C[j].vert;
+		}
+	}
+	qsort(edges, numedges, sizeof(HalfEdge), CompareEdges);
+	*numedgesp = numedges;
+	return edges;
+}
+
+/*
+ * the pairs of polygons that can be merged, found by one chunk
+ * of polygons; arcs[2*k] is a polygon in the chunk, arcs[2*k+1]
+ * a later one across one of its edges
+ */
+typedef struct arclist {
+	int *arcs;
+	int numarcs, maxarcs;
+	int failed;			/* ran out of memory */
+} ArcList;
+
+typedef struct arcjob {
+	HalfEdge *edges;
+	int numedges;
+	ArcList *lists;			/* one for each chunk */
+} ArcJob;
+
+static void
+arcchunk( void *arg, int n )
+{
+	ChunkJob *job = arg;
+	ArcJob *aj = job->data;
+	ArcList *l = &aj->lists[n];
+	HalfEdge *edges = aj->edges;
+	Object *obj = job->obj;
+	Polygon P, Q;
+	Polygon MergedPoly;
+	int *newarcs;
+	int i, j, e, start, end;
+	int from, to;
+
+	ChunkRange(job, n, &start, &end);
+	for (i = start; i < end; i++) {
+		if (obj->facetab[i].numverts <= 0)
+			continue;
+		GetPolygon(obj, i, &P);
+		from = P.vert[P.numverts-1];
+		for (j = 0; j < P.numverts; j++) {
+			to = P.vert[j];
+			for (e = FindEdge(edges, aj->numedges, to, from);
+			     e < aj->numedges && edges[e].from == to && edges[e].to == from; e++) {
+				if (edges[e].poly <= i)
+					continue;
+				GetPolygon(obj, edges[e].poly, &Q);
+				if (!CanMerge( obj, &P, &Q, &MergedPoly ))
+					continue;
+				if (l->numarcs >= l->maxarcs) {
+					l->maxarcs = l->maxarcs ? 2*l->maxarcs : 256;
+					newarcs = myrealloc(l->arcs, l->maxarcs * 2 * sizeof(int));
+					if (!newarcs) {
+						l->failed = 1;
+						return;
+					}
+					l->arcs = newarcs;
+				}
+				l->arcs[2*l->numarcs] = i;
+				l->arcs[2*l->numarcs+1] = edges[e].poly;
+				l->numarcs++;
+			}
+			from = to;
+		}
+	}
+}
+
+/*
+ * collect the pairs of (live) polygons that can be merged, each
+ * pair once, in order of the first polygon and then of its edges;
+ * the array goes in *arcsp (NULL if there are none), and the
+ * number of pairs in *numarcsp.
+ * Returns 0 on success, -1 if we ran out of memory
+ */
+static int
+CollectArcs( Object *obj, HalfEdge *edges, int numedges, int numthreads,
+	     int **arcsp, int *numarcsp )
+{
+	ChunkJob job;
+	ArcJob aj;
+	int *arcs;
+	int n, numarcs, ret;
+
+	*arcsp = NULL;
+	*numarcsp = 0;
+	job.obj = obj;
+	job.first = 0;
+	job.count = obj->numPolys;
+	job.numchunks = NumChunks(numthreads, obj->numPolys);
+	job.data = &aj;
+	aj.edges = edges;
+	aj.numedges = numedges;
+	aj.lists = mycalloc( job.numchunks, sizeof(ArcList) );
+	if (!aj.lists)
+		return -1;
+	if (job.numchunks > 1)
+		ParallelFor(numthreads, job.numchunks, arcchunk, &job);
+	else
+		arcchunk(&job, 0);
+
+	ret = 0;
+	numarcs = 0;
+	for (n = 0; n < job.numchunks; n++) {
+		if (aj.lists[n].failed)
+			ret = -1;
+		numarcs += aj.lists[n].numarcs;
+	}
+	if (ret == 0 && job.numchunks == 1) {
+		/* no need to copy anything */
+		*arcsp = aj.lists[0].arcs;
+		*numarcsp = numarcs;
+		aj.lists[0].arcs = NULL;
+	} else if (ret == 0 && numarcs > 0) {
+		arcs = mymalloc( numarcs * 2 * sizeof(int) );
+		if (arcs) {
+			*arcsp = arcs;
+			*numarcsp = numarcs;
+			for (n = 0; n < job.numchunks; n++) {
+				memcpy(arcs, aj.lists[n].arcs, aj.lists[n].numarcs * 2 * sizeof(int));
+				arcs += 2*aj.lists[n].numarcs;
+			}
+		} else {
+			ret = -1;
+		}
+	}
+	for (n = 0; n < job.numchunks; n++) {
+		if (aj.lists[n].arcs)
+			myfree(aj.lists[n].arcs);
+	}
+	myfree(aj.lists);
+	return ret;
+}
+
+/*
+ * Merge pairs of faces. Each polygon, in order, is paired
+ * with the first later polygon across any of its edges that
+ * it can be merged with; a polygon that has been merged
+ * once is left alone after that. Merged-away polygons are
+ * marked by setting numverts to 0.
+ * Returns the number of merges done, or -1 if we ran out
+ * of memory.
+ */
+static int
+GreedyMerge( Object *obj, int numthreads )
+{
+	int i, j, e, n;
+	Polygon FirstPoly, NextPoly;
 	Polygon MergedPoly;
 	int mergedsome;
-	int oldnumPolys;
+	HalfEdge *edges;
+	int numedges;
+	char *merged;
+	int *prefer;
+	int *arcs;
+	int numarcs;
+	int from, to;
+
+	edges = BuildEdgeTable(obj, &numedges);
+	merged = mycalloc( obj->numPolys, 1 );
+	prefer = NULL;
+	if (edges && merged && NumChunks(numthreads, obj->numPolys) > 1) {
+		/* for big objects, find in parallel the first later
+		 * polygon each one could be merged with. Polygons are
+		 * only changed once they have been merged, so when a
+		 * polygon's turn comes this is still the answer,
+		 * unless that polygon has been merged already
+		 */
+		prefer = mymalloc( obj->numPolys * sizeof(int) );
+		if (prefer && CollectArcs(obj, edges, numedges, numthreads, &arcs, &numarcs) == 0) {
+			for (i = 0; i < obj->numPolys; i++)
+				prefer[i] = -1;
+			for (j = 0; j < numarcs; j++) {
+				i = arcs[2*j]; n = arcs[2*j+1];
+				if (prefer[i] < 0 || n < prefer[i])
+					prefer[i] = n;
+			}
+			if (arcs) myfree(arcs);
+		} else if (prefer) {
+			myfree(prefer);
+			prefer = NULL;
+		}
+	}
+	if (!edges || !merged) {
+		if (edges) myfree(edges);
+		if (merged) myfree(merged);
+		return -1;
+	}
 
 	mergedsome = 0;
-	for (i = 0; i < obj->numPolys-1; ) {
-		FirstPoly = &obj->polytab[i];
-		NextPoly = &obj->polytab[i+1];
-		if ( CanMerge( obj->verttab, FirstPoly, NextPoly, &MergedPoly ) ) {
-			*FirstPoly = MergedPoly;
-			NextPoly->numverts = 0;			/* mark NextPoly as deleted */
-			i += 2;					/* skip both polygons */
-			mergedsome++;
+	for (i = 0; i < obj->numPolys; i++) {
+		if (merged[i] || obj->facetab[i].numverts <= 0)
+			continue;
+		GetPolygon(obj, i, &FirstPoly);
+		n = -1;
+		if (prefer && (prefer[i] < 0 || !merged[prefer[i]])) {
+			n = prefer[i];
 		} else {
-			i++;
+			/* look at the polygons across each edge; a neighbour
+			 * shares the edge, but runs it the other way
+			 */
+			from = FirstPoly.vert[FirstPoly.numverts-1];
+			for (j = 0; j < FirstPoly.numverts; j++) {
+				to = FirstPoly.vert[j];
+				for (e = FindEdge(edges, numedges, to, from);
+				     e < numedges && edges[e].from == to && edges[e].to == from; e++) {
+					if (edges[e].poly <= i || merged[edges[e].poly])
+						continue;
+					if (n >= 0 && edges[e].poly >= n)
+						break;		/* already have an earlier one */
+					GetPolygon(obj, edges[e].poly, &NextPoly);
+					if (CanMerge( obj, &FirstPoly, &NextPoly, &MergedPoly ))
+						n = edges[e].poly;
+				}
+				from = to;
+			}
+		}
+		if (n >= 0) {
+			GetPolygon(obj, n, &NextPoly);
+			CanMerge( obj, &FirstPoly, &NextPoly, &MergedPoly );
+			if (SetPolygon(obj, i, &MergedPoly) != 0) {
+				mergedsome = -1;
+				break;
+			}
+			obj->facetab[n].numverts = 0;		/* mark NextPoly as deleted */
+			merged[i] = merged[n] = 1;
+			mergedsome++;
 		}
 	}
+	if (prefer) myfree(prefer);
+	myfree(merged);
+	myfree(edges);
+	return mergedsome;
+}
 
-	/* now compress the polygon list */
-	if (mergedsome) {
-		oldnumPolys = obj->numPolys;
-		obj->numPolys = 0;
-		for (i = 0; i < oldnumPolys; i++) {
-			if (obj->polytab[i].numverts > 0) {
-				if (i != obj->numPolys)
-					obj->polytab[obj->numPolys] = obj->polytab[i];
-				obj->numPolys++;
+/*
+ * state for finding a maximum matching in the graph whose
+ * nodes are polygons, and whose arcs join polygons that can
+ * be merged (Edmonds' blossom algorithm)
+ */
+typedef struct matching {
+	int n;				/* number of polygons */
+	int *adjstart;			/* arcs of node i are adj[adjstart[i]..adjstart[i+1]-1] */
+	int *adj;
+	int *match;			/* node matched with, or -1 */
+	int *parent;			/* alternating tree links, or -1 */
+	int *base;			/* base of the blossom containing the node */
+	int *mark;			/* stamps for the common ancestor search */
+	int *blossom;			/* stamps for nodes in the current blossom */
+	char *used;			/* node is an outer node of the tree */
+	int *queue;
+	int *touched;			/* nodes to reset after the search */
+	int numtouched;
+	int stamp;
+} Matching;
+
+static void
+TouchNode( Matching *m, int v )
+{
+	if (m->parent[v] < 0 && !m->used[v] && m->base[v] == v)
+		m->touched[m->numtouched++] = v;
+}
+
+static int
+CommonBase( Matching *m, int a, int b )
+{
+	m->stamp++;
+	for (;;) {
+		a = m->base[a];
+		m->mark[a] = m->stamp;
+		if (m->match[a] < 0)
+			break;
+		a = m->parent[m->match[a]];
+	}
+	for (;;) {
+		b = m->base[b];
+		if (m->mark[b] == m->stamp)
+			return b;
+		b = m->parent[m->match[b]];
+	}
+}
+
+static void
+MarkBlossomPath( Matching *m, int v, int b, int child )
+{
+	while (m->base[v] != b) {
+		m->blossom[m->base[v]] = m->blossom[m->base[m->match[v]]] = m->stamp;
+		m->parent[v] = child;
+		child = m->match[v];
+		v = m->parent[m->match[v]];
+	}
+}
+
+/*
+ * look for an augmenting path starting at the free node
+ * "root"; returns the free node at its other end, or -1
+ */
+static int
+FindAugmentingPath( Matching *m, int root )
+{
+	int qhead, qtail;
+	int v, to, i, k, b;
+	int found;
+
+	found = -1;
+	m->numtouched = 0;
+	TouchNode(m, root);
+	m->used[root] = 1;
+	qhead = qtail = 0;
+	m->queue[qtail++] = root;
+	while (qhead < qtail && found < 0) {
+		v = m->queue[qhead++];
+		for (k = m->adjstart[v]; k < m->adjstart[v+1]; k++) {
+			to = m->adj[k];
+			if (m->base[v] == m->base[to] || m->match[v] == to)
+				continue;
+			if (to == root || (m->match[to] >= 0 && m->parent[m->match[to]] >= 0)) {
+				/* found an odd cycle; shrink it into a blossom */
+				b = CommonBase(m, v, to);
+				MarkBlossomPath(m, v, b, to);
+				MarkBlossomPath(m, to, b, v);
+				for (i = 0; i < m->numtouched; i++) {
+					if (m->blossom[m->base[m->touched[i]]] == m->stamp) {
+						m->base[m->touched[i]] = b;
+						if (!m->used[m->touched[i]]) {
+							m->used[m->touched[i]] = 1;
+							m->queue[qtail++] = m->touched[i];
+						}
+					}
+				}
+			} else if (m->parent[to] < 0) {
+				TouchNode(m, to);
+				m->parent[to] = v;
+				if (m->match[to] < 0) {
+					found = to;
+					break;
+				}
+				TouchNode(m, m->match[to]);
+				m->used[m->match[to]] = 1;
+				m->queue[qtail++] = m->match[to];
+			}
+		}
+	}
+
+	if (found >= 0) {
+		/* flip the matching along the path */
+		for (v = found; v >= 0; v = k) {
+			to = m->parent[v];
+			k = m->match[to];
+			m->match[v] = to;
+			m->match[to] = v;
+		}
+	}
+	for (i = 0; i < m->numtouched; i++) {
+		v = m->touched[i];
+		m->used[v] = 0;
+		m->parent[v] = -1;
+		m->base[v] = v;
+	}
+	return found;
+}
+
+/*
+ * Pair up as many polygons as possible: build the graph of
+ * which polygons can be merged with which, find a maximum
+ * matching in it, and merge the matched pairs.
+ * Returns the number of merges done, or -1 if we ran out
+ * of memory.
+ */
+static int
+MatchFaces( Object *obj, int numthreads )
+{
+	Matching m;
+	HalfEdge *edges;
+	int numedges;
+	int numarcs;
+	int *arcs;
+	Polygon P, Q;
+	Polygon MergedPoly;
+	int i, j, k;
+	int mergedsome;
+
+	mergedsome = -1;
+	memset(&m, 0, sizeof(m));
+	arcs = NULL;
+	edges = BuildEdgeTable(obj, &numedges);
+	if (!edges)
+		return -1;
+
+	/* collect the pairs that can be merged, each pair once */
+	if (CollectArcs(obj, edges, numedges, numthreads, &arcs, &numarcs) != 0)
+		goto done;
+	myfree(edges);
+	edges = NULL;
+
+	m.n = obj->numPolys;
+	m.adjstart = mycalloc( m.n + 1, sizeof(int) );
+	m.adj = mymalloc( (numarcs > 0 ? 2*numarcs : 1) * sizeof(int) );
+	m.match = mymalloc( m.n * sizeof(int) );
+	m.parent = mymalloc( m.n * sizeof(int) );
+	m.base = mymalloc( m.n * sizeof(int) );
+	m.mark = mycalloc( m.n, sizeof(int) );
+	m.blossom = mycalloc( m.n, sizeof(int) );
+	m.used = mycalloc( m.n, 1 );
+	m.queue = mymalloc( m.n * sizeof(int) );
+	m.touched = mymalloc( m.n * sizeof(int) );
+	if (!m.adjstart || !m.adj || !m.match || !m.parent || !m.base || !m.mark ||
+	    !m.blossom || !m.used || !m.queue || !m.touched)
+		goto done;
+
+	/* build the adjacency lists; arcs are in order, so each
+	 * list comes out sorted
+	 */
+	for (k = 0; k < numarcs; k++) {
+		m.adjstart[arcs[2*k]+1]++;
+		m.adjstart[arcs[2*k+1]+1]++;
+	}
+	for (i = 0; i < m.n; i++)
+		m.adjstart[i+1] += m.adjstart[i];
+	for (i = 0; i < m.n; i++)
+		m.queue[i] = m.adjstart[i];
+	for (k = 0; k < numarcs; k++) {
+		i = arcs[2*k]; j = arcs[2*k+1];
+		m.adj[m.queue[i]++] = j;
+		m.adj[m.queue[j]++] = i;
+	}
+
+	/* start with a greedy matching, then improve it until
+	 * there are no augmenting paths left
+	 */
+	for (i = 0; i < m.n; i++) {
+		m.match[i] = m.parent[i] = -1;
+		m.base[i] = i;
+	}
+	for (i = 0; i < m.n; i++) {
+		if (m.match[i] >= 0)
+			continue;
+		for (k = m.adjstart[i]; k < m.adjstart[i+1]; k++) {
+			if (m.match[m.adj[k]] < 0) {
+				m.match[i] = m.adj[k];
+				m.match[m.adj[k]] = i;
+				break;
+			}
+		}
+	}
+	for (i = 0; i < m.n; i++) {
+		if (m.match[i] < 0 && m.adjstart[i+1] > m.adjstart[i])
+			(void)FindAugmentingPath(&m, i);
+	}
+
+	mergedsome = 0;
+	for (i = 0; i < m.n; i++) {
+		j = m.match[i];
+		if (j <= i)
+			continue;
+		GetPolygon(obj, i, &P);
+		GetPolygon(obj, j, &Q);
+		if (CanMerge( obj, &P, &Q, &MergedPoly )) {
+			if (SetPolygon(obj, i, &MergedPoly) != 0) {
+				mergedsome = -1;
+				break;
 			}
+			obj->facetab[j].numverts = 0;
+			mergedsome++;
+		}
+	}
+
+done:
+	if (edges) myfree(edges);
+	if (arcs) myfree(arcs);
+	if (m.adjstart) myfree(m.adjstart);
+	if (m.adj) myfree(m.adj);
+	if (m.match) myfree(m.match);
+	if (m.parent) myfree(m.parent);
+	if (m.base) myfree(m.base);
+	if (m.mark) myfree(m.mark);
+	if (m.blossom) myfree(m.blossom);
+	if (m.used) myfree(m.used);
+	if (m.queue) myfree(m.queue);
+	if (m.touched) myfree(m.touched);
+	return mergedsome;
+}
+
+/*
+ * Merge faces together. Normally this just pairs up
+ * triangles. With "maxmerge" set, the pairing is done
+ * so that as many polygons as possible get paired, and then
+ * neighbouring polygons keep being merged for as long as
+ * the result still fits in MAXVERTICES and is convex.
+ */
+void
+MergeFaces( Object *obj, int numthreads )
+{
+	int i, n;
+
+	if (obj->numPolys < 2)
+		return;
+
+	if (obj->cv->maxmerge) {
+		/* keep track of the normals of the faces merged into each one */
+		obj->normrange = mymalloc( 2 * obj->numPolys * sizeof(FaceNormal) );
+		if (!obj->normrange) {
+			fprintf(stderr, "WARNING: unable to merge faces (out of memory)\n");
+			return;
 		}
-		if (verbose)
-			fprintf(stdout, "Object %s: merged %d triangles into %d polygons\n", obj->name,
-				oldnumPolys, obj->numPolys);
+		for (i = 0; i < obj->numPolys; i++)
+			obj->normrange[2*i] = obj->normrange[2*i+1] = obj->normtab[i];
+		n = MatchFaces(obj, numthreads);
+		while (n > 0)
+			n = GreedyMerge(obj, numthreads);
+		myfree(obj->normrange);
+		obj->normrange = 0;
+	} else {
+		n = GreedyMerge(obj, numthreads);
 	}
+	if (n < 0)
+		fprintf(stderr, "WARNING: unable to merge faces (out of memory)\n");
+
+	/* now compress the polygon list */
+	CompactFaces(obj);
 }
 
 /*
  * check for uncolored faces; if any exist, add a default material to
  * the material list
+ * Returns 0 on success, -1 if we ran out of memory
  */
-void
-CheckUncoloredFaces()
+int
+CheckUncoloredFaces( Converter *cv )
 {
 	int numuncolored = 0;
 	int i, j;
 	Material matrec;
 	Object *obj;
 
-	for (j = 0; j < numObjs; j++) {
-		obj = &objtab[j];
+	for (j = 0; j < cv->numObjs; j++) {
+		obj = OBJECT(cv, j);
 		for (i = 0; i < obj->numPolys; i++) {
-			if ( obj->polytab[i].material == -1 ) {
-				obj->polytab[i].material = numMaterials;	/* this will be the index of the default material */
+			if ( obj->facetab[i].material == -1 ) {
+				obj->facetab[i].material = cv->numMaterials;	/* this will be the index of the default material */
 				numuncolored++;
 			}
 		}
@@ -469,10 +2112,11 @@ CheckUncoloredFaces()
 		matrec.red = 128;
 		matrec.green = 128;
 		matrec.blue = 128;
-		matrec.name = strdup("Default Material");
+		matrec.name = "Default Material";
 		matrec.texmap = 0;
-		AddMaterial(&matrec);
+		return AddMaterial(cv, &matrec);
 	}
+	return 0;
 }
 
 /*
@@ -480,94 +2124,177 @@ CheckUncoloredFaces()
  * table, and return a pointer to it
  */
 Object *
-FindObject( char *name )
+FindObject( Converter *cv, char *name )
 {
 	int i;
 
-	for (i = 0; i < numObjs; i++) {
-		if (!strcmp(objtab[i].name, name)) {
-			return &objtab[i];
+	LockMutex(cv->objlock);
+	i = FindName(&cv->objnames, name);
+	UnlockMutex(cv->objlock);
+	if (i >= 0)
+		return OBJECT(cv, i);
+	return (Object *)0;
+}
+
+/*
+ * Add another page to the objects table. The directory of
+ * pages is allocated (at its full size) with the first page,
+ * and never changes after that, so that other threads can go
+ * on using it without taking objlock.
+ * Returns 0 on success, -1 if there's no room for more objects
+ */
+static int
+AddObjectPage( Converter *cv )
+{
+	Object *page;
+
+	if (cv->numpages >= OBJPAGE_MAX) {
+		fprintf(stderr, "ERROR: too many objects (the most is %d)\n", OBJPAGE_MAX * OBJPAGE_SIZE);
+		return -1;
+	}
+	if (!cv->objpages) {
+		cv->objpages = ArenaMalloc(cv->arena, OBJPAGE_MAX * sizeof(Object *));
+		if (!cv->objpages) {
+			fprintf(stderr, "ERROR: out of memory\n");
+			return -1;
 		}
 	}
-	return (Object *)0;
+	page = ArenaMalloc(cv->arena, OBJPAGE_SIZE * sizeof(Object));
+	if (!page) {
+		fprintf(stderr, "ERROR: out of memory\n");
+		return -1;
+	}
+	cv->objpages[cv->numpages++] = page;
+	cv->maxObjs += OBJPAGE_SIZE;
+	return 0;
 }
 
 /*
  * Create a new (blank) object,
  * and add it to the objects table.
+ * Objects never move once they have been created, and
+ * this can be called from several threads at once.
+ * Returns NULL if the object can't be created.
  */
 
 Object *
-CreateObject( char *name )
+CreateObject( Converter *cv, char *name )
 {
-	int i;
 	Object *curobj;
+	char *objname;
 
+	LockMutex(cv->objlock);
 	/* sanity check: is the object already in the table? */
-	for (i = 0; i < numObjs; i++) {
-		if (!strcmp(objtab[i].name, name)) {
-			fprintf(stderr, "FATAL ERROR: duplicate object name (%s)\n", name);
-			exit(1);
-		}
+	if (FindName(&cv->objnames, name) >= 0) {
+		UnlockMutex(cv->objlock);
+		fprintf(stderr, "ERROR: duplicate object name (%s)\n", name);
+		return (Object *)0;
+	}
+	objname = ArenaStrdup(cv->arena, name);
+	if (!objname) {
+		UnlockMutex(cv->objlock);
+		fprintf(stderr, "ERROR: out of memory\n");
+		return (Object *)0;
 	}
-	numObjs++;
-	/* expand the table */
-	objtab = myrealloc(objtab, numObjs*sizeof(Object));
-	if (!objtab) {
-		fprintf(stderr, "FATAL ERROR: out of memory\n");
-		exit(1);
+	if ((cv->numObjs >= cv->maxObjs && AddObjectPage(cv) != 0) ||
+	    AddName(cv->arena, &cv->objnames, objname) != 0) {
+		UnlockMutex(cv->objlock);
+		return (Object *)0;
 	}
-	curobj = &objtab[numObjs-1];
+	curobj = OBJECT(cv, cv->numObjs);
+	curobj->index = cv->numObjs;
+	cv->numObjs++;
+	UnlockMutex(cv->objlock);
 
-	curobj->name = strdup(name);
+	curobj->name = objname;
 	curobj->pivotx = curobj->pivoty = curobj->pivotz = 0.0;
 
-	curobj->verttab = 0;
+	memset(&curobj->verts, 0, sizeof(curobj->verts));
 	curobj->numVerts = curobj->maxVerts = 0;
 
-	curobj->polytab = 0;
+	curobj->facetab = 0;
+	curobj->normtab = 0;
+	curobj->normrange = 0;
 	curobj->numPolys = curobj->maxPolys = 0;
 
+	curobj->corntab = 0;
+	curobj->numCorners = curobj->maxCorners = 0;
+
 	curobj->children = curobj->siblings = curobj->parent = (Object *)0;
 	curobj->numframes = 0;
 	curobj->frames = (Matrix *)0;
 
 	curobj->inpptr = (void *)0;
+	curobj->geokey[0] = 0;
+	curobj->cached = 0;
+	curobj->cv = cv;
 
 	return curobj;
 }
 
+/*
+ * Throw away all the materials and objects in a converter, e.g.
+ * after part of a model has been loaded from a file that turned
+ * out to be bad. The object pages are kept, to be used again.
+ */
+
+void
+ClearModel( Converter *cv )
+{
+	int i;
+
+	for (i = 0; i < cv->numObjs; i++) {
+		FreeGeometry(OBJECT(cv, i));
+		ArenaFree(cv->arena, OBJECT(cv, i)->frames);
+	}
+	cv->numObjs = 0;
+	ArenaFree(cv->arena, cv->objnames.entries);
+	ArenaFree(cv->arena, cv->objnames.bucket);
+	memset(&cv->objnames, 0, sizeof(cv->objnames));
+
+	ArenaFree(cv->arena, cv->mattab);
+	cv->mattab = 0;
+	cv->numMaterials = cv->maxMaterials = 0;
+	ArenaFree(cv->arena, cv->matnames.entries);
+	ArenaFree(cv->arena, cv->matnames.bucket);
+	memset(&cv->matnames, 0, sizeof(cv->matnames));
+	cv->labelobject = 0;
+}
+
 
 /*
  * fix up the "sibling" and "parent" object lists
- * return a "root" object, i.e. one with no parent
+ * return a "root" object, i.e. one with no parent,
+ * or NULL if there isn't one
  */
 
 Object *
-FixObjectLists( void )
+FixObjectLists( Converter *cv )
 {
 	Object *rootobj;
+	Object *obj;
 	int i;
 
 	rootobj = (Object *)0;
 
-	for (i = 0; i < numObjs; i++) {
-		if (!objtab[i].parent) {
-			rootobj = &objtab[i];
+	for (i = 0; i < cv->numObjs; i++) {
+		if (!OBJECT(cv, i)->parent) {
+			rootobj = OBJECT(cv, i);
 			break;
 		}
 	}
 
 	if (!rootobj) {
 		fprintf(stderr, "ERROR: all objects in file have a parent??\n");
-		exit(1);
+		return (Object *)0;
 	}
 
 	i++;
-	for (; i < numObjs; i++) {
-		if (objtab[i].parent == 0) {
-			objtab[i].siblings = rootobj->siblings;
-			rootobj->siblings = &objtab[i];
+	for (; i < cv->numObjs; i++) {
+		obj = OBJECT(cv, i);
+		if (obj->parent == 0) {
+			obj->siblings = rootobj->siblings;
+			rootobj->siblings = obj;
 		}
 	}
 
@@ -2,9 +2,53 @@
  * internal format data structures, etc.
  */
 
-#ifndef EXTERN
-#define EXTERN extern
-#endif
+struct converter;
+
+/*
+ * the converter's version (the history is in 3dsconv.c)
+ */
+#define VERSION "1.5"
+
+/*
+ * the version of the conversion itself: saved conversions (see
+ * cache.c) are only reused by a converter with the same one, so
+ * this must be bumped by every change that makes the same input
+ * convert to different output (or a different model or cleaned up
+ * object), even if VERSION stays the same
+ */
+#define CACHE_VERSION "4"
+
+/*
+ * size of a cache key (32 hex digits, and the trailing 0)
+ */
+#define CACHEKEYSIZE	33
+
+/*
+ * memory that lives as long as a conversion does; see arena.c
+ */
+typedef struct arena Arena;
+
+/*
+ * a lock; see threads.c
+ */
+typedef struct mutex Mutex;
+
+/*
+ * a condition variable and a thread; see threads.c
+ */
+typedef struct cond Cond;
+typedef struct thread Thread;
+
+/*
+ * a file being written by a writer thread; see output.c
+ */
+typedef struct output Output;
+
+/*
+ * what we know about texture files, shared between conversions;
+ * see targa.c
+ */
+typedef struct texcache TexCache;
 
 typedef struct material {
 	char *name;			/* material name */
@@ -19,16 +63,55 @@ typedef struct vertex {
 	double	u,v;			/* texture coordinates for point */
 } Vertex;
 
+/*
+ * how an object stores its vertices: one array per field
+ * rather than an array of Vertex, so that the normal code
+ * can work on several vertices at once
+ */
+typedef struct vertexarrays {
+	double	*x, *y, *z;		/* coordinates */
+	double	*vx, *vy, *vz;		/* vertex normals */
+	double	*u, *v;			/* texture coordinates */
+} VertexArrays;
+
 #define MAXVERTICES 8
+
+/*
+ * a polygon in unpacked form; this is what the input readers
+ * build and what the face merging code works on, but objects
+ * store their faces more compactly (see Face below)
+ */
 typedef struct polygon {
 	int material;			/* material for this polygon */
 	double fx, fy, fz;		/* face normal */
+	double nlo[3], nhi[3];		/* lowest and highest fx, fy, fz of the faces merged into it */
 	int numverts;			/* number of vertices in the polygon */
 	int vert[MAXVERTICES];		/* vertex indicies, in clockwise order */
 	double u[MAXVERTICES];		/* texture coordinates (in same order as vertices) */
 	double v[MAXVERTICES];
 } Polygon;
 
+/*
+ * how an object stores its faces: each face has a run of
+ * numverts entries in the object's corner table, starting at
+ * "first"; the face normals are kept in a separate table, in
+ * the same order as the faces
+ */
+typedef struct face {
+	int material;			/* material for this face */
+	int first;			/* index of first corner in corner table */
+	int numverts;			/* number of vertices in the face (0 if deleted) */
+} Face;
+
+typedef struct corner {
+	int vert;			/* vertex index */
+	double u, v;			/* texture coordinates at this corner */
+} Corner;
+
+typedef struct facenormal {
+	double fx, fy, fz;
+} FaceNormal;
+
 
 
 /*
@@ -43,15 +126,22 @@ typedef struct matrix {
 
 typedef struct object {
 	char *name;			/* name of this mesh */
+	int index;			/* where it is in the objects table */
 	double pivotx, pivoty, pivotz;	/* origin for rotations */
 
-	Vertex *verttab;		/* vertex table */
+	VertexArrays verts;		/* vertex table */
 	int numVerts;			/* number of vertices currently in table */
 	int maxVerts;			/* current size of vertex table */
 
-	Polygon *polytab;		/* face table for this object */
+	Face *facetab;			/* face table for this object */
+	FaceNormal *normtab;		/* face normals, parallel to facetab */
+	FaceNormal *normrange;		/* while merging with -maxmerge: nlo and nhi of each face */
 	int numPolys;			/* number of faces currently in table */
-	int maxPolys;			/* current size of face table */
+	int maxPolys;			/* current size of face (and normal) table */
+
+	Corner *corntab;		/* face corners, in clockwise order */
+	int numCorners;			/* number of corners currently in table */
+	int maxCorners;			/* current size of corner table */
 
 	/* hierarchy info */
 	struct object *parent;		/* object at higher level */
@@ -64,14 +154,146 @@ typedef struct object {
 
 	/* private data for input functions */
 	void	*inpptr;		/* used by e.g. 3dsfile.c, lwfile.c */
+
+	/* saved geometry (see cache.c) */
+	char	geokey[CACHEKEYSIZE];	/* cache key for the finished geometry, or "" */
+	int	cached;			/* 1 if the geometry came from the cache, finished */
+
+	struct converter *cv;		/* conversion this object belongs to */
 } Object;
 
 
-EXTERN	Material *mattab;		/* material table */
-EXTERN	int numMaterials;		/* number of materials currently in table */
-EXTERN	int maxMaterials;		/* current size of materials table */
+/*
+ * an input file, mapped (or read) into memory by map_file()
+ */
+typedef struct mappedfile {
+	unsigned char *data;		/* file contents; read only! */
+	long size;			/* size of the file in bytes */
+	int mapped;			/* 1 if data is a mapping, 0 if it was malloc'd */
+} MappedFile;
+
+
+/*
+ * buffered output for the writers; see emit.c
+ */
+typedef struct emitter {
+	Output	*out;			/* file being written, or 0 to keep it in buf */
+	char	*buf;			/* output not written to it yet */
+	size_t	len;			/* how much of buf is used */
+	size_t	size;			/* how big buf is */
+	int	err;			/* set if some output was lost */
+
+	/* the list being written by EmitItem(), if any */
+	const char *head;		/* what each line of it starts with */
+	const char *end;		/* what each line of it ends with */
+	int	items;			/* items on the current line so far */
+	int	maxitems;		/* most items to put on a line */
+} Emitter;
 
 
-EXTERN Object *objtab;			/* object table */
-EXTERN int numObjs;			/* number of objects currently in table */
+/*
+ * output formats
+ */
+#define FORMAT_JAG	0		/* old output format */
+#define	FORMAT_N3D	1		/* new output format */
+#define FORMAT_ANIM	2		/* new output format + animation info */
+#define FORMAT_C	3		/* C file output format, integer */
+#define FORMAT_CFLOAT	4		/* C file output format, floating point */
+#define FORMAT_BIN	5		/* binary new output format (see binout.c) */
+#define FORMAT_ABIN	6		/* binary new output format + animation info */
 
+/*
+ * maximum length of a label made by name2label(), including
+ * the trailing 0
+ */
+#define LABELSIZE	128
+
+/*
+ * a hash table of names, giving the index of each one in the
+ * table it names the entries of (see internal.c)
+ */
+typedef struct nameentry {
+	char	*name;
+	unsigned int hash;
+	int	next;			/* next entry in the same bucket, or -1 */
+} NameEntry;
+
+typedef struct nametable {
+	NameEntry *entries;		/* entry i names table entry i */
+	int	num, max;		/* entries in use, and room for */
+	int	*bucket;		/* first entry in each bucket, or -1 */
+	int	mask;			/* number of buckets - 1 */
+} NameTable;
+
+/*
+ * everything about one conversion: the options, and the data
+ * read from the input file. Nothing is kept anywhere else, so
+ * any number of conversions can be going on at once, as long
+ * as each has its own converter. InitConverter() fills in the
+ * default options; set any others, then call ConvertFile()
+ * and finally FreeConverter().
+ */
+typedef struct converter {
+	/* options */
+	char	*progname;		/* name to use in error messages */
+	char	*infilename;		/* name of the input file */
+	char	*outfilename;		/* name of the output file, or 0 for the default */
+	char	*defaultlabel;		/* label for the object data, or 0 for the default */
+	int	output_format;		/* one of the FORMAT_xxx values above */
+	int	merge_tris;		/* merge triangles into polygons if 1, don't if 0 */
+	int	maxmerge;		/* merge as many faces as possible, into polygons of up to MAXVERTICES */
+	int	verbose;		/* report lots of things about what we're doing if 1, be quiet if 0 */
+	int	usedataseg;		/* whether to use the data segment (1) or text segment (0) */
+	int	outputheader;		/* whether to output .include commands */
+	int	clabels;		/* output C style labels (i.e. with underbars) if 1, -1 for the default */
+	int	multiobject;		/* output a multiple object header (1) or just 1 object (0) */
+	int	animflag;		/* include animation data (1) or not (0) */
+	int	compact;		/* pack the face and vertex lists, without comments (1) or not (0) */
+	int	numthreads;		/* number of worker threads to use */
+	double	uscale;			/* user specified scale factor */
+	double	pointdelta;		/* if points are less than pointdelta apart, they are merged */
+	double	facedelta;		/* if face normals are less than this much apart, they can be merged */
+	TexCache *texcache;		/* texture info shared with other conversions, or 0 */
+	char	*cachedir;		/* directory to save conversions in for reuse (-cache), or 0 */
+	char	*modelname;		/* file to save the finished model in (-model), or 0 */
+
+	/* the model */
+	Material *mattab;		/* material table */
+	int	numMaterials;		/* number of materials currently in table */
+	int	maxMaterials;		/* current size of materials table */
+	NameTable matnames;		/* index of materials by name */
+
+	Object	**objpages;		/* object table, in pages of OBJPAGE_SIZE objects */
+	int	numpages;		/* number of pages allocated so far */
+	int	numObjs;		/* number of objects currently in table */
+	int	maxObjs;		/* room in the pages allocated so far */
+	NameTable objnames;		/* index of objects by name */
+	Mutex	*objlock;		/* held while objects are created or looked up */
+	int	labelobject;		/* object 0 is named after the label, not the input */
+
+	/* conversion state */
+	char	*filepath;		/* path where the input file is found */
+	Arena	*arena;			/* all of the above is allocated from here */
+	int	wrotemats;		/* set once the materials (or texture list) have been output */
+	int	tboxnum;		/* number of texture boxes output so far */
+	char	cachekey[CACHEKEYSIZE];	/* cache key for the input and options, or "" */
+	char	modelkey[CACHEKEYSIZE];	/* cache key for the model (see model.c), or "" */
+	char	**texdeps;		/* textures looked for, for the cache */
+	int	numtexdeps, maxtexdeps;
+} Converter;
+
+/*
+ * Objects are kept in pages that never move, so a pointer to an
+ * object stays good while more objects are being created (even by
+ * other threads); an object's number in the table works as a handle
+ * for it too. The directory of pages is allocated once, at its full
+ * size of OBJPAGE_MAX pages, so it never moves either: a thread that
+ * got an object's number from CreateObject() or FindObject() (which
+ * take objlock) can use OBJECT() on it without locking. Reading
+ * numObjs without objlock is only safe once no other thread can be
+ * creating objects, e.g. between ParallelFor() calls.
+ */
+#define OBJPAGE_SHIFT	6
+#define OBJPAGE_SIZE	(1 << OBJPAGE_SHIFT)
+#define OBJPAGE_MAX	4096
+#define OBJECT(cv, i)	(&(cv)->objpages[(i) >> OBJPAGE_SHIFT][(i) & (OBJPAGE_SIZE-1)])
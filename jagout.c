@@ -15,16 +15,18 @@ mat2intcry( Material *mat )
 }
 
 static void
-writeheader(FILE *f, Object *obj)
+writeheader(Converter *cv, Emitter *e, Object *obj)
 {
-	char *label = name2label(obj->name);
+	char label[LABELSIZE];
 
-	fprintf(f, ".%s_data:\n", label);
-	fprintf(f, "\tdc.w\t%d,%d\t\t;Number of points, Number of faces\n",
+	name2label(cv, obj->name, label);
+
+	EmitPrintf(e, ".%s_data:\n", label);
+	EmitPrintf(e, "\tdc.w\t%d,%d\t\t;Number of points, Number of faces\n",
 		obj->numVerts, obj->numPolys);
-	fprintf(f, "\tdc.l\t.vertlist%s\n", label);
-	fprintf(f, "\tdc.l\t.texlist\n");
-	fprintf(f, "\tdc.l\t.tboxlist%s\n", label);
+	EmitPrintf(e, "\tdc.l\t.vertlist%s\n", label);
+	EmitStr(e, "\tdc.l\t.texlist\n");
+	EmitPrintf(e, "\tdc.l\t.tboxlist%s\n", label);
 }
 
 /* convert a float to a signed integer */
@@ -36,129 +38,254 @@ writeheader(FILE *f, Object *obj)
 /* convert a float to a 0.8 fixed point number */
 #define TOBYTE(x) ((int)((x)*255.9))
 
-static int tboxnum;		/* global variable; keeps track of number of tboxes emitted */
+/* most values on one line with -compact */
+#define ITEMSPERLINE	16
 
+/*
+ * the face list with -compact: the same data, without the comments
+ */
 static void
-writefaces(FILE *f, Object *obj)
+packfaces(Converter *cv, Emitter *e, Object *obj)
 {
 	int i, j;
-	Polygon *p;
+	Face *p;
 	int boxnum;
 
-	boxnum = tboxnum;
-	fprintf(f, ".facelist%s:\n", name2label(obj->name));
-	p = obj->polytab;
+	boxnum = cv->tboxnum;
+	p = obj->facetab;
+	EmitListStart(e, "\tdc.w\t", "\n", ITEMSPERLINE);
+	for (i = 0; i < obj->numPolys; i++,p++) {
+		EmitItem(e);
+		if (cv->mattab[p->material].texmap) {
+			EmitChar(e, '$');
+			EmitHex(e, p->material, 4);
+			EmitItem(e);
+			EmitChar(e, '$');
+			EmitHex(e, boxnum, 4);
+			boxnum++;
+		} else {
+			EmitStr(e, "$FFFF");
+			EmitItem(e);
+			EmitStr(e, "$0000");
+		}
+		EmitItem(e);
+		EmitInt(e, p->numverts);
+		EmitItem(e);
+		EmitChar(e, '$');
+		EmitHex(e, mat2intcry(&cv->mattab[p->material]), 4);
+		for (j = 0; j < p->numverts; j++) {
+			EmitItem(e);
+			EmitInt(e, obj->corntab[p->first + j].vert);
+			EmitStr(e, "*8");
+		}
+	}
+	EmitListEnd(e);
+}
+
+static void
+writefaces(Converter *cv, Emitter *e, Object *obj)
+{
+	char label[LABELSIZE];
+	int i, j;
+	Face *p;
+	int boxnum;
+
+	boxnum = cv->tboxnum;
+	EmitPrintf(e, ".facelist%s:\n", name2label(cv, obj->name, label));
+	if (cv->compact) {
+		packfaces(cv, e, obj);
+		return;
+	}
+	p = obj->facetab;
 
 	for (i = 0; i < obj->numPolys; i++,p++) {
-		fprintf(f, ";* Face %d\n", i);
-		if (mattab[p->material].texmap) {
-			fprintf(f, "\tdc.w\t$%04x,$%04x\t;* texture mapped\n", p->material, boxnum);
+		EmitStr(e, ";* Face ");
+		EmitInt(e, i);
+		if (cv->mattab[p->material].texmap) {
+			EmitStr(e, "\n\tdc.w\t$");
+			EmitHex(e, p->material, 4);
+			EmitStr(e, ",$");
+			EmitHex(e, boxnum, 4);
+			EmitStr(e, "\t;* texture mapped\n");
 			boxnum++;
 		} else {
-			fprintf(f, "\tdc.w\t$FFFF,$0000\t;* Gouraud shaded\n");
+			EmitStr(e, "\n\tdc.w\t$FFFF,$0000\t;* Gouraud shaded\n");
 		}
-		fprintf(f, "\tdc.w\t%d\t\t; number of points\n", p->numverts);
-		fprintf(f, "\tdc.w\t$%04x\t\t; material %s\n", mat2intcry(&mattab[p->material]), mattab[p->material].name);
+		EmitStr(e, "\tdc.w\t");
+		EmitInt(e, p->numverts);
+		EmitStr(e, "\t\t; number of points\n\tdc.w\t$");
+		EmitHex(e, mat2intcry(&cv->mattab[p->material]), 4);
+		EmitStr(e, "\t\t; material ");
+		EmitStr(e, cv->mattab[p->material].name);
+		EmitChar(e, '\n');
 		for (j = 0; j < p->numverts; j++) {
-			fprintf(f, "\tdc.w\t%d * 8\n", p->vert[j]);
+			EmitStr(e, "\tdc.w\t");
+			EmitInt(e, obj->corntab[p->first + j].vert);
+			EmitStr(e, " * 8\n");
 		}
-		fprintf(f, "\n");
+		EmitChar(e, '\n');
 	}
 }
 
+/*
+ * the vertex list with -compact
+ */
 static void
-writeverts(FILE *f, Object *obj)
+packverts(Emitter *e, Object *obj)
 {
 	int i;
 
-	fprintf(f, "\t.long\n");
-	fprintf(f, ".vertlist%s:\n", name2label(obj->name));
+	EmitListStart(e, "\tdc.w\t", "\n", ITEMSPERLINE);
 	for (i = 0; i < obj->numVerts; i++) {
-		fprintf(f, ";* Vertex %d\n", i);
-		fprintf(f, "\tdc.w\t%d,%d,%d\t; coordinates\n",
-			TOINT(obj->verttab[i].x), TOINT(obj->verttab[i].y), TOINT(obj->verttab[i].z) );
-		fprintf(f, "\tdc.w\t$%04x,$%04x,$%04x\t; vertex normal\n\n",
-			TOFIXED(obj->verttab[i].vx), TOFIXED(obj->verttab[i].vy), TOFIXED(obj->verttab[i].vz) );
+		EmitItem(e);
+		EmitInt(e, TOINT(obj->verts.x[i]));
+		EmitItem(e);
+		EmitInt(e, TOINT(obj->verts.y[i]));
+		EmitItem(e);
+		EmitInt(e, TOINT(obj->verts.z[i]));
+		EmitItem(e);
+		EmitChar(e, '$');
+		EmitHex(e, TOFIXED(obj->verts.vx[i]), 4);
+		EmitItem(e);
+		EmitChar(e, '$');
+		EmitHex(e, TOFIXED(obj->verts.vy[i]), 4);
+		EmitItem(e);
+		EmitChar(e, '$');
+		EmitHex(e, TOFIXED(obj->verts.vz[i]), 4);
 	}
+	EmitListEnd(e);
 }
 
-static int wrotetexlist = 0;
+static void
+writeverts(Converter *cv, Emitter *e, Object *obj)
+{
+	char label[LABELSIZE];
+	int i;
+
+	EmitStr(e, "\t.long\n");
+	EmitPrintf(e, ".vertlist%s:\n", name2label(cv, obj->name, label));
+	if (cv->compact) {
+		packverts(e, obj);
+		return;
+	}
+	for (i = 0; i < obj->numVerts; i++) {
+		EmitStr(e, ";* Vertex ");
+		EmitInt(e, i);
+		EmitStr(e, "\n\tdc.w\t");
+		EmitInt(e, TOINT(obj->verts.x[i]));
+		EmitChar(e, ',');
+		EmitInt(e, TOINT(obj->verts.y[i]));
+		EmitChar(e, ',');
+		EmitInt(e, TOINT(obj->verts.z[i]));
+		EmitStr(e, "\t; coordinates\n\tdc.w\t$");
+		EmitHex(e, TOFIXED(obj->verts.vx[i]), 4);
+		EmitStr(e, ",$");
+		EmitHex(e, TOFIXED(obj->verts.vy[i]), 4);
+		EmitStr(e, ",$");
+		EmitHex(e, TOFIXED(obj->verts.vz[i]), 4);
+		EmitStr(e, "\t; vertex normal\n\n");
+	}
+}
 
 static void
-writetexlist(FILE *f, Object *obj)
+writetexlist(Converter *cv, Emitter *e, Object *obj)
 {
+	char label[LABELSIZE];
 	int i;
 
-	if (wrotetexlist)
+	if (cv->wrotemats)
 		return;
-	wrotetexlist = 1;
+	cv->wrotemats = 1;
 
-	for (i = 0; i < numMaterials; i++) {
-		if (mattab[i].texmap) {
-			fprintf(f, "\t.extern\t%s\n", name2label(mattab[i].texmap));
+	for (i = 0; i < cv->numMaterials; i++) {
+		if (cv->mattab[i].texmap) {
+			EmitPrintf(e, "\t.extern\t%s\n", name2label(cv, cv->mattab[i].texmap, label));
 		}
 	}
 
-	fprintf(f, ".texlist:\n");
-	for (i = 0; i < numMaterials; i++) {
-		fprintf(f, "\n; Material %d: %s\n", i, mattab[i].name);
-		if (mattab[i].texmap) {
-			fprintf(f, "\tdc.l\t%s\t; texture\n", name2label(mattab[i].texmap));
-			fprintf(f, "\tdc.l\t(PITCH1|PIXEL16|WID%d|XADDINC)\n", mattab[i].twidth);
+	EmitStr(e, ".texlist:\n");
+	for (i = 0; i < cv->numMaterials; i++) {
+		EmitPrintf(e, "\n; Material %d: %s\n", i, cv->mattab[i].name);
+		if (cv->mattab[i].texmap) {
+			EmitPrintf(e, "\tdc.l\t%s\t; texture\n", name2label(cv, cv->mattab[i].texmap, label));
+			EmitPrintf(e, "\tdc.l\t(PITCH1|PIXEL16|WID%d|XADDINC)\n", cv->mattab[i].twidth);
 		} else {
-			fprintf(f, "\tdc.l\t0\t\t; no texture\n");
-			fprintf(f, "\tdc.l\t0\n");
+			EmitStr(e, "\tdc.l\t0\t\t; no texture\n");
+			EmitStr(e, "\tdc.l\t0\n");
 		}
 	}
 }
 
 static void
-writetboxlist(FILE *f, Object *obj)
+writetboxlist(Converter *cv, Emitter *e, Object *obj)
 {
+	char label[LABELSIZE];
 	int i, j;
 	int boxnum;			/* temporary copy of boxnum */
-	Polygon *P;
+	Face *P;
+	Corner *C;
 	double twidth, theight;
 
-	fprintf(f, ".tboxlist%s:\n", name2label(obj->name));
+	EmitPrintf(e, ".tboxlist%s:\n", name2label(cv, obj->name, label));
 
-	boxnum = tboxnum;
+	boxnum = cv->tboxnum;
+	if (cv->compact)
+		EmitListStart(e, "\tdc.l\t", "\n", ITEMSPERLINE);
 	for (i = 0; i < obj->numPolys; i++) {
-		P = &obj->polytab[i];
-		if ( mattab[P->material].texmap ) {
-			fprintf(f, "\tdc.l\t.pts%d\n", boxnum);
+		P = &obj->facetab[i];
+		if ( cv->mattab[P->material].texmap ) {
+			if (cv->compact) {
+				EmitItem(e);
+				EmitStr(e, ".pts");
+			} else {
+				EmitStr(e, "\tdc.l\t.pts");
+			}
+			EmitInt(e, boxnum);
+			if (!cv->compact)
+				EmitChar(e, '\n');
 			boxnum++;
 		}
 	}
+	if (cv->compact)
+		EmitListEnd(e);
 
-	boxnum = tboxnum;
+	boxnum = cv->tboxnum;
 	for (i = 0; i < obj->numPolys; i++) {
-		P = &obj->polytab[i];
-		if ( mattab[P->material].texmap ) {
-			twidth = (double) mattab[P->material].twidth - 1;
-			theight = (double) mattab[P->material].theight - 1;
+		P = &obj->facetab[i];
+		if ( cv->mattab[P->material].texmap ) {
+			twidth = (double) cv->mattab[P->material].twidth - 1;
+			theight = (double) cv->mattab[P->material].theight - 1;
 
-			fprintf(f, ".pts%d:\tdc.w\t", boxnum);
+			C = &obj->corntab[P->first];
+			EmitStr(e, ".pts");
+			EmitInt(e, boxnum);
+			EmitStr(e, ":\tdc.w\t");
 			for (j = 0; j < P->numverts-1; j++) {
-				fprintf(f, "%d, %d, ", TOINT(P->u[j]*twidth), TOINT(P->v[j]*theight));
+				EmitInt(e, TOINT(C[j].u*twidth));
+				EmitStr(e, ", ");
+				EmitInt(e, TOINT(C[j].v*theight));
+				EmitStr(e, ", ");
 			}
 			/* j = P->numverts-1 here */
-			fprintf(f, "%d, %d\n", TOINT(P->u[j]*twidth), TOINT(P->v[j]*theight));
+			EmitInt(e, TOINT(C[j].u*twidth));
+			EmitStr(e, ", ");
+			EmitInt(e, TOINT(C[j].v*theight));
+			EmitChar(e, '\n');
 			boxnum++;
 		}
 	}
 
-	tboxnum = boxnum;
+	cv->tboxnum = boxnum;
 }
 
 int
-JAGwritefile(FILE *outf, Object *obj)
+JAGwritefile(Converter *cv, Emitter *e, Object *obj)
 {
 
-	writeheader(outf, obj);
-	writefaces(outf, obj);
-	writeverts(outf, obj);
-	writetexlist(outf, obj);
-	writetboxlist(outf, obj);
+	writeheader(cv, e, obj);
+	writefaces(cv, e, obj);
+	writeverts(cv, e, obj);
+	writetexlist(cv, e, obj);
+	writetboxlist(cv, e, obj);
 	return 0;
 }
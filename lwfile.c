@@ -7,44 +7,22 @@
 #include <ctype.h>
 #include <stdint.h>
 
-#ifdef __DUMB_MSDOS__
-#include <alloc.h>
-#define mymalloc farmalloc
-#define myfree farfree
-#else
-#define mymalloc malloc
-#define myfree free
-#endif
-
 #include "internal.h"
 #include "proto.h"
 
-/* External variables */
-extern double	uscale;			/* user specified scale factor */
-extern char	*progname;		/* name of this program */
-extern char	*infilename;		/* input file name */
-extern int	verbose;		/* -v flag specified? */
-extern int	multiobject;		/* output multiple objects? */
-
-/* Global variables */
-static double	scale;				/* scale factor from 3DS file */
-
 typedef struct color {
 	double red, green, blue;
 } COLOR;
 
 /* local functions */
-static int buildsurfinfo(uint8_t *, uint8_t *);
+static int readlwdata(Converter *, char *, uint8_t *, long);
+static int buildsurfinfo(Converter *, uint8_t *, uint8_t *);
 static float getfloat(uint8_t *);
 static uint16_t getshort(void *);
 static uint32_t getlong(void *);
 static uint8_t *getchunk(uint8_t *, uint8_t *, char *, long *);
 static uint8_t *getsubchunk(uint8_t *, uint8_t *, char *, long *);
-static uint8_t *get3dpoint(uint8_t *, double *, double *, double *);
-
-#ifdef _WIN32
-#define strdup _strdup
-#endif
+static uint8_t *get3dpoint(uint8_t *, double, double *, double *, double *);
 
 /*
  *	read lightwave file into internal format
@@ -52,70 +30,80 @@ static uint8_t *get3dpoint(uint8_t *, double *, double *, double *);
  */
 
 int
-readlwfile(fname)
+readlwfile(cv, fname)
+	Converter *cv;	/* conversion to read it for */
 	char *fname;	/* ptr to file name */
 {
-	FILE *fp;
+	MappedFile mf;
+	int ret;
+
+	if (map_file(fname, &mf) != 0)
+		return -1;
+
+	ret = readlwdata(cv, fname, mf.data, mf.size);
+
+	/* everything we keep has been copied out of the file by now */
+	unmap_file(&mf);
+	return ret;
+}
+
+/*
+ *	convert the (read only) file image in fbuf
+ */
+static int
+readlwdata(cv, fname, fbuf, fbufsize)
+	Converter *cv;		/* conversion to read it for */
+	char *fname;		/* ptr to file name */
+	uint8_t *fbuf;		/* start of file image */
+	long fbufsize;		/* ...and its size */
+{
 	long length;
-	uint8_t *fbuf, *fbufend;	/* pointers to start and end of FORM chunk */
-	long fbufsize;
+	uint8_t *fbufend;	/* end of FORM chunk */
 	uint8_t *mdata, *mdataend;	/* pointers to start and end of other chunks */
 	int i, numpolys;
 	Vertex vert;
 	Polygon poly;
 	Object *curobj;
-
-	if ((fp = fopen(fname, "rb")) == NULL) {
-		perror(fname);
-		exit(-1);
-	}
-	fseek(fp, 0L, 2);	/* seek to end of file */
-	fbufsize = ftell(fp);
-	fseek(fp, 0L, 0);	/* rewind */
-
-	if ((fbuf = (uint8_t *) mymalloc(fbufsize)) == NULL) {	/* get buffer */
-		fprintf(stderr, "%s: insufficient memory for loading Lightwave file\n",
-			progname);
-		return -1;
-	}
-	if (fread(fbuf, fbufsize, 1, fp) != 1) {	/* read lightwave file */
-		perror(fname);
-		return -1;
-	}
-	fclose(fp);
+	double scale;		/* what to divide coordinates by */
 
 	/*
 	 * compute end of buffer 
 	 */
 	fbufend = fbuf + fbufsize;
 
+	if (fbufsize < 12) {
+		fprintf(stderr,"%s: %s is not a valid LWOB file.\n", cv->progname, fname);
+		return -1;
+	}
 	/*
 	 * check that it's a FORM LWOB IFF file
 	 */
 	if (strncmp((char *)fbuf, "FORM", 4) != 0) {
-		fprintf(stderr,"%s: %s is not a valid LWOB file.\n", progname, fname);
+		fprintf(stderr,"%s: %s is not a valid LWOB file.\n", cv->progname, fname);
 		return -1;
 	}
 	fbuf += 4;
 	length = getlong(fbuf);
 	fbuf += 4;
+	if (length > fbufend - fbuf)
+		length = fbufend - fbuf;	/* truncated file; use what's there */
 	fbufend = fbuf + length;
 
 	if (strncmp((char *)fbuf, "LWOB", 4) != 0) {
-		fprintf(stderr,"%s: %s is not a valid LWOB file.\n", progname, fname);
+		fprintf(stderr,"%s: %s is not a valid LWOB file.\n", cv->progname, fname);
 		return -1;
 	}
 	fbuf += 4;
 
 	scale = 1.0;
-	scale /= uscale;
+	scale /= cv->uscale;
 
 	/*
 	 * now process the various parts of the LWOB file
 	 */
 
 	/* first, get all the surface information */
-	if (buildsurfinfo(fbuf, fbufend) != 0) {
+	if (buildsurfinfo(cv, fbuf, fbufend) != 0) {
 		return -1;
 	}
 
@@ -127,16 +115,19 @@ readlwfile(fname)
 	}
 	mdataend = mdata + length;
 
-	if (verbose)
+	if (cv->verbose)
 		fprintf(stdout, "Getting data for %ld points\n", length/12);
 
-	curobj = CreateObject( "Default" );
+	curobj = CreateObject(cv, "Default");
+	if (!curobj || ReserveVertices(curobj, length/12) != 0)
+		return -1;
 
 	while (mdata < mdataend) {
 		vert.vx = vert.vy = vert.vz = 0;
 		vert.u = vert.v = 0;
-		mdata = get3dpoint(mdata, &vert.x, &vert.y, &vert.z);
-		AddVertex(curobj, &vert);
+		mdata = get3dpoint(mdata, scale, &vert.x, &vert.y, &vert.z);
+		if (AddVertex(curobj, &vert) < 0)
+			return -1;
 	}
 
 	/* finally, get the face records */
@@ -159,8 +150,8 @@ readlwfile(fname)
 				poly.vert[i] = getshort(mdata); mdata += 2;
 				poly.u[i] = poly.v[i] = 0.0;
 			}
-			CalcFaceNormal(curobj, &poly);
-			AddPolygon(curobj, &poly);
+			if (AddPolygon(curobj, &poly) < 0)
+				return -1;
 			numpolys++;
 		} else {
 			int basevert;
@@ -182,8 +173,8 @@ readlwfile(fname)
 				poly.u[0] = poly.v[0] = 0.0;
 				poly.u[1] = poly.v[1] = 0.0;
 				poly.u[2] = poly.v[2] = 0.0;
-				CalcFaceNormal(curobj, &poly);
-				AddPolygon(curobj, &poly);
+				if (AddPolygon(curobj, &poly) < 0)
+					return -1;
 				numpolys++;
 				rightside = leftside;
 			}
@@ -201,17 +192,18 @@ readlwfile(fname)
 		material -= 1;
 
 		/* make sure material number is in range */
-		if ( material >= numMaterials ) {
+		if ( material >= cv->numMaterials ) {
 			fprintf(stderr, "Warning: request for material %d, but only %d materials exit\n",
-				material+1, numMaterials);
+				material+1, cv->numMaterials);
 			material = 0;
 		}
 		/* change material for all polygons we added */
 		for (i = curpolynum; i < numpolys; i++) {
-			curobj->polytab[i].material = material;
+			curobj->facetab[i].material = material;
 		}
 	}
-	if (verbose) {
+	CalcFaceNormals(curobj, 0, cv->numthreads);
+	if (cv->verbose) {
 		fprintf(stdout, "%d polygons found\n", numpolys);
 	}
 	return 0;
@@ -221,7 +213,8 @@ readlwfile(fname)
  *	build the materials records
  */
 static int
-buildsurfinfo(fbuf, fbufend)
+buildsurfinfo(cv, fbuf, fbufend)
+	Converter *cv;	/* conversion to add the materials to */
 	uint8_t *fbuf;	/* start of form chunk */
 	uint8_t *fbufend;	/* ...and its end */
 {
@@ -230,6 +223,7 @@ buildsurfinfo(fbuf, fbufend)
 	long length;
 	Material mat;
 	Material *oldmat;
+	int matnum;
 
 	/* first, get the list of all materials */
 	mdata = getchunk(fbuf, fbufend, "SRFS", &length);
@@ -246,9 +240,14 @@ buildsurfinfo(fbuf, fbufend)
 
 	while (mdata < mdataend) {
 		length = 0;
-		mat.name = strdup((char *)mdata);
+		mat.name = ArenaStrdup(cv->arena, (char *)mdata);
+		if (!mat.name) {
+			fprintf(stderr, "ERROR: out of memory\n");
+			return -1;
+		}
 printf("Creating material %s\n", mat.name);
-		AddMaterial(&mat);
+		if (AddMaterial(cv, &mat) != 0)
+			return -1;
 		/* skip this material's name */
 		/* note that it is padded to be even length */
 		do {
@@ -265,9 +264,10 @@ printf("Creating material %s\n", mat.name);
 		if (!mdata) break;
 printf("Getting material data for %s\n", mdata);
 		fbuf = mdataend = mdata + length;
-		oldmat = &mattab[GetMaterial((char *)mdata)];
-		if (!oldmat)
+		matnum = GetMaterial(cv, (char *)mdata);
+		if (matnum < 0)
 			return -1;	/* material not found? (probably can't happen) */
+		oldmat = &cv->mattab[matnum];
 		/* skip over the name */
 		length = 0;
 		do {
@@ -290,17 +290,19 @@ printf("Getting material data for %s\n", mdata);
 
 /*
  *	get a 32 bit float from a long pointer (byte swapped)
+ *	the buffer is read only, so we swap into a local instead
  */
 static	float
 getfloat(p)
 	uint8_t *p;
 {
-	float *flp;
+	union {
+		uint32_t l;
+		float f;
+	} u;
 
-	*((uint32_t *)p) = getlong((char *)p);	/* looks weird, but we don't want */
-	flp = (float *) p;			/* the compiler to tranfer the     */
-						/* float to a uint32_t                 */
-	return *flp;
+	u.l = getlong(p);
+	return u.f;
 }
 
 
@@ -397,8 +399,9 @@ fprintf(stderr, "\tlooked at %04s\n", chunkid);
 
 
 static uint8_t
-*get3dpoint(p, x, y, z)
+*get3dpoint(p, scale, x, y, z)
 	uint8_t *p;		/* data stream pointer */
+	double scale;		/* what to divide the coordinates by */
 	double *x, *y, *z;
 {
 	*x =  (getfloat(p) / scale);
@@ -0,0 +1,170 @@
+/*
+ * Read-only input file mapping for 3DSCONV.
+ *
+ * The input readers only ever look at the file contents, so
+ * rather than copying the whole file into a malloc'd buffer
+ * we map it read-only and let the OS page it in as needed.
+ * Where mapping isn't available (or fails, e.g. on a pipe)
+ * we fall back to reading the file into memory.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <limits.h>
+
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#define USE_WIN32_MAPPING
+#elif !defined(__DUMB_MSDOS__) && !defined(__MSDOS__)
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#define USE_MMAP
+#endif
+
+#ifdef __DUMB_MSDOS__
+#include <alloc.h>
+#define mymalloc farmalloc
+#define myfree farfree
+#else
+#define mymalloc malloc
+#define myfree free
+#endif
+
+#include "internal.h"
+#include "proto.h"
+
+extern char	*progname;		/* name of this program */
+
+/*
+ * read the whole file into a malloc'd buffer; used when
+ * the file can't be mapped
+ */
+static int
+read_file(char *fname, MappedFile *mf)
+{
+	FILE *fp;
+	long size;
+
+	if ((fp = fopen(fname, "rb")) == NULL) {
+		perror(fname);
+		return -1;
+	}
+	fseek(fp, 0L, 2);	/* seek to end of file */
+	size = ftell(fp);
+	fseek(fp, 0L, 0);	/* rewind */
+
+	if ((mf->data = (unsigned char *) mymalloc(size > 0 ? size : 1)) == NULL) {
+		fprintf(stderr, "%s: insufficient memory for loading %s\n", progname, fname);
+		fclose(fp);
+		return -1;
+	}
+	if (size > 0 && fread(mf->data, size, 1, fp) != 1) {
+		perror(fname);
+		myfree(mf->data);
+		fclose(fp);
+		return -1;
+	}
+	fclose(fp);
+	mf->size = size;
+	mf->mapped = 0;
+	return 0;
+}
+
+/*
+ * map a file read-only into memory
+ * returns: 0 on success, otherwise -1 (after printing an error)
+ */
+int
+map_file(char *fname, MappedFile *mf)
+{
+#if defined(USE_MMAP)
+	int fd;
+	struct stat st;
+	void *addr;
+
+	if ((fd = open(fname, O_RDONLY)) < 0) {
+		perror(fname);
+		return -1;
+	}
+	if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+		/* not something we can map; read it the slow way */
+		close(fd);
+		return read_file(fname, mf);
+	}
+	if (st.st_size > LONG_MAX) {
+		fprintf(stderr, "%s: %s is too large\n", progname, fname);
+		close(fd);
+		return -1;
+	}
+	addr = mmap(0, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);		/* the mapping keeps its own reference */
+	if (addr == MAP_FAILED)
+		return read_file(fname, mf);
+#ifdef MADV_WILLNEED
+	/* we're going to touch all of it; start the reads now */
+	(void)madvise(addr, (size_t)st.st_size, MADV_WILLNEED);
+#endif
+	mf->data = addr;
+	mf->size = (long)st.st_size;
+	mf->mapped = 1;
+	return 0;
+#elif defined(USE_WIN32_MAPPING)
+	HANDLE fh, mh;
+	LARGE_INTEGER size;
+	void *addr;
+
+	fh = CreateFileA(fname, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+			 FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (fh == INVALID_HANDLE_VALUE) {
+		perror(fname);
+		return -1;
+	}
+	if (!GetFileSizeEx(fh, &size) || size.QuadPart == 0 || size.QuadPart > LONG_MAX) {
+		CloseHandle(fh);
+		return read_file(fname, mf);
+	}
+	mh = CreateFileMappingA(fh, NULL, PAGE_READONLY, 0, 0, NULL);
+	CloseHandle(fh);
+	if (!mh)
+		return read_file(fname, mf);
+	addr = MapViewOfFile(mh, FILE_MAP_READ, 0, 0, 0);
+	CloseHandle(mh);	/* the view keeps the mapping alive */
+	if (!addr)
+		return read_file(fname, mf);
+	mf->data = addr;
+	mf->size = (long)size.QuadPart;
+	mf->mapped = 1;
+	return 0;
+#else
+	return read_file(fname, mf);
+#endif
+}
+
+/*
+ * release a file obtained from map_file()
+ */
+void
+unmap_file(MappedFile *mf)
+{
+	if (!mf->data)
+		return;
+#if defined(USE_MMAP)
+	if (mf->mapped)
+		munmap(mf->data, (size_t)mf->size);
+	else
+		myfree(mf->data);
+#elif defined(USE_WIN32_MAPPING)
+	if (mf->mapped)
+		UnmapViewOfFile(mf->data);
+	else
+		myfree(mf->data);
+#else
+	myfree(mf->data);
+#endif
+	mf->data = 0;
+	mf->size = 0;
+}
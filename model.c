@@ -0,0 +1,660 @@
+/*
+ * Model files for 3DSCONV.
+ *
+ * A model file holds everything a conversion knows once it has
+ * read and cleaned up its input: the materials, the objects with
+ * their finished geometry, the object hierarchy and the animation
+ * frames. Any of the output formats can be written from it without
+ * reading or cleaning up the original file again, so a model that
+ * is needed in several formats only has to be processed once.
+ *
+ * The layout is fixed: every number is little endian, integers are
+ * 32 bits and coordinates are IEEE doubles, and everything is at a
+ * known offset, so a model can be used straight from a mapping of
+ * the file. It goes:
+ *   - a header (MODEL_HDRSIZE bytes), giving the number of
+ *     materials and objects and the offsets of the tables below;
+ *   - the material table, MODEL_MATSIZE bytes per material;
+ *   - the object table, MODEL_OBJSIZE bytes per object, each with
+ *     the offsets of its arrays;
+ *   - each object's arrays: its 8 vertex arrays (x, y, z, vx, vy,
+ *     vz, u, v), faces, face normals, corners and frames, each
+ *     starting on an 8 byte boundary;
+ *   - the string table: names, each with a trailing 0, which the
+ *     other tables refer to by offset.
+ * Objects refer to each other (parent, children, siblings) by
+ * their number in the object table, or -1 for none.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#ifdef __DUMB_MSDOS__
+#include <alloc.h>
+#define mymalloc farmalloc
+#define myfree farfree
+#else
+#define mymalloc malloc
+#define myfree free
+#endif
+
+#include "internal.h"
+#include "proto.h"
+
+#define MODEL_MAGIC	"3dsconv model"		/* start of a model file */
+#define MODEL_VERSION	1			/* layout of the rest of it */
+
+#define MODEL_HDRSIZE	64
+#define MODEL_MATSIZE	32
+#define MODEL_OBJSIZE	128
+#define MODEL_FACESIZE	12
+#define MODEL_NORMSIZE	24
+#define MODEL_CORNSIZE	24
+#define MODEL_FRAMESIZE	96
+
+/* header flags */
+#define MODEL_ANIM	1			/* it has animation data */
+#define MODEL_LABELOBJ	2			/* object 0 is named after the label */
+
+#define NOSTRING	0xffffffffu		/* a string offset for "none" */
+#define WRBUFSIZE	65536
+
+/*
+ * reading and writing little endian numbers
+ */
+static void
+put32(unsigned char *p, uint32_t x)
+{
+	p[0] = x; p[1] = x >> 8; p[2] = x >> 16; p[3] = x >> 24;
+}
+
+static void
+put64(unsigned char *p, uint64_t x)
+{
+	put32(p, (uint32_t)x);
+	put32(p+4, (uint32_t)(x >> 32));
+}
+
+static void
+putdouble(unsigned char *p, double d)
+{
+	uint64_t x;
+
+	memcpy(&x, &d, sizeof(x));
+	put64(p, x);
+}
+
+static uint32_t
+get32(const unsigned char *p)
+{
+	return p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint64_t
+get64(const unsigned char *p)
+{
+	return get32(p) | ((uint64_t)get32(p+4) << 32);
+}
+
+static double
+getdouble(const unsigned char *p)
+{
+	uint64_t x = get64(p);
+	double d;
+
+	memcpy(&d, &x, sizeof(d));
+	return d;
+}
+
+/* round up to a multiple of 8 */
+#define ALIGN8(n)	(((n) + 7) & ~(uint64_t)7)
+
+/*
+ * a model file being written
+ */
+typedef struct modelwriter {
+	FILE	*f;
+	unsigned char *buf;		/* output not written yet */
+	size_t	len;			/* how much of buf is used */
+	uint64_t pos;			/* offset in the file of buf[len] */
+	int	err;			/* set if a write failed */
+} ModelWriter;
+
+static void
+wrflush(ModelWriter *w)
+{
+	if (w->len > 0 && fwrite(w->buf, 1, w->len, w->f) != w->len)
+		w->err = 1;
+	w->len = 0;
+}
+
+/* make room for n (<= 256) bytes, and return where to put them */
+static unsigned char *
+wrspace(ModelWriter *w, size_t n)
+{
+	unsigned char *p;
+
+	if (w->len + n > WRBUFSIZE)
+		wrflush(w);
+	p = w->buf + w->len;
+	w->len += n;
+	w->pos += n;
+	return p;
+}
+
+static void
+wr32(ModelWriter *w, uint32_t x)
+{
+	put32(wrspace(w, 4), x);
+}
+
+static void
+wrdoubles(ModelWriter *w, const double *d, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+		putdouble(wrspace(w, 8), d[i]);
+}
+
+/* pad with zeroes up to file offset "pos" */
+static void
+wrpad(ModelWriter *w, uint64_t pos)
+{
+	while (w->pos < pos)
+		*wrspace(w, 1) = 0;
+}
+
+/*
+ * the offset in the string table of a name, adding it to the
+ * table if it's new; strings are only added in the order they
+ * are asked for, so the writer can work them out as it goes
+ */
+static uint32_t
+stroffset(uint32_t *strsize, char *s)
+{
+	uint32_t off;
+
+	if (!s)
+		return NOSTRING;
+	off = *strsize;
+	*strsize += strlen(s) + 1;
+	return off;
+}
+
+/* number of an object in the table, or -1 */
+static int32_t
+objnumber(Object *obj)
+{
+	return obj ? obj->index : -1;
+}
+
+/* where each of an object's arrays goes */
+typedef struct objlayout {
+	uint64_t verts, faces, norms, corners, frames, end;
+} ObjLayout;
+
+static void
+objlayout(Object *obj, uint64_t pos, ObjLayout *L)
+{
+	L->verts = pos;
+	pos += 8 * 8 * (uint64_t)obj->numVerts;
+	L->faces = pos;
+	pos = ALIGN8(pos + MODEL_FACESIZE * (uint64_t)obj->numPolys);
+	L->norms = pos;
+	pos += MODEL_NORMSIZE * (uint64_t)obj->numPolys;
+	L->corners = pos;
+	pos += MODEL_CORNSIZE * (uint64_t)obj->numCorners;
+	L->frames = pos;
+	pos += MODEL_FRAMESIZE * (uint64_t)(obj->frames ? obj->numframes : 0);
+	L->end = pos;
+}
+
+/*
+ * save the model in cv (read, cleaned up, and ready to write out)
+ * in file fname
+ * returns: 0 on success, otherwise -1 (after printing an error)
+ */
+int
+SaveModel( Converter *cv, char *fname )
+{
+	ModelWriter w;
+	ObjLayout L;
+	Object *obj;
+	Material *mat;
+	VertexArrays *V;
+	unsigned char *p;
+	uint64_t pos, matoff, objoff, stroff;
+	uint32_t strsize;
+	int i, j;
+
+	memset(&w, 0, sizeof(w));
+	w.buf = mymalloc(WRBUFSIZE);
+	if (!w.buf) {
+		fprintf(stderr, "%s: insufficient memory\n", cv->progname);
+		return -1;
+	}
+	w.f = fopen(fname, "wb");
+	if (!w.f) {
+		perror(fname);
+		myfree(w.buf);
+		return -1;
+	}
+
+	/* work out where everything goes */
+	matoff = MODEL_HDRSIZE;
+	objoff = matoff + MODEL_MATSIZE * (uint64_t)cv->numMaterials;
+	pos = objoff + MODEL_OBJSIZE * (uint64_t)cv->numObjs;
+	for (i = 0; i < cv->numObjs; i++) {
+		objlayout(OBJECT(cv, i), pos, &L);
+		pos = L.end;
+	}
+	stroff = pos;
+
+	/* the header */
+	p = wrspace(&w, MODEL_HDRSIZE);
+	memset(p, 0, MODEL_HDRSIZE);
+	strcpy((char *)p, MODEL_MAGIC);
+	put32(p+16, MODEL_VERSION);
+	put32(p+20, (cv->animflag ? MODEL_ANIM : 0) | (cv->labelobject ? MODEL_LABELOBJ : 0));
+	put32(p+24, cv->numMaterials);
+	put32(p+28, cv->numObjs);
+	put64(p+32, matoff);
+	put64(p+40, objoff);
+	put64(p+48, stroff);
+
+	/* the material and object tables; strings are numbered in the same order they're written */
+	strsize = 0;
+	for (i = 0; i < cv->numMaterials; i++) {
+		mat = &cv->mattab[i];
+		p = wrspace(&w, MODEL_MATSIZE);
+		memset(p, 0, MODEL_MATSIZE);
+		put32(p, stroffset(&strsize, mat->name));
+		put32(p+4, stroffset(&strsize, mat->texmap));
+		put32(p+8, mat->red);
+		put32(p+12, mat->green);
+		put32(p+16, mat->blue);
+		put32(p+20, mat->texmap ? mat->twidth : 0);	/* (only set for textures) */
+		put32(p+24, mat->texmap ? mat->theight : 0);
+	}
+	pos = objoff + MODEL_OBJSIZE * (uint64_t)cv->numObjs;
+	for (i = 0; i < cv->numObjs; i++) {
+		obj = OBJECT(cv, i);
+		objlayout(obj, pos, &L);
+		pos = L.end;
+		p = wrspace(&w, MODEL_OBJSIZE);
+		memset(p, 0, MODEL_OBJSIZE);
+		put32(p, stroffset(&strsize, obj->name));
+		put32(p+4, obj->numVerts);
+		put32(p+8, obj->numPolys);
+		put32(p+12, obj->numCorners);
+		put32(p+16, objnumber(obj->parent));
+		put32(p+20, objnumber(obj->children));
+		put32(p+24, objnumber(obj->siblings));
+		put32(p+28, obj->frames ? obj->numframes : 0);
+		putdouble(p+32, obj->pivotx);
+		putdouble(p+40, obj->pivoty);
+		putdouble(p+48, obj->pivotz);
+		put64(p+56, L.verts);
+		put64(p+64, L.faces);
+		put64(p+72, L.norms);
+		put64(p+80, L.corners);
+		put64(p+88, L.frames);
+	}
+
+	/* each object's arrays */
+	for (i = 0; i < cv->numObjs; i++) {
+		obj = OBJECT(cv, i);
+		V = &obj->verts;
+		wrdoubles(&w, V->x, obj->numVerts);
+		wrdoubles(&w, V->y, obj->numVerts);
+		wrdoubles(&w, V->z, obj->numVerts);
+		wrdoubles(&w, V->vx, obj->numVerts);
+		wrdoubles(&w, V->vy, obj->numVerts);
+		wrdoubles(&w, V->vz, obj->numVerts);
+		wrdoubles(&w, V->u, obj->numVerts);
+		wrdoubles(&w, V->v, obj->numVerts);
+		for (j = 0; j < obj->numPolys; j++) {
+			wr32(&w, obj->facetab[j].material);
+			wr32(&w, obj->facetab[j].first);
+			wr32(&w, obj->facetab[j].numverts);
+		}
+		wrpad(&w, ALIGN8(w.pos));
+		for (j = 0; j < obj->numPolys; j++) {
+			p = wrspace(&w, MODEL_NORMSIZE);
+			putdouble(p, obj->normtab[j].fx);
+			putdouble(p+8, obj->normtab[j].fy);
+			putdouble(p+16, obj->normtab[j].fz);
+		}
+		for (j = 0; j < obj->numCorners; j++) {
+			p = wrspace(&w, MODEL_CORNSIZE);
+			put32(p, obj->corntab[j].vert);
+			put32(p+4, 0);
+			putdouble(p+8, obj->corntab[j].u);
+			putdouble(p+16, obj->corntab[j].v);
+		}
+		for (j = 0; obj->frames && j < obj->numframes; j++) {
+			Matrix *M = &obj->frames[j];
+
+			p = wrspace(&w, MODEL_FRAMESIZE);
+			putdouble(p, M->xrite); putdouble(p+8, M->yrite); putdouble(p+16, M->zrite);
+			putdouble(p+24, M->xdown); putdouble(p+32, M->ydown); putdouble(p+40, M->zdown);
+			putdouble(p+48, M->xhead); putdouble(p+56, M->yhead); putdouble(p+64, M->zhead);
+			putdouble(p+72, M->xposn); putdouble(p+80, M->yposn); putdouble(p+88, M->zposn);
+		}
+	}
+
+	/* and the strings, in the order they were numbered */
+	for (i = 0; i < cv->numMaterials; i++) {
+		mat = &cv->mattab[i];
+		for (j = 0; j < 2; j++) {
+			char *s = j ? mat->texmap : mat->name;
+			size_t n;
+
+			if (!s)
+				continue;
+			for (n = strlen(s) + 1; n > 0; n--)
+				*wrspace(&w, 1) = *s++;
+		}
+	}
+	for (i = 0; i < cv->numObjs; i++) {
+		char *s = OBJECT(cv, i)->name;
+		size_t n;
+
+		for (n = strlen(s) + 1; n > 0; n--)
+			*wrspace(&w, 1) = *s++;
+	}
+	wrflush(&w);
+
+	/* now the size of the string table is known */
+	p = w.buf;
+	put64(p, strsize);
+	if (fseek(w.f, 56L, SEEK_SET) != 0 || fwrite(p, 1, 8, w.f) != 8)
+		w.err = 1;
+	if (ferror(w.f) | fclose(w.f))
+		w.err = 1;
+	myfree(w.buf);
+	if (w.err || w.pos != stroff + strsize) {
+		fprintf(stderr, "%s: error writing model file\n", fname);
+		remove(fname);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * is fname a model file (rather than some other kind of input)?
+ */
+int
+IsModelFile( char *fname )
+{
+	FILE *f;
+	char magic[16];
+	int ret;
+
+	f = fopen(fname, "rb");
+	if (!f)
+		return 0;
+	ret = (fread(magic, 1, sizeof(magic), f) == sizeof(magic) &&
+	       !memcmp(magic, MODEL_MAGIC, sizeof(MODEL_MAGIC)));
+	fclose(f);
+	return ret;
+}
+
+/*
+ * a model file being read
+ */
+typedef struct modelreader {
+	const unsigned char *data;	/* the file */
+	uint64_t size;			/* and its size */
+	const unsigned char *strings;	/* the string table */
+	uint64_t strsize;		/* and its size */
+} ModelReader;
+
+/* is there room for count items of size bytes each at offset off? */
+static int
+inrange(ModelReader *r, uint64_t off, uint64_t count, uint64_t size)
+{
+	return off <= r->size && count <= (r->size - off) / size;
+}
+
+/* a string from the string table, or 0 (and *ok cleared) if it's no good */
+static const char *
+getstring(ModelReader *r, uint32_t off, int *ok)
+{
+	if (off == NOSTRING)
+		return 0;
+	if (off >= r->strsize || !memchr(r->strings + off, 0, r->strsize - off)) {
+		*ok = 0;
+		return 0;
+	}
+	return (const char *)r->strings + off;
+}
+
+/* an object number, or 0 (and *ok cleared if it's no good) */
+static Object *
+getobject(Converter *cv, uint32_t n, int numobjs, int *ok)
+{
+	if ((int32_t)n == -1)
+		return (Object *)0;
+	if (n >= (uint32_t)numobjs) {
+		*ok = 0;
+		return (Object *)0;
+	}
+	return OBJECT(cv, n);
+}
+
+static void
+getdoubles(const unsigned char *p, double *d, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++, p += 8)
+		d[i] = getdouble(p);
+}
+
+/*
+ * read the arrays of object i
+ * returns: 0 on success, -1 if we ran out of memory, -2 if the
+ * file is no good
+ */
+static int
+readobject(ModelReader *r, Converter *cv, int i, int numobjs)
+{
+	const unsigned char *p = r->data + get64(r->data + 40) + MODEL_OBJSIZE * (uint64_t)i;
+	const unsigned char *q;
+	Object *obj = OBJECT(cv, i);
+	VertexArrays *V = &obj->verts;
+	int32_t numverts, numpolys, numcorners, numframes;
+	uint64_t verts, faces, norms, corners, frames;
+	double *arrays[8];
+	int j, ok;
+
+	numverts = get32(p+4);
+	numpolys = get32(p+8);
+	numcorners = get32(p+12);
+	numframes = get32(p+28);
+	verts = get64(p+56);
+	faces = get64(p+64);
+	norms = get64(p+72);
+	corners = get64(p+80);
+	frames = get64(p+88);
+	if (numverts < 0 || numpolys < 0 || numcorners < 0 || numframes < 0 ||
+	    !inrange(r, verts, numverts, 8 * 8) || !inrange(r, faces, numpolys, MODEL_FACESIZE) ||
+	    !inrange(r, norms, numpolys, MODEL_NORMSIZE) || !inrange(r, corners, numcorners, MODEL_CORNSIZE) ||
+	    !inrange(r, frames, numframes, MODEL_FRAMESIZE))
+		return -2;
+
+	ok = 1;
+	obj->parent = getobject(cv, get32(p+16), numobjs, &ok);
+	obj->children = getobject(cv, get32(p+20), numobjs, &ok);
+	obj->siblings = getobject(cv, get32(p+24), numobjs, &ok);
+	if (!ok)
+		return -2;
+	obj->pivotx = getdouble(p+32);
+	obj->pivoty = getdouble(p+40);
+	obj->pivotz = getdouble(p+48);
+
+	if (ReserveVertices(obj, numverts) != 0 || ReservePolygons(obj, numpolys, numcorners) != 0)
+		return -1;
+	arrays[0] = V->x; arrays[1] = V->y; arrays[2] = V->z;
+	arrays[3] = V->vx; arrays[4] = V->vy; arrays[5] = V->vz;
+	arrays[6] = V->u; arrays[7] = V->v;
+	for (j = 0; j < 8; j++)
+		getdoubles(r->data + verts + 8 * (uint64_t)numverts * j, arrays[j], numverts);
+	obj->numVerts = numverts;
+
+	for (j = 0, q = r->data + faces; j < numpolys; j++, q += MODEL_FACESIZE) {
+		obj->facetab[j].material = get32(q);
+		obj->facetab[j].first = get32(q+4);
+		obj->facetab[j].numverts = get32(q+8);
+	}
+	for (j = 0, q = r->data + norms; j < numpolys; j++, q += MODEL_NORMSIZE) {
+		obj->normtab[j].fx = getdouble(q);
+		obj->normtab[j].fy = getdouble(q+8);
+		obj->normtab[j].fz = getdouble(q+16);
+	}
+	obj->numPolys = numpolys;
+	for (j = 0, q = r->data + corners; j < numcorners; j++, q += MODEL_CORNSIZE) {
+		obj->corntab[j].vert = get32(q);
+		obj->corntab[j].u = getdouble(q+8);
+		obj->corntab[j].v = getdouble(q+16);
+	}
+	obj->numCorners = numcorners;
+	if (CheckGeometry(obj) != 0)
+		return -2;
+	for (j = 0; j < numpolys; j++) {
+		if (obj->facetab[j].material < 0 || obj->facetab[j].material >= cv->numMaterials)
+			return -2;
+	}
+
+	if (numframes > 0) {
+		obj->frames = ArenaMalloc(cv->arena, numframes * sizeof(Matrix));
+		if (!obj->frames)
+			return -1;
+		for (j = 0, q = r->data + frames; j < numframes; j++, q += MODEL_FRAMESIZE) {
+			Matrix *M = &obj->frames[j];
+
+			M->xrite = getdouble(q); M->yrite = getdouble(q+8); M->zrite = getdouble(q+16);
+			M->xdown = getdouble(q+24); M->ydown = getdouble(q+32); M->zdown = getdouble(q+40);
+			M->xhead = getdouble(q+48); M->yhead = getdouble(q+56); M->zhead = getdouble(q+64);
+			M->xposn = getdouble(q+72); M->yposn = getdouble(q+80); M->zposn = getdouble(q+88);
+		}
+	}
+	obj->numframes = numframes;
+	return 0;
+}
+
+/*
+ * load model file fname (made by SaveModel()) into cv, which
+ * mustn't have a model yet; if "quiet", a file that isn't a good
+ * model is just not loaded, rather than being an error. Either
+ * way, if it can't be loaded cv is left without a model.
+ * returns: 0 on success, otherwise -1 (after printing an error,
+ * unless quiet)
+ */
+int
+LoadModel( Converter *cv, char *fname, int quiet )
+{
+	MappedFile mf;
+	ModelReader r;
+	Material mat;
+	const unsigned char *p;
+	const char *name;
+	uint64_t matoff, objoff;
+	uint32_t flags;
+	int32_t nummats, numobjs;
+	int i, ok, ret;
+
+	if (quiet) {
+		/* map_file() complains if it can't be read */
+		FILE *f = fopen(fname, "rb");
+
+		if (!f)
+			return -1;
+		fclose(f);
+	}
+	if (map_file(fname, &mf) != 0)
+		return -1;
+	r.data = mf.data;
+	r.size = mf.size;
+
+	ret = -2;
+	if (r.size < MODEL_HDRSIZE || memcmp(r.data, MODEL_MAGIC, sizeof(MODEL_MAGIC)) != 0 ||
+	    get32(r.data+16) != MODEL_VERSION)
+		goto done;
+	flags = get32(r.data+20);
+	nummats = get32(r.data+24);
+	numobjs = get32(r.data+28);
+	matoff = get64(r.data+32);
+	objoff = get64(r.data+40);
+	r.strsize = get64(r.data+56);
+	if (nummats < 0 || numobjs < 0 || !inrange(&r, matoff, nummats, MODEL_MATSIZE) ||
+	    !inrange(&r, objoff, numobjs, MODEL_OBJSIZE) || !inrange(&r, get64(r.data+48), r.strsize, 1))
+		goto done;
+	r.strings = r.data + get64(r.data+48);
+	if (cv->animflag && !(flags & MODEL_ANIM)) {
+		if (!quiet)
+			fprintf(stderr, "%s: model has no animation data (it must be made with -f anim)\n", fname);
+		ret = -3;			/* (already reported) */
+		goto done;
+	}
+
+	/* the materials */
+	ret = -1;
+	for (i = 0, p = r.data + matoff; i < nummats; i++, p += MODEL_MATSIZE) {
+		ok = 1;
+		name = getstring(&r, get32(p), &ok);
+		mat.name = name ? ArenaStrdup(cv->arena, name) : 0;
+		name = getstring(&r, get32(p+4), &ok);
+		mat.texmap = name ? ArenaStrdup(cv->arena, name) : 0;
+		if (!ok || !mat.name) {
+			ret = ok ? -1 : -2;
+			goto done;
+		}
+		if (name && !mat.texmap)
+			goto done;
+		mat.red = get32(p+8);
+		mat.green = get32(p+12);
+		mat.blue = get32(p+16);
+		mat.twidth = get32(p+20);
+		mat.theight = get32(p+24);
+		if (AddMaterial(cv, &mat) != 0)
+			goto done;
+	}
+
+	/* create all the objects first, so that they can refer to each other */
+	for (i = 0, p = r.data + objoff; i < numobjs; i++, p += MODEL_OBJSIZE) {
+		ok = 1;
+		name = getstring(&r, get32(p), &ok);
+		if (!ok || !name) {
+			ret = -2;
+			goto done;
+		}
+		if (i == 0 && (flags & MODEL_LABELOBJ)) {
+			/* this depends on the options, not the input */
+			name = cv->clabels ? cv->defaultlabel + 1 : cv->defaultlabel;
+			cv->labelobject = 1;
+		}
+		if (!CreateObject(cv, (char *)name))
+			goto done;
+	}
+	for (i = 0; i < numobjs; i++) {
+		ret = readobject(&r, cv, i, numobjs);
+		if (ret != 0)
+			goto done;
+	}
+	ret = 0;
+
+done:
+	unmap_file(&mf);
+	if (ret != 0)
+		ClearModel(cv);
+	if (ret == -2 && !quiet)
+		fprintf(stderr, "%s: not a valid model file\n", fname);
+	else if (ret == -1 && !quiet)
+		fprintf(stderr, "%s: insufficient memory\n", fname);
+	return ret ? -1 : 0;
+}
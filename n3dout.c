@@ -6,8 +6,6 @@
 #include "proto.h"
 #include <stdint.h>
 
-extern int animflag;
-
 /*
  * function to convert RGB to CRY
  */
@@ -41,18 +39,20 @@ rgb2cry(int red, int green, int blue)
 }
 
 static void
-writeheader(FILE *f, Object *obj)
+writeheader(Converter *cv, Emitter *e, Object *obj)
 {
-	char *label = name2label(obj->name);
-
-	fprintf(f, ".%s_data:\n", label);
-	fprintf(f, "\tdc.w\t%d\t\t;Number of faces\n", obj->numPolys);
-	fprintf(f, "\tdc.w\t%d\t\t;Number of points\n", obj->numVerts);
-	fprintf(f, "\tdc.w\t%d\t\t;Number of materials\n", numMaterials);
-	fprintf(f, "\tdc.w\t0\t\t; reserved word\n");
-	fprintf(f, "\tdc.l\t.facelist%s\n", label);
-	fprintf(f, "\tdc.l\t.vertlist%s\n", label);
-	fprintf(f, "\tdc.l\t.matlist\n");
+	char label[LABELSIZE];
+
+	name2label(cv, obj->name, label);
+
+	EmitPrintf(e, ".%s_data:\n", label);
+	EmitPrintf(e, "\tdc.w\t%d\t\t;Number of faces\n", obj->numPolys);
+	EmitPrintf(e, "\tdc.w\t%d\t\t;Number of points\n", obj->numVerts);
+	EmitPrintf(e, "\tdc.w\t%d\t\t;Number of materials\n", cv->numMaterials);
+	EmitStr(e, "\tdc.w\t0\t\t; reserved word\n");
+	EmitPrintf(e, "\tdc.l\t.facelist%s\n", label);
+	EmitPrintf(e, "\tdc.l\t.vertlist%s\n", label);
+	EmitStr(e, "\tdc.l\t.matlist\n");
 }
 
 /* convert a float to a signed integer */
@@ -66,144 +66,269 @@ writeheader(FILE *f, Object *obj)
 
 /* default texture coordinates */
 static double
-default_u[] = { 0.0, 0.0, 1.0, 1.0 };
+default_u[MAXVERTICES] = { 0.0, 0.0, 1.0, 1.0, 0.0, 0.0, 1.0, 1.0 };
 
 static double
-default_v[] = { 0.0, 1.0, 0.0, 1.0 };
+default_v[MAXVERTICES] = { 0.0, 1.0, 0.0, 1.0, 0.0, 1.0, 0.0, 1.0 };
 
+/* most values on one line with -compact */
+#define ITEMSPERLINE	16
+
+/*
+ * the face list with -compact: the same data, without the comments
+ */
 static void
-writefaces(FILE *f, Object *obj)
+packfaces(Converter *cv, Emitter *e, Object *obj)
 {
 	int i, j;
 	double fd;
-	Polygon *p;
-	double *text_u, *text_v;
-	Vertex *verttab;
-
-	fprintf(f, "\t.phrase\n");
-	fprintf(f, ".facelist%s:\n", name2label(obj->name));
-	p = obj->polytab;
-	verttab = obj->verttab;
-
-	for (i = 0; i < obj->numPolys; i++,p++) {
-		fprintf(f, ";* Face %d\n", i);
-		fd = p->fx * verttab[p->vert[0]].x + p->fy * verttab[p->vert[0]].y + p->fz * verttab[p->vert[0]].z;
-		fprintf(f, "\tdc.w\t$%x,$%x,$%x,$%x\t; face normal\n",
-			TOFIXED(p->fx), TOFIXED(p->fy), TOFIXED(p->fz),
-			TOINT(-fd) & 0x0000ffff
-		);
-		fprintf(f, "\tdc.w\t%d\t\t; number of points\n", p->numverts);
-		fprintf(f, "\tdc.w\t%d\t\t; material %s\n", p->material, mattab[p->material].name);
+	Face *p;
+	Corner *c;
+	FaceNormal *n;
+	double text_u, text_v;
+	VertexArrays *V = &obj->verts;
+
+	p = obj->facetab;
+	n = obj->normtab;
+	EmitListStart(e, "\tdc.w\t", "\n", ITEMSPERLINE);
+	for (i = 0; i < obj->numPolys; i++,p++,n++) {
+		c = &obj->corntab[p->first];
+		fd = n->fx * V->x[c[0].vert] + n->fy * V->y[c[0].vert] + n->fz * V->z[c[0].vert];
+		EmitItem(e);
+		EmitChar(e, '$');
+		EmitHex(e, TOFIXED(n->fx), 1);
+		EmitItem(e);
+		EmitChar(e, '$');
+		EmitHex(e, TOFIXED(n->fy), 1);
+		EmitItem(e);
+		EmitChar(e, '$');
+		EmitHex(e, TOFIXED(n->fz), 1);
+		EmitItem(e);
+		EmitChar(e, '$');
+		EmitHex(e, TOINT(-fd) & 0x0000ffff, 1);
+		EmitItem(e);
+		EmitInt(e, p->numverts);
+		EmitItem(e);
+		EmitInt(e, p->material);
 		for (j = 0; j < p->numverts; j++) {
-			fprintf(f, "\tdc.w\t%d, ", p->vert[j]);
+			if (cv->mattab[p->material].texmap) {
+				text_u = c[j].u; text_v = c[j].v;
+			} else {
+				text_u = default_u[j]; text_v = default_v[j];
+			}
+			EmitItem(e);
+			EmitInt(e, c[j].vert);
+			EmitItem(e);
+			EmitChar(e, '$');
+			EmitHex(e, TOBYTE(text_u), 2);
+			EmitHex(e, TOBYTE(text_v), 2);
+		}
+	}
+	EmitListEnd(e);
+}
+
+static void
+writefaces(Converter *cv, Emitter *e, Object *obj)
+{
+	char label[LABELSIZE];
+	int i, j;
+	double fd;
+	Face *p;
+	Corner *c;
+	FaceNormal *n;
+	double text_u, text_v;
+	VertexArrays *V;
+
+	EmitStr(e, "\t.phrase\n");
+	EmitPrintf(e, ".facelist%s:\n", name2label(cv, obj->name, label));
+	if (cv->compact) {
+		packfaces(cv, e, obj);
+		return;
+	}
+	p = obj->facetab;
+	n = obj->normtab;
+	V = &obj->verts;
+
+	for (i = 0; i < obj->numPolys; i++,p++,n++) {
+		c = &obj->corntab[p->first];
+		EmitStr(e, ";* Face ");
+		EmitInt(e, i);
+		fd = n->fx * V->x[c[0].vert] + n->fy * V->y[c[0].vert] + n->fz * V->z[c[0].vert];
+		EmitStr(e, "\n\tdc.w\t$");
+		EmitHex(e, TOFIXED(n->fx), 1);
+		EmitStr(e, ",$");
+		EmitHex(e, TOFIXED(n->fy), 1);
+		EmitStr(e, ",$");
+		EmitHex(e, TOFIXED(n->fz), 1);
+		EmitStr(e, ",$");
+		EmitHex(e, TOINT(-fd) & 0x0000ffff, 1);
+		EmitStr(e, "\t; face normal\n\tdc.w\t");
+		EmitInt(e, p->numverts);
+		EmitStr(e, "\t\t; number of points\n\tdc.w\t");
+		EmitInt(e, p->material);
+		EmitStr(e, "\t\t; material ");
+		EmitStr(e, cv->mattab[p->material].name);
+		EmitChar(e, '\n');
+		for (j = 0; j < p->numverts; j++) {
+			EmitStr(e, "\tdc.w\t");
+			EmitInt(e, c[j].vert);
 			/* if texture coordinates are provided, use those */
-			if (mattab[p->material].texmap) {
-				text_u = p->u; text_v = p->v;
+			if (cv->mattab[p->material].texmap) {
+				text_u = c[j].u; text_v = c[j].v;
 			} else {
-				text_u = default_u; text_v = default_v;
+				text_u = default_u[j]; text_v = default_v[j];
 			}
-			fprintf(f, "$%02x%02x\t; Point index, texture coordinates\n", TOBYTE(text_u[j]), TOBYTE(text_v[j]));
+			EmitStr(e, ", $");
+			EmitHex(e, TOBYTE(text_u), 2);
+			EmitHex(e, TOBYTE(text_v), 2);
+			EmitStr(e, "\t; Point index, texture coordinates\n");
 		}
-		fprintf(f, "\n");
+		EmitChar(e, '\n');
 	}
 }
 
+/*
+ * the vertex list with -compact
+ */
 static void
-writeverts(FILE *f, Object *obj)
+packverts(Emitter *e, Object *obj)
 {
+	VertexArrays *V = &obj->verts;
 	int i;
-	Vertex *verttab = obj->verttab;
 
-	fprintf(f, "\t.long\n");
-	fprintf(f, ".vertlist%s:\n", name2label(obj->name));
+	EmitListStart(e, "\tdc.w\t", "\n", ITEMSPERLINE);
 	for (i = 0; i < obj->numVerts; i++) {
-		fprintf(f, ";* Vertex %d\n", i);
-		fprintf(f, "\tdc.w\t%d,%d,%d\t; coordinates\n",
-			TOINT(verttab[i].x), TOINT(verttab[i].y), TOINT(verttab[i].z) );
-		fprintf(f, "\tdc.w\t$%04x,$%04x,$%04x\t; vertex normal\n\n",
-			TOFIXED(verttab[i].vx), TOFIXED(verttab[i].vy), TOFIXED(verttab[i].vz) );
+		EmitItem(e);
+		EmitInt(e, TOINT(V->x[i]));
+		EmitItem(e);
+		EmitInt(e, TOINT(V->y[i]));
+		EmitItem(e);
+		EmitInt(e, TOINT(V->z[i]));
+		EmitItem(e);
+		EmitChar(e, '$');
+		EmitHex(e, TOFIXED(V->vx[i]), 4);
+		EmitItem(e);
+		EmitChar(e, '$');
+		EmitHex(e, TOFIXED(V->vy[i]), 4);
+		EmitItem(e);
+		EmitChar(e, '$');
+		EmitHex(e, TOFIXED(V->vz[i]), 4);
 	}
-	fprintf(f, "\n");
+	EmitListEnd(e);
 }
 
-/* flag: set to 1 when the materials are output for the first time */
-static int wrotemats;
+static void
+writeverts(Converter *cv, Emitter *e, Object *obj)
+{
+	char label[LABELSIZE];
+	int i;
+	VertexArrays *V = &obj->verts;
+
+	EmitStr(e, "\t.long\n");
+	EmitPrintf(e, ".vertlist%s:\n", name2label(cv, obj->name, label));
+	if (cv->compact) {
+		packverts(e, obj);
+		EmitStr(e, "\n");
+		return;
+	}
+	for (i = 0; i < obj->numVerts; i++) {
+		EmitStr(e, ";* Vertex ");
+		EmitInt(e, i);
+		EmitStr(e, "\n\tdc.w\t");
+		EmitInt(e, TOINT(V->x[i]));
+		EmitChar(e, ',');
+		EmitInt(e, TOINT(V->y[i]));
+		EmitChar(e, ',');
+		EmitInt(e, TOINT(V->z[i]));
+		EmitStr(e, "\t; coordinates\n\tdc.w\t$");
+		EmitHex(e, TOFIXED(V->vx[i]), 4);
+		EmitStr(e, ",$");
+		EmitHex(e, TOFIXED(V->vy[i]), 4);
+		EmitStr(e, ",$");
+		EmitHex(e, TOFIXED(V->vz[i]), 4);
+		EmitStr(e, "\t; vertex normal\n\n");
+	}
+	EmitStr(e, "\n");
+}
 
+/* flag: set to 1 when the materials are output for the first time */
 static void
-writemats(FILE *f, Object *obj)
+writemats(Converter *cv, Emitter *e, Object *obj)
 {
+	char label[LABELSIZE];
 	int i;
 
-	if (wrotemats != 0)
+	if (cv->wrotemats != 0)
 		return;
-	wrotemats++;
+	cv->wrotemats++;
 
-	for (i = 0; i < numMaterials; i++) {
-		if (mattab[i].texmap) {
-			fprintf(f, "\t.extern\t%s\n", name2label(mattab[i].texmap));
+	for (i = 0; i < cv->numMaterials; i++) {
+		if (cv->mattab[i].texmap) {
+			EmitPrintf(e, "\t.extern\t%s\n", name2label(cv, cv->mattab[i].texmap, label));
 		}
 	}
 
-	fprintf(f, "\t.phrase\n");
-	fprintf(f, ".matlist:\n");
-	for (i = 0; i < numMaterials; i++) {
-		fprintf(f, "\n; Material %d: %s\n", i, mattab[i].name);
-		fprintf(f, "\tdc.w\t$%04x, 0\n", rgb2cry( mattab[i].red, mattab[i].green, mattab[i].blue ) );
-		if (mattab[i].texmap) {
-			fprintf(f, "\tdc.l\t.%s_bitmap\t; texture\n", name2label(mattab[i].texmap));
+	EmitStr(e, "\t.phrase\n");
+	EmitStr(e, ".matlist:\n");
+	for (i = 0; i < cv->numMaterials; i++) {
+		EmitPrintf(e, "\n; Material %d: %s\n", i, cv->mattab[i].name);
+		EmitPrintf(e, "\tdc.w\t$%04x, 0\n", rgb2cry( cv->mattab[i].red, cv->mattab[i].green, cv->mattab[i].blue ) );
+		if (cv->mattab[i].texmap) {
+			EmitPrintf(e, "\tdc.l\t.%s_bitmap\t; texture\n", name2label(cv, cv->mattab[i].texmap, label));
 		} else {
-			fprintf(f, "\tdc.l\t0\t\t; no texture\n");
+			EmitStr(e, "\tdc.l\t0\t\t; no texture\n");
 		}
 	}
-	fprintf(f, "\n");
+	EmitStr(e, "\n");
 
 	/* now output bitmap definitions for the textures */
-	for (i = 0; i < numMaterials; i++) {
-		if (mattab[i].texmap) {
-			fprintf(f, ".%s_bitmap:\n", name2label(mattab[i].texmap));
-			fprintf(f, "\t.dc.w\t%d, %d\n", mattab[i].twidth, mattab[i].theight);
-			fprintf(f, "\t.dc.l\tPITCH1|PIXEL16|WID%d\n", mattab[i].twidth);
-			fprintf(f, "\t.dc.l\t%s\n", name2label(mattab[i].texmap));
+	for (i = 0; i < cv->numMaterials; i++) {
+		if (cv->mattab[i].texmap) {
+			EmitPrintf(e, ".%s_bitmap:\n", name2label(cv, cv->mattab[i].texmap, label));
+			EmitPrintf(e, "\t.dc.w\t%d, %d\n", cv->mattab[i].twidth, cv->mattab[i].theight);
+			EmitPrintf(e, "\t.dc.l\tPITCH1|PIXEL16|WID%d\n", cv->mattab[i].twidth);
+			EmitPrintf(e, "\t.dc.l\t%s\n", name2label(cv, cv->mattab[i].texmap, label));
 		}
 	}
-	fprintf(f, "\n");
+	EmitStr(e, "\n");
 }
 
 static void
-writeanims(FILE *f, Object *obj)
+writeanims(Converter *cv, Emitter *e, Object *obj)
 {
+	char label[LABELSIZE];
 	Matrix *M;
 	int i;
 	int32_t x, y, z;
 
-	fprintf(f, ".%s_anim:\n", name2label(obj->name));
-	fprintf(f, "\t.dc.w\t1, 0\t; frame animation\n");
-	fprintf(f, "\t.dc.w\t%d\t; number of frames\n", obj->numframes);
-	fprintf(f, "\t.dc.w\t$0002\t; frames per 300th of a second\n");
-	fprintf(f, "\t.dc.l\t0\t; current frame number\n");
+	EmitPrintf(e, ".%s_anim:\n", name2label(cv, obj->name, label));
+	EmitStr(e, "\t.dc.w\t1, 0\t; frame animation\n");
+	EmitPrintf(e, "\t.dc.w\t%d\t; number of frames\n", obj->numframes);
+	EmitStr(e, "\t.dc.w\t$0002\t; frames per 300th of a second\n");
+	EmitStr(e, "\t.dc.l\t0\t; current frame number\n");
 	for (i = 0; i < obj->numframes; i++) {
 		M = &obj->frames[i];
-		fprintf(f, "\t;* frame %d\n", i);
+		EmitPrintf(e, "\t;* frame %d\n", i);
 		x = TOFIXED(M->xrite); y = TOFIXED(M->yrite); z = TOFIXED(M->zrite);
-		fprintf(f, "\t.dc.w\t$%04x, $%04x, $%04x\n", x, y, z);
+		EmitPrintf(e, "\t.dc.w\t$%04x, $%04x, $%04x\n", x, y, z);
 		x = TOFIXED(M->xdown); y = TOFIXED(M->ydown); z = TOFIXED(M->zdown);
-		fprintf(f, "\t.dc.w\t$%04x, $%04x, $%04x\n", x, y, z);
+		EmitPrintf(e, "\t.dc.w\t$%04x, $%04x, $%04x\n", x, y, z);
 		x = TOFIXED(M->xhead); y = TOFIXED(M->yhead); z = TOFIXED(M->zhead);
-		fprintf(f, "\t.dc.w\t$%04x, $%04x, $%04x\n", x, y, z);
+		EmitPrintf(e, "\t.dc.w\t$%04x, $%04x, $%04x\n", x, y, z);
 		x = TOINT(M->xposn); y = TOINT(M->yposn); z = TOINT(M->zposn);
-		fprintf(f, "\t.dc.w\t$%04x, $%04x, $%04x\n",
+		EmitPrintf(e, "\t.dc.w\t$%04x, $%04x, $%04x\n",
 			x & 0x0000ffff, y & 0x0000ffff, z & 0x0000ffff);
 	}
 }
 
 int
-N3Dwritefile(FILE *outf, Object *obj)
+N3Dwritefile(Converter *cv, Emitter *e, Object *obj)
 {
-	writeheader(outf, obj);
-	writefaces(outf, obj);
-	writeverts(outf, obj);
-	writemats(outf, obj);
-	if (animflag)
-		writeanims(outf, obj);
+	writeheader(cv, e, obj);
+	writefaces(cv, e, obj);
+	writeverts(cv, e, obj);
+	writemats(cv, e, obj);
+	if (cv->animflag)
+		writeanims(cv, e, obj);
 	return 0;
 }
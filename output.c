@@ -0,0 +1,280 @@
+/*
+ * Output files for 3DSCONV.
+ *
+ * Formatting a big model and writing it out take about as long as
+ * each other when the output goes to a slow disk or over the
+ * network, so the writing is done by a thread of its own: whoever
+ * is producing the output fills a buffer and hands it over with
+ * OutputBuffer(), getting back an empty one to carry on with. At
+ * most OUTQUEUE buffers wait to be written; after that the
+ * producer waits for the writer. Where there are no threads, each
+ * buffer is just written as it is handed over.
+ *
+ * A file that is already there is only replaced if the new output
+ * is different: until the output stops matching it, the writer just
+ * reads the old file and compares. So converting something again
+ * without changing it leaves the file alone (and its time stamp,
+ * which is what make and friends go by). Once the output is
+ * different, the rest of it is written over the old file from
+ * there on, and whatever is left of the old file is cut off at the
+ * end; it's the same file as before, so it keeps its permissions,
+ * owner and links. (Only ordinary files are compared; anything
+ * else, like a terminal or a pipe, is just written.)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#if defined(_WIN32) || defined(__DUMB_MSDOS__) || defined(__MSDOS__)
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+#ifdef __DUMB_MSDOS__
+#include <alloc.h>
+#define mymalloc farmalloc
+#define myrealloc farrealloc
+#define myfree farfree
+#else
+#define mymalloc malloc
+#define myrealloc realloc
+#define myfree free
+#endif
+
+#if !defined(S_ISREG) && defined(S_IFREG)
+#define S_ISREG(m)	(((m) & S_IFMT) == S_IFREG)
+#endif
+
+#include "internal.h"
+#include "proto.h"
+
+#define OUTQUEUE	4		/* most buffers waiting to be written */
+
+struct output {
+	FILE	*f;			/* the file */
+	int	existed;		/* set if it was there already */
+	int	comparing;		/* set while the output matches what's there */
+	char	*cmp;			/* buffer for reading what's there */
+	size_t	cmpsize;		/* and its size */
+	int	err;			/* set if anything went wrong */
+
+	/* shared with the writer thread; all protected by lock */
+	Thread	*thread;		/* the writer, or 0 to write as we go */
+	Mutex	*lock;
+	Cond	*cond;			/* woken whenever the queue changes */
+	char	*queue[OUTQUEUE];	/* buffers waiting to be written */
+	size_t	qlen[OUTQUEUE];		/* and how much of each is used */
+	int	first;			/* queue[first] is the next one */
+	int	count;			/* number of buffers in the queue */
+	char	*spare[OUTQUEUE+2];	/* buffers that have been written */
+	int	numspare;
+	int	numbufs;		/* buffers allocated here */
+	int	done;			/* set when no more buffers are coming */
+};
+
+/*
+ * cut f off at pos
+ * returns: 0 on success, -1 on failure
+ */
+static int
+truncfile( FILE *f, long pos )
+{
+	if (fseek(f, pos, SEEK_SET) != 0)
+		return -1;
+#if defined(_WIN32)
+	return _chsize(_fileno(f), pos);
+#elif defined(__DUMB_MSDOS__) || defined(__MSDOS__)
+	return chsize(fileno(f), pos);
+#else
+	return ftruncate(fileno(f), pos);
+#endif
+}
+
+/*
+ * write len bytes from buf (or just compare them with the old file)
+ */
+static void
+writebuf( Output *o, const char *buf, size_t len )
+{
+	char *cmp;
+	long pos;
+
+	if (o->err || len == 0)
+		return;
+	if (o->comparing) {
+		if (len > o->cmpsize) {
+			cmp = myrealloc(o->cmp, len);
+			if (cmp) {
+				o->cmp = cmp;
+				o->cmpsize = len;
+			}
+		}
+		pos = ftell(o->f);
+		if (len <= o->cmpsize && fread(o->cmp, 1, len, o->f) == len &&
+		    memcmp(o->cmp, buf, len) == 0)
+			return;
+		/* it's different after all: write the rest over it */
+		o->comparing = 0;
+		if (pos < 0 || fseek(o->f, pos, SEEK_SET) != 0) {
+			o->err = 1;
+			return;
+		}
+	}
+	if (fwrite(buf, 1, len, o->f) != len)
+		o->err = 1;
+}
+
+/*
+ * the writer thread: write buffers as they arrive, until there
+ * are no more
+ */
+static void
+writer( void *arg )
+{
+	Output *o = arg;
+	char *buf;
+	size_t len;
+
+	LockMutex(o->lock);
+	for (;;) {
+		while (o->count == 0 && !o->done)
+			WaitCond(o->cond, o->lock);
+		if (o->count == 0)
+			break;
+		buf = o->queue[o->first];
+		len = o->qlen[o->first];
+		o->first = (o->first + 1) % OUTQUEUE;
+		o->count--;
+		UnlockMutex(o->lock);
+
+		writebuf(o, buf, len);
+
+		LockMutex(o->lock);
+		o->spare[o->numspare++] = buf;
+		WakeCond(o->cond);
+	}
+	UnlockMutex(o->lock);
+}
+
+/*
+ * open file "name" for writing; binary is 1 for a binary file,
+ * 0 for a text file
+ * returns: the file, or NULL on error (which has been reported)
+ */
+Output *
+OpenOutput( char *name, int binary )
+{
+	Output *o;
+	struct stat st;
+
+	o = mymalloc(sizeof(Output));
+	if (!o) {
+		fprintf(stderr, "%s: insufficient memory\n", name);
+		return NULL;
+	}
+	memset(o, 0, sizeof(Output));
+	if (stat(name, &st) == 0 && S_ISREG(st.st_mode)) {
+		o->f = fopen(name, binary ? "r+b" : "r+");
+		o->existed = o->comparing = (o->f != 0);
+	}
+	if (!o->f) {
+		/* nothing to compare with */
+		o->f = fopen(name, binary ? "wb" : "w");
+		if (!o->f) {
+			perror(name);
+			myfree(o);
+			return NULL;
+		}
+	}
+
+	o->lock = NewMutex();
+	o->cond = NewCond();
+	if (o->lock && o->cond)
+		o->thread = StartThread(writer, o);
+	return o;
+}
+
+/*
+ * hand over the first len bytes of buf (which is "size" bytes
+ * long, the same every time) to be written
+ * returns: an empty buffer of the same size to carry on with
+ */
+char *
+OutputBuffer( Output *o, char *buf, size_t len, size_t size )
+{
+	char *next;
+
+	if (!o->thread) {
+		writebuf(o, buf, len);
+		return buf;
+	}
+	LockMutex(o->lock);
+	while (o->count == OUTQUEUE)
+		WaitCond(o->cond, o->lock);
+	o->queue[(o->first + o->count) % OUTQUEUE] = buf;
+	o->qlen[(o->first + o->count) % OUTQUEUE] = len;
+	o->count++;
+	WakeCond(o->cond);
+
+	next = 0;
+	if (o->numspare == 0 && o->numbufs < OUTQUEUE) {
+		next = mymalloc(size);
+		if (next)
+			o->numbufs++;
+	}
+	/* if there's no memory for another one, wait for ours to come back */
+	while (!next) {
+		if (o->numspare > 0)
+			next = o->spare[--o->numspare];
+		else
+			WaitCond(o->cond, o->lock);
+	}
+	UnlockMutex(o->lock);
+	return next;
+}
+
+/*
+ * wait for everything to be written, and close the file (the
+ * producer's own buffer isn't freed)
+ * returns: 0 if it was all written, -1 if not
+ */
+int
+CloseOutput( Output *o )
+{
+	long pos;
+	int ret;
+	int i;
+
+	if (o->thread) {
+		LockMutex(o->lock);
+		o->done = 1;
+		WakeCond(o->cond);
+		UnlockMutex(o->lock);
+		JoinThread(o->thread);
+	}
+	for (i = 0; i < o->numspare; i++)
+		myfree(o->spare[i]);
+	FreeCond(o->cond);
+	FreeMutex(o->lock);
+	myfree(o->cmp);
+
+	if (o->existed && !o->err) {
+		/* if the old file went on for longer, cut it off */
+		pos = ftell(o->f);
+		if (!o->comparing || getc(o->f) != EOF) {
+			if (pos < 0 || truncfile(o->f, pos) != 0)
+				o->err = 1;
+		}
+	}
+	if (ferror(o->f))
+		o->err = 1;
+	if (fclose(o->f) != 0)
+		o->err = 1;
+	ret = o->err ? -1 : 0;
+	myfree(o);
+	return ret;
+}
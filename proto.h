@@ -8,29 +8,100 @@
 /* 3dsconv.c */
 void usage P_((char *errmsg));
 int main P_((int argc, char **argv));
-char *change_extension P_((char *name, char *ext));
-char *name2label P_((char *));
-int write_output_file P_((char *name));
+
+/* convert.c */
+void InitConverter P_((Converter *cv));
+int ConvertFile P_((Converter *cv));
+void FreeConverter P_((Converter *cv));
+char *change_extension P_((Converter *cv, char *name, char *ext));
+char *name2label P_((Converter *cv, char *name, char *buf));
+int write_output_file P_((Converter *cv, char *name));
+int CleanupObjects P_((Converter *cv));
 
 /* 3dsfile.c */
-int read3dsfile P_((char *fname));
+int read3dsfile P_((Converter *cv, char *fname));
 
 /* lwfile.c */
-int readlwfile P_((char *fname));
+int readlwfile P_((Converter *cv, char *fname));
+
+/* mapfile.c */
+int map_file P_((char *fname, MappedFile *mf));
+void unmap_file P_((MappedFile *mf));
+
+/* emit.c */
+int InitEmitter P_((Emitter *e, Output *out));
+void EmitFlush P_((Emitter *e));
+int FinishEmitter P_((Emitter *e));
+void EmitBytes P_((Emitter *e, const void *s, size_t n));
+void EmitStr P_((Emitter *e, const char *s));
+void EmitChar P_((Emitter *e, int c));
+void EmitInt P_((Emitter *e, int x));
+void EmitHex P_((Emitter *e, unsigned x, int digits));
+void EmitFloat P_((Emitter *e, double x));
+void EmitListStart P_((Emitter *e, const char *head, const char *end, int maxitems));
+void EmitItem P_((Emitter *e));
+void EmitListEnd P_((Emitter *e));
+void EmitPrintf P_((Emitter *e, const char *fmt, ...));
+
+/* model.c */
+int SaveModel P_((Converter *cv, char *fname));
+int IsModelFile P_((char *fname));
+int LoadModel P_((Converter *cv, char *fname, int quiet));
+
+/* arena.c */
+Arena *NewArena P_((void));
+void *ArenaMalloc P_((Arena *a, size_t size));
+void *ArenaCalloc P_((Arena *a, size_t count, size_t size));
+void *ArenaRealloc P_((Arena *a, void *p, size_t size));
+void ArenaFree P_((Arena *a, void *p));
+void *ArenaAlloc P_((Arena *a, size_t size));
+char *ArenaStrdup P_((Arena *a, const char *s));
+void FreeArena P_((Arena *a));
+
+/* threads.c */
+void ParallelFor P_((int numthreads, int count, void (*func)(void *arg, int i), void *arg));
+int NumCPUs P_((void));
+Mutex *NewMutex P_((void));
+void FreeMutex P_((Mutex *m));
+void LockMutex P_((Mutex *m));
+void UnlockMutex P_((Mutex *m));
+Cond *NewCond P_((void));
+void FreeCond P_((Cond *c));
+void WaitCond P_((Cond *c, Mutex *m));
+void WakeCond P_((Cond *c));
+Thread *StartThread P_((void (*func)(void *arg), void *arg));
+void JoinThread P_((Thread *t));
+
+/* output.c */
+Output *OpenOutput P_((char *name, int binary));
+char *OutputBuffer P_((Output *o, char *buf, size_t len, size_t size));
+int CloseOutput P_((Output *o));
 
 /* internal.c */
-void AddMaterial P_((Material *mat));
-int GetMaterial P_((char *name));
-void AddVertex P_((Object *obj, Vertex *vert));
-void AddPolygon P_((Object *obj, Polygon *p));
-void CalcFaceNormal P_((Object *obj, Polygon *P));
-void CalcVertexNormals P_((Object *obj));
-void MergeVertices P_((Object *obj));
-void MergeFaces P_((Object *obj));
-void CheckUncoloredFaces P_((Object *obj));
-Object *CreateObject P_((char *name));
-Object *FindObject P_((char *name));
-Object *FixObjectLists P_((void));
+int AddMaterial P_((Converter *cv, Material *mat));
+int FindMaterial P_((Converter *cv, char *name));
+int GetMaterial P_((Converter *cv, char *name));
+int ReserveVertices P_((Object *obj, int count));
+int ReservePolygons P_((Object *obj, int count, int corners));
+void GetVertex P_((Object *obj, int i, Vertex *vert));
+void SetVertex P_((Object *obj, int i, Vertex *vert));
+int AddVertex P_((Object *obj, Vertex *vert));
+int AllocVertices P_((Object *obj, int count));
+void FreeGeometry P_((Object *obj));
+int CheckGeometry P_((Object *obj));
+int AddPolygon P_((Object *obj, Polygon *p));
+void GetPolygon P_((Object *obj, int i, Polygon *p));
+int SetPolygon P_((Object *obj, int i, Polygon *p));
+void CompactFaces P_((Object *obj));
+void CalcFaceNormals P_((Object *obj, int first, int numthreads));
+void CalcVertexNormals P_((Object *obj, int numthreads));
+void MergeVertices P_((Object *obj, int numthreads));
+void MergeFaces P_((Object *obj, int numthreads));
+int CheckUncoloredFaces P_((Converter *cv));
+Object *CreateObject P_((Converter *cv, char *name));
+void ClearModel P_((Converter *cv));
+Object *FindObject P_((Converter *cv, char *name));
+Object *FixObjectLists P_((Converter *cv));
 Matrix MMult(Matrix A, Matrix B);
 Matrix MatInv(Matrix M);
 #if !defined(atarist) && !defined(_WIN32)
@@ -38,19 +109,36 @@ double rint P_((double));
 #endif
 
 /* jagout.c */
-int JAGwritefile P_((FILE *f, Object *));
+int JAGwritefile P_((Converter *cv, Emitter *e, Object *));
 
 /* n3dout.c */
 unsigned rgb2cry P_((int red, int green, int blue));
-int N3Dwritefile P_((FILE *f, Object *));
+int N3Dwritefile P_((Converter *cv, Emitter *e, Object *));
+
+/* binout.c */
+int BINwritefile P_((Converter *cv, char *fname));
+int BINwritestub P_((Converter *cv, char *fname));
 
 /* cout.c */
-int Cwritefile P_((FILE *f, Object *));
+int Cwritefile P_((Converter *cv, Emitter *e, Object *));
 
 /* cfout.c */
-int CFwritefile P_((FILE *f, Object *));
+int CFwritefile P_((Converter *cv, Emitter *e, Object *));
 
 /* targa.c */
-int read_targa P_((Material *mat, int colrflag ));
+int read_targa P_((Converter *cv, Material *mat, int colrflag ));
+FILE *open_texture P_((char *dir, char *texmap, char *path));
+TexCache *NewTexCache P_((void));
+void FreeTexCache P_((TexCache *tc));
+
+/* cache.c */
+int CacheAddTexture P_((Converter *cv, char *texmap));
+int CacheLookup P_((Converter *cv, char *filetype));
+void CacheStore P_((Converter *cv));
+int CacheLoadModel P_((Converter *cv));
+void CacheSaveModel P_((Converter *cv));
+void CacheGeometryKey P_((Object *obj, const void *data, long length, double scale, int *mats, int nmats));
+int CacheLoadGeometry P_((Object *obj));
+void CacheSaveGeometry P_((Object *obj));
 
 #undef P_
@@ -10,7 +10,185 @@
 #ifndef _WIN32
 #include <dirent.h>
 #endif
+
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#define USE_WIN32_THREADS
+#elif !defined(__DUMB_MSDOS__) && !defined(__MSDOS__) && !defined(NO_THREADS)
+#include <pthread.h>
+#define USE_PTHREADS
+#endif
+
+#ifdef __DUMB_MSDOS__
+#include <alloc.h>
+#define mymalloc farmalloc
+#define myfree farfree
+#else
+#define mymalloc malloc
+#define myfree free
+#endif
+
 #include "internal.h"
+#include "proto.h"
+
+/*
+ * Many models share the same textures, so when several files
+ * are converted in one run we remember what we found out about
+ * each .TGA file, and read it only once. Conversions running in
+ * different threads share the cache, so it has a lock.
+ * Only successful reads are remembered; a missing or bad file
+ * is tried again (and complained about again) each time, just
+ * as if the files had been converted one at a time.
+ */
+#define TEXCACHE_SIZE	256		/* number of hash buckets */
+
+typedef struct texentry {
+	struct texentry *next;		/* next entry in the same bucket */
+	int colrflag;			/* 1 if the average color is known */
+	int twidth, theight;		/* size of the texture */
+	int red, green, blue;		/* average color, if colrflag is set */
+	char name[1];			/* file name (more space is allocated) */
+} TexEntry;
+
+struct texcache {
+	TexEntry *bucket[TEXCACHE_SIZE];
+#if defined(USE_PTHREADS)
+	pthread_mutex_t lock;
+#elif defined(USE_WIN32_THREADS)
+	SRWLOCK lock;
+#endif
+};
+
+#if defined(USE_PTHREADS)
+#define LOCK(tc)	pthread_mutex_lock(&(tc)->lock)
+#define UNLOCK(tc)	pthread_mutex_unlock(&(tc)->lock)
+#elif defined(USE_WIN32_THREADS)
+#define LOCK(tc)	AcquireSRWLockExclusive(&(tc)->lock)
+#define UNLOCK(tc)	ReleaseSRWLockExclusive(&(tc)->lock)
+#else
+#define LOCK(tc)
+#define UNLOCK(tc)
+#endif
+
+/*
+ * make a new, empty texture cache; returns NULL if there's no memory
+ */
+TexCache *
+NewTexCache(void)
+{
+	TexCache *tc;
+	int i;
+
+	tc = mymalloc(sizeof(TexCache));
+	if (!tc)
+		return NULL;
+	for (i = 0; i < TEXCACHE_SIZE; i++)
+		tc->bucket[i] = NULL;
+#if defined(USE_PTHREADS)
+	pthread_mutex_init(&tc->lock, NULL);
+#elif defined(USE_WIN32_THREADS)
+	InitializeSRWLock(&tc->lock);
+#endif
+	return tc;
+}
+
+void
+FreeTexCache(TexCache *tc)
+{
+	TexEntry *e, *next;
+	int i;
+
+	if (!tc)
+		return;
+	for (i = 0; i < TEXCACHE_SIZE; i++) {
+		for (e = tc->bucket[i]; e; e = next) {
+			next = e->next;
+			myfree(e);
+		}
+	}
+#if defined(USE_PTHREADS)
+	pthread_mutex_destroy(&tc->lock);
+#endif
+	myfree(tc);
+}
+
+static unsigned
+texhash(char *name)
+{
+	unsigned h = 0;
+
+	while (*name)
+		h = h*31 + (unsigned char)*name++;
+	return h % TEXCACHE_SIZE;
+}
+
+/*
+ * look up a texture in the cache, and fill in the material from it
+ * returns: 1 if it was found, 0 if not
+ */
+static int
+lookup_texture(TexCache *tc, char *name, Material *mat, int colrflag)
+{
+	TexEntry *e;
+	int found = 0;
+
+	LOCK(tc);
+	for (e = tc->bucket[texhash(name)]; e; e = e->next) {
+		if (!strcmp(e->name, name)) {
+			if (e->colrflag >= colrflag) {
+				mat->twidth = e->twidth;
+				mat->theight = e->theight;
+				if (colrflag) {
+					mat->red = e->red;
+					mat->green = e->green;
+					mat->blue = e->blue;
+				}
+				found = 1;
+			}
+			break;
+		}
+	}
+	UNLOCK(tc);
+	return found;
+}
+
+/*
+ * remember what we found out about a texture; if there's no
+ * memory for it, we just don't
+ */
+static void
+save_texture(TexCache *tc, char *name, Material *mat, int colrflag)
+{
+	TexEntry *e;
+	unsigned h = texhash(name);
+
+	LOCK(tc);
+	for (e = tc->bucket[h]; e; e = e->next) {
+		if (!strcmp(e->name, name))
+			break;
+	}
+	if (!e) {
+		e = mymalloc(sizeof(TexEntry) + strlen(name));
+		if (!e) {
+			UNLOCK(tc);
+			return;
+		}
+		strcpy(e->name, name);
+		e->colrflag = -1;
+		e->next = tc->bucket[h];
+		tc->bucket[h] = e;
+	}
+	if (colrflag > e->colrflag) {
+		e->colrflag = colrflag;
+		e->twidth = mat->twidth;
+		e->theight = mat->theight;
+		e->red = mat->red;
+		e->green = mat->green;
+		e->blue = mat->blue;
+	}
+	UNLOCK(tc);
+}
 
 
 /*
@@ -19,78 +197,148 @@
  * corresponding material structure
  *
  * Parameters:
+ *	cv:		the conversion; cv->filepath gives the path
+ *			where the .3ds file lives
  *	mat:		pointer to the material
  *	colr:		0 if the color fields are not to be manipulated
  *			1 if the average texture color is to be
  *			  filled in
- * Global variables:
- *	filepath:	string giving the path where the .3ds file
- *			lives
  * Returns:
  * 0 on success
  * -1 if unable to read the .TGA file
  *    in the latter case, an error message is printed here
  */
 
-extern char *filepath;
-
 typedef struct pixel {
 	unsigned char red;
 	unsigned char green;
 	unsigned char blue;
 } Pixel;
 
-/* State info for reading RLE-coded pixels; both counts must be init to 0 */
-static int block_count;		/* # of pixels remaining in RLE block */
-static int dup_pixel_count;	/* # of times to duplicate previous pixel */
-
-static char tga_pixel[4];
+/* a .TGA file being read, and the state info for reading RLE-coded pixels */
+typedef struct tgafile {
+	FILE *fhandle;
+	int block_count;	/* # of pixels remaining in RLE block */
+	int dup_pixel_count;	/* # of times to duplicate previous pixel */
+	char tga_pixel[4];
+} TgaFile;
 
 /*
  * read_rle_pixel: read a pixel from an RLE encoded .TGA file
  */
 static void
-read_rle_pixel(FILE *fhandle, Pixel *place)
+read_rle_pixel(TgaFile *tf, Pixel *place)
 {
+	FILE *fhandle = tf->fhandle;
 	int i;
 
 	/* if we're in the middle of reading a duplicate pixel */
-	if (dup_pixel_count > 0) {
-		dup_pixel_count--;
-		place->blue = tga_pixel[0];
-		place->green = tga_pixel[1];
-		place->red = tga_pixel[2];
+	if (tf->dup_pixel_count > 0) {
+		tf->dup_pixel_count--;
+		place->blue = tf->tga_pixel[0];
+		place->green = tf->tga_pixel[1];
+		place->red = tf->tga_pixel[2];
 		return;
 	}
 	/* should we read an RLE block header? */
-	if (--block_count < 0) {
+	if (--tf->block_count < 0) {
 		i = fgetc(fhandle);
 		if (i < 0) return;			/* end of file */
 		if (i & 0x80) {
-			dup_pixel_count = i & 0x7f;	/* number of duplications after this one */
-			block_count = 0;		/* then a new block header */
+			tf->dup_pixel_count = i & 0x7f;	/* number of duplications after this one */
+			tf->block_count = 0;		/* then a new block header */
 		} else {
-			block_count = i & 0x7f;		/* this many unduplicated pixels */
+			tf->block_count = i & 0x7f;	/* this many unduplicated pixels */
 		}
 	}
-	place->blue = tga_pixel[0] = fgetc(fhandle);
-	place->green = tga_pixel[1] = fgetc(fhandle);
-	place->red = tga_pixel[2] = fgetc(fhandle);
+	place->blue = tf->tga_pixel[0] = fgetc(fhandle);
+	place->green = tf->tga_pixel[1] = fgetc(fhandle);
+	place->red = tf->tga_pixel[2] = fgetc(fhandle);
 }
 
 /*
  * read a pixel from an uncompressed .TGA file
  */
 static void
-read_norm_pixel(FILE *fhandle, Pixel *place)
+read_norm_pixel(TgaFile *tf, Pixel *place)
 {
+	FILE *fhandle = tf->fhandle;
+
 	place->blue = fgetc(fhandle);
 	place->green = fgetc(fhandle);
 	place->red = fgetc(fhandle);
 }
 
+static int read_targa_file(Converter *cv, Material *mat, int colrflag);
+
+/*
+ * open texture file "texmap" in directory "dir" (a path ending
+ * in a separator, or empty); if it isn't there by that name, look
+ * for it without regard to case. The name we tried last goes in
+ * "path", which must have room for FILENAME_MAX characters; the
+ * caller makes sure strlen(dir) + strlen(texmap) is less than that.
+ * Returns the open file, or NULL if it can't be opened.
+ */
+FILE *
+open_texture( char *dir, char *texmap, char *path )
+{
+	FILE *fhandle;
+
+	strcpy(path, dir);
+	strcat(path, texmap);
+	fhandle = fopen(path, "rb");
+#ifndef _WIN32
+	if (!fhandle) {
+		/* Do a case insensitive search for the file */
+		DIR *d = opendir(strlen(dir) ? dir : ".");
+		if (d) {
+			struct dirent *de;
+			for (de = readdir(d); de; de = readdir(d)) {
+				if (strcasecmp(texmap, de->d_name)) continue;
+				if (strlen(dir) + strlen(de->d_name) >= FILENAME_MAX) break;
+				/* Match. Reconstruct path and retry open. */
+				strcpy(path, dir);
+				strcat(path, de->d_name);
+				fhandle = fopen(path, "rb");
+				break;
+			}
+			closedir(d);
+		}
+	}
+#endif
+	return fhandle;
+}
+
 int
-read_targa( Material *mat, int colrflag )
+read_targa( Converter *cv, Material *mat, int colrflag )
+{
+	char *filepath = cv->filepath;
+	char infile[FILENAME_MAX];
+
+	if (cv->cachedir)
+		CacheAddTexture(cv, mat->texmap);
+	if (strlen(filepath) + strlen(mat->texmap) >= sizeof(infile)) {
+		fprintf(stderr, "%s%s: file name too long\n", filepath, mat->texmap);
+		return -1;
+	}
+	strcpy(infile, filepath);
+	strcat(infile, mat->texmap);
+
+	if (cv->texcache && lookup_texture(cv->texcache, infile, mat, colrflag))
+		return 0;
+	if (read_targa_file(cv, mat, colrflag) != 0)
+		return -1;
+	if (cv->texcache)
+		save_texture(cv->texcache, infile, mat, colrflag);
+	return 0;
+}
+
+/*
+ * read the material's texture file (read_targa() checked the
+ * length of its name)
+ */
+static int
+read_targa_file( Converter *cv, Material *mat, int colrflag )
 {
 	uint32_t red, green, blue;
 	uint32_t numpixels;
@@ -98,40 +346,20 @@ read_targa( Material *mat, int colrflag )
 	int cmap_type;
 	int sub_type;
 	int bits_per_pixel;
-	void (*read_pixel)(FILE *fhandle, Pixel *place);
+	void (*read_pixel)(TgaFile *tf, Pixel *place);
 	Pixel pix;
+	TgaFile tf;
 
 	unsigned int image_w;			/* width of image in pixels from TGA header */
 	unsigned int image_h;			/* height of image in pixels from TGA header */
 	FILE *fhandle;
 	int c, i;
-	static char infile[256];
-
-	strcpy(infile, filepath);
-	strcat(infile, mat->texmap);
+	char infile[FILENAME_MAX];
 
-	fhandle = fopen(infile, "rb");
+	fhandle = open_texture(cv->filepath, mat->texmap, infile);
 	if (!fhandle) {
-#ifndef _WIN32
-		/* Do a case insensitive search for the file */
-		DIR *d = opendir(strlen(filepath) ? filepath : ".");
-		if (d) {
-			struct dirent *de;
-			for (de = readdir(d); de; de = readdir(d)) {
-				if (strcasecmp(mat->texmap, de->d_name)) continue;
-				/* Match. Reconstruct infile and retry open. */
-				strcpy(infile, filepath);
-				strcat(infile, de->d_name);
-				fhandle = fopen(infile, "rb");
-				break;
-			}
-			closedir(d);
-		}
-#endif
-		if (!fhandle) {
-			perror(infile);
-			return -1;
-		}
+		perror(infile);
+		return -1;
 	}
 
 	bytes_in_name = fgetc(fhandle);
@@ -175,8 +403,8 @@ read_targa( Material *mat, int colrflag )
 /* figure out how to read source pixels */
 	if (sub_type > 8) {
 	/* an RLE-coded file */
-		block_count = 0;
-		dup_pixel_count = 0;
+		tf.block_count = 0;
+		tf.dup_pixel_count = 0;
 		read_pixel = read_rle_pixel;
 		sub_type -= 8;
 	} else {
@@ -205,10 +433,11 @@ read_targa( Material *mat, int colrflag )
 		}
 	}
 
+	tf.fhandle = fhandle;
 	numpixels = image_w * (uint32_t)image_h;
 	red = green = blue = 0;
 	while (numpixels > 0) {
-		read_pixel(fhandle, &pix);
+		read_pixel(&tf, &pix);
 		red += pix.red;
 		blue += pix.blue;
 		green += pix.green;
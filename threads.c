@@ -0,0 +1,435 @@
+/*
+ * Thread support for 3DSCONV.
+ *
+ * All we need is a "parallel for": run a function on every
+ * index in a range, spread out over a number of worker threads.
+ * Jobs are handed out one at a time, so uneven job sizes still
+ * keep all the workers busy. Where threads aren't available,
+ * the jobs are just run in order on the calling thread.
+ *
+ * The output writer (see output.c) also needs a thread of its own,
+ * and a condition variable to wait on; where threads aren't
+ * available, StartThread() just fails and the caller does the
+ * work itself.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#define USE_WIN32_THREADS
+#elif !defined(__DUMB_MSDOS__) && !defined(__MSDOS__) && !defined(NO_THREADS)
+#include <pthread.h>
+#include <unistd.h>
+#define USE_PTHREADS
+#endif
+
+#ifdef __DUMB_MSDOS__
+#include <alloc.h>
+#define mymalloc farmalloc
+#define myfree farfree
+#else
+#define mymalloc malloc
+#define myfree free
+#endif
+
+#include "internal.h"
+#include "proto.h"
+
+/*
+ * state shared by all the workers of one ParallelFor() call
+ */
+typedef struct pfor {
+	int count;			/* number of jobs */
+	int nextjob;			/* next job to hand out */
+	void (*func)(void *, int);	/* function to run */
+	void *arg;			/* first argument for func */
+	int threaded;			/* 1 if other threads are running jobs too */
+#if defined(USE_PTHREADS)
+	pthread_mutex_t lock;		/* protects nextjob */
+#elif defined(USE_WIN32_THREADS)
+	volatile LONG next;		/* next job, updated atomically */
+#endif
+} PFor;
+
+/*
+ * get the next job to run, or -1 if there are no more
+ */
+static int
+nextjob(PFor *pf)
+{
+	int i;
+
+	if (!pf->threaded) {
+		i = pf->nextjob++;
+	} else {
+#if defined(USE_PTHREADS)
+		pthread_mutex_lock(&pf->lock);
+		i = pf->nextjob++;
+		pthread_mutex_unlock(&pf->lock);
+#elif defined(USE_WIN32_THREADS)
+		i = (int)InterlockedIncrement(&pf->next) - 1;
+#else
+		i = pf->nextjob++;
+#endif
+	}
+	return (i < pf->count) ? i : -1;
+}
+
+static void
+runjobs(PFor *pf)
+{
+	int i;
+
+	while ((i = nextjob(pf)) >= 0)
+		(*pf->func)(pf->arg, i);
+}
+
+#if defined(USE_PTHREADS)
+static void *
+worker(void *p)
+{
+	runjobs((PFor *)p);
+	return NULL;
+}
+#elif defined(USE_WIN32_THREADS)
+static DWORD WINAPI
+worker(LPVOID p)
+{
+	runjobs((PFor *)p);
+	return 0;
+}
+#endif
+
+/*
+ * call func(arg, i) for every i from 0 to count-1, using
+ * up to "numthreads" threads; returns when all the calls
+ * have finished. The order in which the calls happen is
+ * not defined, so func must only touch data belonging to
+ * job i (or protect anything else it shares).
+ */
+void
+ParallelFor(int numthreads, int count, void (*func)(void *arg, int i), void *arg)
+{
+	PFor pf;
+	int nthreads;
+	int i;
+
+	pf.count = count;
+	pf.nextjob = 0;
+	pf.func = func;
+	pf.arg = arg;
+	pf.threaded = 0;
+
+	nthreads = (numthreads < count) ? numthreads : count;
+	if (nthreads <= 1) {
+		runjobs(&pf);
+		return;
+	}
+
+#if defined(USE_PTHREADS)
+	{
+		pthread_t *tids;
+		int started;
+
+		tids = mymalloc(nthreads * sizeof(pthread_t));
+		if (!tids) {
+			runjobs(&pf);
+			return;
+		}
+		pthread_mutex_init(&pf.lock, NULL);
+		pf.threaded = 1;
+		/* the calling thread is one of the workers */
+		for (started = 0, i = 1; i < nthreads; i++) {
+			if (pthread_create(&tids[started], NULL, worker, &pf) == 0)
+				started++;
+		}
+		runjobs(&pf);
+		for (i = 0; i < started; i++)
+			pthread_join(tids[i], NULL);
+		pthread_mutex_destroy(&pf.lock);
+		myfree(tids);
+	}
+#elif defined(USE_WIN32_THREADS)
+	{
+		HANDLE *threads;
+		int started;
+
+		threads = mymalloc(nthreads * sizeof(HANDLE));
+		if (!threads) {
+			runjobs(&pf);
+			return;
+		}
+		pf.next = 0;
+		pf.threaded = 1;
+		for (started = 0, i = 1; i < nthreads; i++) {
+			threads[started] = CreateThread(NULL, 0, worker, &pf, 0, NULL);
+			if (threads[started])
+				started++;
+		}
+		runjobs(&pf);
+		/* (one at a time: WaitForMultipleObjects() only takes 64) */
+		for (i = 0; i < started; i++) {
+			WaitForSingleObject(threads[i], INFINITE);
+			CloseHandle(threads[i]);
+		}
+		myfree(threads);
+	}
+#else
+	(void)i;
+	runjobs(&pf);
+#endif
+}
+
+/*
+ * figure out how many processors we have; this is the
+ * default number of threads
+ */
+int
+NumCPUs(void)
+{
+#if defined(USE_WIN32_THREADS)
+	SYSTEM_INFO si;
+
+	GetSystemInfo(&si);
+	return (si.dwNumberOfProcessors > 0) ? (int)si.dwNumberOfProcessors : 1;
+#elif defined(USE_PTHREADS) && defined(_SC_NPROCESSORS_ONLN)
+	long n;
+
+	n = sysconf(_SC_NPROCESSORS_ONLN);
+	return (n > 0) ? (int)n : 1;
+#else
+	return 1;
+#endif
+}
+
+/*
+ * a lock, for data that several threads may change
+ */
+struct mutex {
+#if defined(USE_PTHREADS)
+	pthread_mutex_t lock;
+#elif defined(USE_WIN32_THREADS)
+	SRWLOCK lock;
+#else
+	int unused;
+#endif
+};
+
+/*
+ * make a new lock; returns NULL if there's no memory
+ */
+Mutex *
+NewMutex(void)
+{
+	Mutex *m;
+
+	m = mymalloc(sizeof(Mutex));
+	if (!m)
+		return NULL;
+#if defined(USE_PTHREADS)
+	pthread_mutex_init(&m->lock, NULL);
+#elif defined(USE_WIN32_THREADS)
+	InitializeSRWLock(&m->lock);
+#endif
+	return m;
+}
+
+void
+FreeMutex(Mutex *m)
+{
+	if (!m)
+		return;
+#if defined(USE_PTHREADS)
+	pthread_mutex_destroy(&m->lock);
+#endif
+	myfree(m);
+}
+
+void
+LockMutex(Mutex *m)
+{
+#if defined(USE_PTHREADS)
+	pthread_mutex_lock(&m->lock);
+#elif defined(USE_WIN32_THREADS)
+	AcquireSRWLockExclusive(&m->lock);
+#else
+	(void)m;
+#endif
+}
+
+void
+UnlockMutex(Mutex *m)
+{
+#if defined(USE_PTHREADS)
+	pthread_mutex_unlock(&m->lock);
+#elif defined(USE_WIN32_THREADS)
+	ReleaseSRWLockExclusive(&m->lock);
+#else
+	(void)m;
+#endif
+}
+
+/*
+ * a condition variable: a thread holding a lock can wait on it until
+ * some other thread changes what the lock protects
+ */
+struct cond {
+#if defined(USE_PTHREADS)
+	pthread_cond_t cond;
+#elif defined(USE_WIN32_THREADS)
+	CONDITION_VARIABLE cond;
+#else
+	int unused;
+#endif
+};
+
+/*
+ * make a new condition variable; returns NULL if there's no memory
+ */
+Cond *
+NewCond(void)
+{
+	Cond *c;
+
+	c = mymalloc(sizeof(Cond));
+	if (!c)
+		return NULL;
+#if defined(USE_PTHREADS)
+	pthread_cond_init(&c->cond, NULL);
+#elif defined(USE_WIN32_THREADS)
+	InitializeConditionVariable(&c->cond);
+#endif
+	return c;
+}
+
+void
+FreeCond(Cond *c)
+{
+	if (!c)
+		return;
+#if defined(USE_PTHREADS)
+	pthread_cond_destroy(&c->cond);
+#endif
+	myfree(c);
+}
+
+/*
+ * unlock m, wait until c is woken, and lock m again (which may
+ * also happen for no reason, so check what was being waited for)
+ */
+void
+WaitCond(Cond *c, Mutex *m)
+{
+#if defined(USE_PTHREADS)
+	pthread_cond_wait(&c->cond, &m->lock);
+#elif defined(USE_WIN32_THREADS)
+	SleepConditionVariableSRW(&c->cond, &m->lock, INFINITE, 0);
+#else
+	(void)c;
+	(void)m;
+#endif
+}
+
+/*
+ * wake every thread waiting on c
+ */
+void
+WakeCond(Cond *c)
+{
+#if defined(USE_PTHREADS)
+	pthread_cond_broadcast(&c->cond);
+#elif defined(USE_WIN32_THREADS)
+	WakeAllConditionVariable(&c->cond);
+#else
+	(void)c;
+#endif
+}
+
+/*
+ * a thread running a function
+ */
+struct thread {
+#if defined(USE_PTHREADS)
+	pthread_t tid;
+#elif defined(USE_WIN32_THREADS)
+	HANDLE handle;
+#endif
+	void (*func)(void *);		/* function to run */
+	void *arg;			/* and its argument */
+};
+
+#if defined(USE_PTHREADS)
+static void *
+runthread(void *p)
+{
+	Thread *t = p;
+
+	(*t->func)(t->arg);
+	return NULL;
+}
+#elif defined(USE_WIN32_THREADS)
+static DWORD WINAPI
+runthread(LPVOID p)
+{
+	Thread *t = p;
+
+	(*t->func)(t->arg);
+	return 0;
+}
+#endif
+
+/*
+ * call func(arg) on a new thread
+ * returns: the thread, or NULL if it couldn't be started (or
+ * there are no threads), in which case func hasn't been called
+ */
+Thread *
+StartThread(void (*func)(void *arg), void *arg)
+{
+#if defined(USE_PTHREADS) || defined(USE_WIN32_THREADS)
+	Thread *t;
+
+	t = mymalloc(sizeof(Thread));
+	if (!t)
+		return NULL;
+	t->func = func;
+	t->arg = arg;
+#if defined(USE_PTHREADS)
+	if (pthread_create(&t->tid, NULL, runthread, t) != 0) {
+		myfree(t);
+		return NULL;
+	}
+#else
+	t->handle = CreateThread(NULL, 0, runthread, t, 0, NULL);
+	if (!t->handle) {
+		myfree(t);
+		return NULL;
+	}
+#endif
+	return t;
+#else
+	(void)func;
+	(void)arg;
+	return NULL;
+#endif
+}
+
+/*
+ * wait for a thread started by StartThread() to finish
+ */
+void
+JoinThread(Thread *t)
+{
+	if (!t)
+		return;
+#if defined(USE_PTHREADS)
+	pthread_join(t->tid, NULL);
+#elif defined(USE_WIN32_THREADS)
+	WaitForSingleObject(t->handle, INFINITE);
+	CloseHandle(t->handle);
+#endif
+	myfree(t);
+}